@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "core/memory.h"
+#include "core/vm.h"
+
+// Builds a binary tree of a few million objects, then reports the best of a
+// few full collections of it for each number of marking threads. Sweeping
+// takes the same time whatever the number.
+
+#define RUNS 5
+
+static const char *script = "fn node(left, right) {\n"
+							"    fn child(which) {\n"
+							"        if (which) { return left; }\n"
+							"        return right;\n"
+							"    }\n"
+							"    return child;\n"
+							"}\n"
+							"fn tree(depth) {\n"
+							"    if (depth == 0) { return 0; }\n"
+							"    return node(tree(depth - 1), tree(depth - 1));\n"
+							"}\n"
+							"let root = tree(19);\n";
+
+static const int threads[] = {1, 2, 4, 8};
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main()
+{
+	init_vm(NULL);
+	vm.cache = false;
+	if (interpret(script) != INTERPRET_OK) {
+		free_vm();
+		return EXIT_FAILURE;
+	}
+	collect_garbage();
+	printf("%.1f MB live\n", (double)vm.bytesAllocated / (1024 * 1024));
+
+	for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+		vm.gcThreads = threads[i];
+		double best = 0;
+		for (int run = 0; run < RUNS; run++) {
+			double start = now();
+			collect_garbage();
+			double seconds = now() - start;
+			if (run == 0 || seconds < best)
+				best = seconds;
+		}
+		printf("%d threads: %.2f ms\n", threads[i], best * 1000);
+	}
+
+	free_vm();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "core/scanner.h"
+
+// Scans a generated source of several megabytes and reports the best of a few
+// runs in tokens per second.
+
+#define SOURCE_SIZE (8 * 1024 * 1024)
+#define RUNS 5
+
+static const char *snippet = "// Generated helper, as a code generator would emit it.\n"
+							 "fn generated_helper_function(argument, other_argument) {\n"
+							 "    let accumulated_value = 0;\n"
+							 "    for (let index = 0; index < 1000; index = index + 1) {\n"
+							 "        if (argument % 2 == 0 or not other_argument) {\n"
+							 "            accumulated_value = accumulated_value + index * 3.14159;\n"
+							 "        } else {\n"
+							 "            print(\"a fairly long string literal from a data table\");\n"
+							 "        }\n"
+							 "    }\n"
+							 "    return accumulated_value;\n"
+							 "}\n\n";
+
+int main()
+{
+	size_t snippetLength = strlen(snippet);
+	size_t copies = SOURCE_SIZE / snippetLength;
+	char *source = malloc(copies * snippetLength + 1);
+	for (size_t i = 0; i < copies; i++) {
+		memcpy(source + i * snippetLength, snippet, snippetLength);
+	}
+	source[copies * snippetLength] = '\0';
+
+	double best = 0;
+	long tokens = 0;
+	for (int run = 0; run < RUNS; run++) {
+		Scanner scanner;
+		init_scanner(&scanner, source);
+
+		clock_t start = clock();
+		tokens = 0;
+		for (;;) {
+			Token token = scan_token(&scanner);
+			if (token.type == TOKEN_EOF)
+				break;
+			tokens++;
+		}
+		double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		if (run == 0 || seconds < best)
+			best = seconds;
+	}
+
+	double megabytes = (double)(copies * snippetLength) / (1024 * 1024);
+	printf("%ld tokens in %.2f MB\n", tokens, megabytes);
+	printf("%.2f ms, %.1f M tokens/s, %.1f MB/s\n", best * 1000, tokens / best / 1e6, megabytes / best);
+
+	free(source);
+	return EXIT_SUCCESS;
+}
@@ -10,6 +10,15 @@ struct options {
 	bool help;
 	bool version;
 	bool use_colors;
+	int optimize;
+	bool lazy;
+	bool time;
+	bool cache;
+	long gc_step;
+	bool gc_concurrent;
+	int gc_threads;
+	bool gc_compact;
+	long heap_limit;
 	char file_name[FILE_NAME_SIZE];
 };
 
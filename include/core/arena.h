@@ -0,0 +1,21 @@
+#ifndef emo_core_arena_h
+#define emo_core_arena_h
+
+#include "core/common.h"
+#include "core/object.h"
+
+// One block holding the code and position tables of a whole tree of functions,
+// freed along with the last of them.
+typedef struct CodeArena {
+	int functionCount;
+	size_t size;
+	uint8_t bytes[];
+} CodeArena;
+
+// Moves the code and position tables of `function` and every function nested in it
+// into a new arena, and trims their constant pools to size.
+void pack_function(ObjFunction *function);
+// Called as a packed function is freed.
+void release_arena(CodeArena *arena);
+
+#endif
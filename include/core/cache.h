@@ -0,0 +1,23 @@
+#ifndef emo_core_cache_h
+#define emo_core_cache_h
+
+#include "core/common.h"
+#include "core/object.h"
+
+// Bump whenever the bytecode or the file layout changes.
+#define CACHE_VERSION 6
+
+uint64_t hash_source(const char *source);
+// Where the cache of the script at the `length` bytes of `path` goes: "x.emo"
+// is cached in "x.emoc", anything else gets ".emoc" appended. Free the result,
+// which is terminated, with FREE_ARRAY().
+char *cache_path(const char *path, size_t length);
+
+// Returns NULL unless `path` holds a cache of the same version, optimization
+// level and source hash, whose payload matches its checksum and whose code only
+// uses the slots `module` has.
+ObjFunction *load_cache(const char *path, ObjModule *module, uint64_t sourceHash);
+// Fails for scripts that still have lazily compiled bodies.
+bool write_cache(const char *path, ObjFunction *function, uint64_t sourceHash);
+
+#endif
@@ -2,6 +2,7 @@
 #define emo_core_chunk_h
 
 #include "core/common.h"
+#include "core/table.h"
 #include "core/value.h"
 
 typedef enum {
@@ -17,10 +18,14 @@ typedef enum {
 	OP_SET_GLOBAL,
 	OP_GET_UPVALUE,
 	OP_SET_UPVALUE,
+	OP_GET_MODULE,
+	OP_DEFINE_MODULE,
+	OP_SET_MODULE,
 	OP_EQUAL,
 	OP_GREATER,
 	OP_LESS,
 	OP_ADD,
+	OP_ADD_MANY, // Adds its operand count of values, left to right.
 	OP_MULTIPLY,
 	OP_DIVIDE,
 	OP_MODULO,
@@ -35,41 +40,69 @@ typedef enum {
 	OP_CLOSURE,
 	OP_CLOSE_UPVALUE,
 	OP_CONSTANT_LONG,
+	OP_WIDE, // The next instruction's operands are 24-bit, little-endian.
 	OP_RETURN,
+	OP_END_MODULE, // Returns from a module's top-level code, without a result.
 } OpCode;
 
+// The source position of the bytes from `offset` up to the next run.
 typedef struct {
-	int linemark;
 	int offset;
-} LineRecord;
+	int line;
+	int column;
+} Position;
 
+// The position of every POSITION_CHECKPOINT_INTERVAL-th run, and where the run
+// after it starts in the encoded table.
+typedef struct {
+	Position position;
+	int index;
+} PositionCheckpoint;
+
+#define POSITION_CHECKPOINT_INTERVAL 16
+
+// While a chunk is written, `runs` gets an entry whenever the position changes.
+// finish_positions() then encodes each run as the varint deltas of its offset,
+// line and column, and indexes them with checkpoints for binary search.
 typedef struct {
 	int count;
 	int capacity;
-	LineRecord *linemarks;
-} LineRecordArray;
+	Position *runs;
+	int size;
+	uint8_t *data;
+	int checkpointCount;
+	PositionCheckpoint *checkpoints;
+} PositionTable;
 
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t *code;
-	// int *lines;
-	LineRecordArray lines;
+	PositionTable positions;
 	ValueArray constants;
+	// The code and positions live in `arena` rather than their own allocations.
+	bool packed;
+	struct CodeArena *arena;
 } Chunk;
 
-void init_line_record_array(LineRecordArray *array);
-void write_line_record_array(LineRecordArray *array, int line);
-void encode_line_record_array(LineRecordArray *array, int line);
-void free_line_record_array(LineRecordArray *array);
-
 void init_chunk(Chunk *chunk);
-void write_chunk(Chunk *chunk, uint8_t byte, int line);
+void write_chunk(Chunk *chunk, uint8_t byte, int line, int column);
 void free_chunk(Chunk *chunk);
+void truncate_chunk(Chunk *chunk, int count);
 
 int add_constant(Chunk *chunk, Value value);
-void write_constant(Chunk *chunk, Value value, int line);
+// Like add_constant(), but numbers and strings equal to one already recorded in
+// `shared`, which maps each of them to its index, reuse its slot.
+int add_shared_constant(Chunk *chunk, Table *shared, Value value);
+void write_constant(Chunk *chunk, Value value, int line, int column);
+
+void finish_positions(Chunk *chunk);
+// Takes over encoded position data, as written by finish_positions().
+void load_positions(Chunk *chunk, uint8_t *data, int size);
+Position get_position(Chunk *chunk, int offset);
+int get_line(Chunk *chunk, int offset);
 
-int get_line(LineRecordArray *array, int offset);
+// How many values an instruction takes off the stack, and how many it puts back.
+void stack_effect(uint8_t op, uint32_t operand, int *pops, int *pushes);
 
 #endif
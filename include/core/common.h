@@ -8,5 +8,6 @@
 #include <stdint.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT24_MAX 0xffffff
 
 #endif
@@ -1,10 +1,43 @@
 #ifndef emo_core_compiler_h
 #define emo_core_compiler_h
 
+#include <time.h>
+
 #include "core/object.h"
-#include "core/vm.h"
+#include "core/scanner.h"
+
+typedef struct Compiler Compiler;
+
+// The state of one compilation. Nothing is shared between parsers except the
+// heap, so code run at compile time can start a compile of its own, but only on
+// the same thread.
+typedef struct Parser {
+	Scanner scanner;
+	Token current;
+	Token previous;
+	bool hadError;
+	bool panicMode;
+	Compiler *compiler;
+	// The module whose code is being compiled, and whose slots names resolve to.
+	ObjModule *module;
+	// Leave top-level function bodies for compile_lazy().
+	bool lazy;
+	// Let string literals point into the source instead of copying them.
+	bool borrowStrings;
+	// How many of the module's constants names can resolve to, which is fewer
+	// for a lazily compiled body than for the rest of its script.
+	int constLimit;
+	clock_t time;
+	struct Parser *next;
+} Parser;
 
-ObjFunction *compile(const char *source);
+void init_parser(Parser *parser);
+ObjFunction *compile(Parser *parser, const char *source);
+// Compiles the body of a function that was declared while lazy compilation was
+// on. The source passed to compile() must still be alive.
+bool compile_lazy(Parser *parser, ObjFunction *function);
+// Seconds spent in compile() and compile_lazy() so far.
+double compile_time(Parser *parser);
 void mark_compiler_roots();
 
 #endif
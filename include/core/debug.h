@@ -3,7 +3,7 @@
 
 #include "core/chunk.h"
 
-void disassemble_chunk(Chunk *chunk, const char *name);
+void disassemble_chunk(Chunk *chunk, ObjString *name);
 int disassemble_instruction(Chunk *chunk, int offset);
 
 #endif
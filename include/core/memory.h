@@ -2,6 +2,7 @@
 #define emo_core_memory_h
 
 #include "core/object.h"
+#include "core/vm.h"
 
 #define ALLOCATE(type, count) (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -14,10 +15,80 @@
 
 #define FREE_ARRAY(type, pointer, oldCount) reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Short-lived objects are bump-allocated in the nursery. A young collection
+// copies the ones still reachable into the old space, where collect_garbage()
+// manages them, and empties it again.
+#define NURSERY_SIZE (256 * 1024)
+// Larger objects go straight to the old space.
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+
+#define GC_THREADS_MAX 64
+
+void init_heap(const Allocator *allocator);
+// Takes memory for objects and what they own from `vm.allocator`, and counts it
+// in `vm.bytesAllocated`. The collector takes its own memory from there too.
 void *reallocate(void *previous, size_t oldSize, size_t newSize);
+// The bytes in use: objects, what they own, and the collector's own memory.
+size_t heap_size();
+// Takes a cell for an object in the old space.
+void *allocate_old(size_t size, ObjType type);
+// NULL when the object should be old instead.
+void *allocate_young(size_t size);
+void remember_object(Obj *object);
+void write_value_marking(Obj *object, Value *field, Value value);
+void write_object_marking(Obj *object, Obj **field, Obj *value);
+// Keeps marking from losing track of an object the VM took from a weak table.
+void shade_object(Obj *object);
 void mark_object(Obj *object);
+bool is_marked(Obj *object);
 void mark_value(Value value);
+void collect_young();
+// Marking runs in steps when `vm.gcStepTime` is set, or on its own thread when
+// `vm.gcConcurrent` is. This ends it at once.
+void finish_marking();
+// Finishes the collection under way, or runs a whole one.
 void collect_garbage();
+// Collects garbage, then moves the objects out of the sparsest pages of each
+// size class into the free cells of the others, and hands the emptied pages
+// back. Only call it where every object the caller needs is reachable from the
+// VM's roots; it does nothing while code is loading or the compiler evaluates.
+void compact_heap();
 void free_objects();
 
+static inline bool is_young(Obj *object)
+{
+	return (uint8_t *)object >= vm.nursery && (uint8_t *)object < vm.nurseryEnd;
+}
+
+static inline void remember_young(Obj *object, Obj *value)
+{
+	if (value != NULL && is_young(value) && !object->isRemembered && !is_young(object))
+		remember_object(object);
+}
+
+// The VM stores references into objects with these, unless the field is a
+// root. While marking is under way, the collector may be done with `object`,
+// or be reading it on its own thread; and a young collection only looks at the
+// old objects it remembers.
+static inline void write_value(Obj *object, Value *field, Value value)
+{
+	if (vm.gcPhase == GC_MARK) {
+		write_value_marking(object, field, value);
+	} else {
+		*field = value;
+	}
+	if (IS_OBJ(value))
+		remember_young(object, AS_OBJ(value));
+}
+
+static inline void write_object(Obj *object, Obj **field, Obj *value)
+{
+	if (vm.gcPhase == GC_MARK) {
+		write_object_marking(object, field, value);
+	} else {
+		*field = value;
+	}
+	remember_young(object, value);
+}
+
 #endif
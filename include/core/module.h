@@ -0,0 +1,17 @@
+#ifndef emo_core_module_h
+#define emo_core_module_h
+
+#include "core/object.h"
+
+// Returns the module at `path`, relative to the importing file, loading and
+// declaring it the first time. NULL if the file cannot be read.
+ObjModule *load_module(ObjModule *importer, const char *path, int length);
+// Like load_module(), but only finds modules that are already loaded.
+ObjModule *find_module(ObjModule *importer, const char *path, int length);
+// Gives `module` a slot for each name that `source` declares at its top level,
+// unless it is the main script, and for the names of the modules it imports.
+void declare_module(ObjModule *module, const char *source);
+// Compiles a loaded module's code, or takes it from the module's cache.
+ObjFunction *compile_module(ObjModule *module);
+
+#endif
@@ -3,16 +3,19 @@
 
 #include "core/chunk.h"
 #include "core/common.h"
+#include "core/table.h"
 #include "core/value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 #define IS_CLOSURE(value) is_obj_type(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
+#define IS_MODULE(value) is_obj_type(value, OBJ_MODULE)
 #define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
 
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_MODULE(value) ((ObjModule *)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
@@ -20,23 +23,47 @@
 typedef enum {
 	OBJ_CLOSURE,
 	OBJ_FUNCTION,
+	OBJ_MODULE,
 	OBJ_NATIVE,
 	OBJ_STRING,
 	OBJ_UPVALUE,
 } ObjType;
 
+// Eight bytes ahead of every object. Only young objects, those in the nursery,
+// use `isMarked`: old ones keep their marks in the pages that hold them. Once a
+// young collection copies a young object out, it is forwarded, and its first
+// field holds the address of the copy.
 struct sObj {
-	ObjType type;
+	uint8_t type;
 	bool isMarked;
-	struct sObj *next;
+	// An old object in `vm.remembered`, which may point at young objects.
+	bool isRemembered;
+	bool isForwarded;
+	uint32_t size;
 };
 
+typedef struct sObjClosure ObjClosure;
+typedef struct sObjModule ObjModule;
+
 typedef struct {
 	Obj obj;
 	int arity;
 	int upvalueCount;
 	Chunk chunk;
 	ObjString *name;
+	// Where its top-level names and imports are.
+	ObjModule *module;
+	// Shared by every `OP_CLOSURE` of a function that captures nothing.
+	ObjClosure *closure;
+	// A const fn, or a function inside one: it only uses its own arguments and
+	// locals, what it captures from them and constants.
+	bool pure;
+	// Until a lazily compiled body is needed, where its parameter list starts,
+	// and how many of the module's constants were declared before it.
+	const char *source;
+	int sourceLine;
+	int sourceColumn;
+	int constCount;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
@@ -46,38 +73,88 @@ typedef struct {
 	NativeFn function;
 } ObjNative;
 
+// `chars` is not terminated when the string borrows it from a Source, so
+// print it with its length.
 struct sObjString {
 	Obj obj;
-	bool ownsChars; // <--
+	bool ownsChars;
 	int length;
 	uint32_t hash;
-	// char *chars;
-	char chars[];
+	char *chars;
+	char storage[];
+};
+
+typedef enum {
+	MODULE_UNLOADED, // Imported, but its code has not run yet.
+	MODULE_RUNNING,
+	MODULE_LOADED,
+} ModuleState;
+
+typedef struct {
+	ObjString *name;
+	Value value;
+	bool defined;
+	bool constant;
+} ModuleValue;
+
+// A name that a module's code uses, and the module whose top level defines it.
+typedef struct {
+	ObjModule *owner;
+	int index;
+} ModuleSlot;
+
+// A file of code with its own top-level names. The main script is a module too,
+// but its own names stay globals, so only its imports get slots.
+struct sObjModule {
+	Obj obj;
+	ObjString *path;
+	struct Source *source;
+	ModuleState state;
+	int valueCount;
+	int valueCapacity;
+	ModuleValue *values;
+	// The values of its top-level `const` declarations in the order they were
+	// compiled, and the index of each by name.
+	ValueArray constValues;
+	Table constants;
+	// Maps every name its code can use, own names first, to an index in `slots`,
+	// or to -1 for the main script's own names.
+	Table slotNames;
+	int slotCount;
+	int slotCapacity;
+	ModuleSlot *slots;
 };
 
 typedef struct sUpvalue {
 	Obj obj;
 	Value *location;
 	Value closed;
-	struct sUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+struct sObjClosure {
 	Obj obj;
 	ObjFunction *function;
-	ObjUpvalue **upvalues;
 	int upvalueCount;
-} ObjClosure;
+	ObjUpvalue *upvalues[];
+};
 
 ObjFunction *new_function();
+ObjModule *new_module(ObjString *path);
 ObjNative *new_native(NativeFn function);
 ObjClosure *new_closure(ObjFunction *function);
 // ObjString *take_string(char *chars, int length);
 ObjString *make_string(int length);
 ObjString *copy_string(const char *chars, int length);
+// Interns a string that points at `chars` instead of copying them.
+ObjString *borrow_string(const char *chars, int length);
 ObjString *take_string(ObjString *string);
 ObjString *hash_string(ObjString *string);
 ObjUpvalue *new_upvalue(Value *slot);
+// Like make_string() and new_closure(), but in the nursery, as are upvalues. A
+// young collection moves them, so only the VM makes them, where it can find
+// them again on its stack.
+ObjString *make_young_string(int length);
+ObjClosure *new_young_closure(ObjFunction *function);
 
 void print_object(Value value);
 
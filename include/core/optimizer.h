@@ -0,0 +1,24 @@
+#ifndef emo_core_optimizer_h
+#define emo_core_optimizer_h
+
+#include "core/object.h"
+
+// -O0 leaves the bytecode as emitted, -O1 folds constants and removes dead
+// code, -O2 also threads jumps, drops redundant loads, reuses common
+// subexpressions and hoists loop invariants.
+#define OPTIMIZE_NONE 0
+#define OPTIMIZE_BASIC 1
+#define OPTIMIZE_FULL 2
+#define OPTIMIZE_DEFAULT OPTIMIZE_BASIC
+
+void set_optimize_level(int level);
+int get_optimize_level();
+
+// `constants` maps the numbers and strings in the function's pool to their
+// indices, so that folded values can reuse them.
+void optimize_function(ObjFunction *function, Table *constants);
+// Evaluates the expression compiled into `chunk` from `start` on, if it only
+// involves constants.
+bool evaluate_constant(Chunk *chunk, int start, Value *result);
+
+#endif
@@ -33,11 +33,13 @@ typedef enum {
 
 	// Keywords.
 	TOKEN_AND,
+	TOKEN_CONST,
 	TOKEN_ELSE,
 	TOKEN_FALSE,
 	TOKEN_FOR,
 	TOKEN_FN,
 	TOKEN_IF,
+	TOKEN_IMPORT,
 	TOKEN_LET,
 	TOKEN_OR,
 	TOKEN_NOT,
@@ -55,16 +57,20 @@ typedef struct {
 	const char *start;
 	int length;
 	int line;
+	int column;
 } Token;
 
 typedef struct {
 	const char *start;
 	const char *current;
+	const char *lineStart;
 	int line;
+	int column;
 } Scanner;
 
-void init_scanner(const char *source);
+void init_scanner(Scanner *scanner, const char *source);
+void seek_scanner(Scanner *scanner, const char *position, int line, int column);
 
-Token scan_token();
+Token scan_token(Scanner *scanner);
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef emo_core_source_h
+#define emo_core_source_h
+
+#include "core/common.h"
+
+// A script's text, kept until the VM is freed so that compiled code can borrow
+// from it: string constants and lazily compiled bodies point into `chars`.
+typedef struct Source {
+	struct Source *next;
+	char *path;
+	const char *chars;
+	size_t length;
+	// Mapped read-only from the file, rather than read into a buffer.
+	bool mapped;
+} Source;
+
+// Returns NULL if the file cannot be read. The `length` bytes of `path` need
+// not be terminated, since it may come from a borrowed string. The text is
+// always followed by a terminating zero byte.
+Source *load_source(const char *path, size_t length);
+void free_sources();
+
+#endif
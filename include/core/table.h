@@ -20,6 +20,9 @@ void free_table(Table *table);
 bool table_get(Table *table, Value key, Value *value);
 bool table_set(Table *table, Value key, Value value);
 bool table_delete(Table *table, Value key);
+// Stores `replacement`, which must hash like `key`, in place of it. `key` is
+// only compared, so it may be an object that has been moved.
+void table_replace_key(Table *table, Value key, Value replacement);
 // void table_add_all(Table *from, Table *to);
 ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash);
 void mark_table(Table *table);
@@ -4,19 +4,47 @@
 #include <stdint.h>
 
 #include "core/chunk.h"
+#include "core/compiler.h"
+#include "core/source.h"
 #include "core/object.h"
 #include "core/table.h"
 #include "core/value.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// How deep and how long a call that the compiler makes may run.
+#define EVAL_FRAMES_MAX 32
+#define EVAL_FUEL 1000000
 
 typedef struct {
 	ObjClosure *closure;
 	uint8_t *ip;
 	Value *slots;
+	// Open upvalues lie between these two slots, so returns and block exits
+	// only scan that span, and frames that captured nothing skip it.
+	int openUpvalueCount;
+	int lowestOpenSlot;
+	int highestOpenSlot;
 } CallFrame;
 
+// Where the VM gets all of its memory. `reallocate` works like realloc(), but
+// frees `pointer` and returns NULL when `newSize` is 0. `allocateAligned`
+// returns `size` bytes aligned on `alignment`, a power of two, which go back
+// through `freeAligned`. Each gets `userData`. Shared and concurrent marking
+// call `reallocate` from their own threads.
+typedef struct {
+	void *(*reallocate)(void *pointer, size_t oldSize, size_t newSize, void *userData);
+	void *(*allocateAligned)(size_t size, size_t alignment, void *userData);
+	void (*freeAligned)(void *pointer, size_t size, void *userData);
+	void *userData;
+} Allocator;
+
+typedef enum {
+	GC_IDLE,
+	GC_MARK,
+	GC_SWEEP,
+} GcPhase;
+
 typedef struct {
 	CallFrame frames[FRAMES_MAX];
 	int frameCount;
@@ -25,25 +53,83 @@ typedef struct {
 	Value *stack;
 	Value *stackTop;
 	int stackCapacity;
+	// Parallel to `stack`: the open upvalue capturing each slot, or NULL.
+	ObjUpvalue **openUpvalues;
 	Table globals;
+	// Every imported module, by resolved path.
+	Table modules;
+	// The module of the script or the REPL; it holds what they import.
+	ObjModule *main;
 	Table strings;
-	ObjUpvalue *openUpvalues;
-	Obj *objects;
+	uint8_t *nursery;
+	uint8_t *nurseryTop;
+	uint8_t *nurseryEnd;
+	// The old objects that young ones may be stored in.
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj **remembered;
+	Allocator allocator;
 	size_t bytesAllocated;
 	size_t nextGC;
+	// When the heap grows past this many bytes, 0 for no limit, and a whole
+	// collection cannot bring it back, `outOfMemory` is set and the VM raises a
+	// runtime error at its next loop, call or concatenation.
+	size_t heapLimit;
+	bool outOfMemory;
+	// With a step time, in microseconds, collections are incremental: marking
+	// and then sweeping take a step whenever `nextStep` is reached. Without
+	// one, marking stops the world, and pages are swept as allocation needs
+	// them or a few at a time at each `nextStep`.
+	long gcStepTime;
+	// Marking runs on a collector thread instead, from a snapshot of the roots.
+	// The old values of the fields that change meanwhile go in `satb`.
+	bool gcConcurrent;
+	int satbCount;
+	int satbCapacity;
+	Obj **satb;
+	// Marking that stops the script is shared between this many threads.
+	int gcThreads;
+	// Compact the old space when a collection leaves it fragmented. That sets
+	// `compactDue`, and the VM compacts at its next loop, call or concatenation.
+	bool gcCompact;
+	bool compactDue;
+	GcPhase gcPhase;
+	// Compiling, reading caches and declaring modules store into objects
+	// without write barriers. While one of them runs, nothing is young and
+	// marking is not under way.
+	int loading;
+	size_t nextStep;
 	int grayCount;
 	int grayCapacity;
 	Obj **grayStack;
+	Source *sources;
+	// Compiles interpret() sources, modules and the lazy function bodies in them.
+	Parser parser;
+	// Reuse and refresh the .emoc file next to each script and module.
+	bool cache;
+	// While the compiler runs a call with evaluate_call(): the frames below it,
+	// which errors leave alone, and the calls and loop iterations it has left.
+	bool evaluating;
+	int baseFrame;
+	int frameLimit;
+	uint64_t fuel;
 } VM;
 
 extern VM vm;
 
 typedef enum { INTERPRET_OK, INTERPRET_COMPILE_ERROR, INTERPRET_RUNTIME_ERROR } InterpretResult;
 
-void init_vm();
+// Takes its memory from `allocator`, or from the C library if it is NULL.
+void init_vm(const Allocator *allocator);
 void free_vm();
 
 InterpretResult interpret(const char *source);
+// Runs a script loaded with load_source(). Its string literals borrow from it.
+InterpretResult interpret_source(Source *source);
+// Calls a const fn for the compiler, on top of whatever is running. The callee
+// and its arguments are on the stack and the result replaces them, unless the
+// call fails, runs out of fuel or recurses too deep.
+bool evaluate_call(int argCount);
 void push(Value value);
 Value pop();
 
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,11 +7,23 @@
 #include "cli/messages.h"
 #include "cli/styles.h"
 
+#include "core/memory.h"
+#include "core/optimizer.h"
+
 static void set_default_options(Options *options)
 {
 	options->help = false;
 	options->version = false;
 	options->use_colors = true;
+	options->optimize = OPTIMIZE_DEFAULT;
+	options->lazy = false;
+	options->time = false;
+	options->cache = true;
+	options->gc_step = 0;
+	options->gc_concurrent = false;
+	options->gc_threads = 1;
+	options->gc_compact = false;
+	options->heap_limit = 0;
 }
 
 void switch_options(int arg, Options *options)
@@ -26,6 +39,66 @@ void switch_options(int arg, Options *options)
 		version();
 		exit(EXIT_SUCCESS);
 
+	case 'O':
+		if (strlen(optarg) != 1 || optarg[0] < '0' || optarg[0] > '2') {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		options->optimize = optarg[0] - '0';
+		break;
+
+	case 'l':
+		options->lazy = true;
+		break;
+
+	case 't':
+		options->time = true;
+		break;
+
+	case 'c':
+		options->cache = false;
+		break;
+
+	case 'g': {
+		char *end;
+		options->gc_step = strtol(optarg, &end, 10);
+		if (*optarg == '\0' || *end != '\0' || options->gc_step < 0) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		break;
+	}
+
+	case 'm':
+		options->gc_concurrent = true;
+		break;
+
+	case 'p': {
+		char *end;
+		long threads = strtol(optarg, &end, 10);
+		if (*optarg == '\0' || *end != '\0' || threads < 1 || threads > GC_THREADS_MAX) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		options->gc_threads = (int)threads;
+		break;
+	}
+
+	case 'k':
+		options->gc_compact = true;
+		break;
+
+	case 'x': {
+		char *end;
+		options->heap_limit = strtol(optarg, &end, 10);
+		if (*optarg == '\0' || *end != '\0' || options->heap_limit < 0 ||
+			(unsigned long)options->heap_limit > SIZE_MAX / (1024 * 1024)) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		break;
+	}
+
 	case 0:
 		options->use_colors = false;
 		break;
@@ -57,12 +130,21 @@ void options_parser(int argc, char *argv[], Options *options)
 	static struct option long_options[] = {
 		{"help", no_argument, 0, 'h'},
 		{"version", no_argument, 0, 'v'},
+		{"lazy", no_argument, 0, 'l'},
+		{"time", no_argument, 0, 't'},
+		{"no-cache", no_argument, 0, 'c'},
 		{"no-colors", no_argument, 0, 0},
+		{"gc-step", required_argument, 0, 'g'},
+		{"gc-concurrent", no_argument, 0, 'm'},
+		{"gc-threads", required_argument, 0, 'p'},
+		{"gc-compact", no_argument, 0, 'k'},
+		{"heap-limit", required_argument, 0, 'x'},
+		{0, 0, 0, 0},
 	};
 
 	while (true) {
 		int option_index = 0;
-		arg = getopt_long(argc, argv, "hvt:", long_options, &option_index);
+		arg = getopt_long(argc, argv, "hvlO:t", long_options, &option_index);
 		if (arg == -1)
 			break;
 		switch_options(arg, options);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "cli/args.h"
 #include "cli/messages.h"
@@ -8,6 +9,8 @@
 
 #include "core/chunk.h"
 #include "core/common.h"
+#include "core/compiler.h"
+#include "core/optimizer.h"
 #include "core/vm.h"
 
 #include "external/crossline.h"
@@ -45,42 +48,23 @@ static void run_repl()
 	crossline_history_save(history);
 }
 
-static char *read_file(const char *path)
+static void run_file(const char *path, bool time)
 {
-	FILE *file = fopen(path, "rb");
-
-	if (file == NULL) {
-		fprintf(stderr, "Could not open file \"%s\".\n", path);
-		exit(74);
-	}
-
-	fseek(file, 0L, SEEK_END);
-	size_t fileSize = ftell(file);
-	rewind(file);
-
-	char *buffer = (char *)malloc(fileSize + 1);
-	if (buffer == NULL) {
-		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-		exit(74);
-	}
-
-	size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-	if (bytesRead < fileSize) {
+	// The VM keeps the source until it is freed.
+	Source *source = load_source(path, strlen(path));
+	if (source == NULL) {
 		fprintf(stderr, "Could not read file \"%s\".\n", path);
 		exit(74);
 	}
 
-	buffer[bytesRead] = '\0';
-
-	fclose(file);
-	return buffer;
-}
+	clock_t start = clock();
+	InterpretResult result = interpret_source(source);
+	double total = (double)(clock() - start) / CLOCKS_PER_SEC;
 
-static void run_file(const char *path)
-{
-	char *source = read_file(path);
-	InterpretResult result = interpret(source);
-	free(source);
+	if (time) {
+		double compile = compile_time(&vm.parser);
+		fprintf(stderr, "compile: %.3f ms, run: %.3f ms\n", compile * 1000, (total - compile) * 1000);
+	}
 
 	if (result == INTERPRET_COMPILE_ERROR)
 		exit(65);
@@ -98,15 +82,33 @@ int main(int argc, char *argv[])
 	fprintf(stdout, BROWN "help: %d\n" NO_COLOR, options.help);
 	fprintf(stdout, BROWN "version: %d\n" NO_COLOR, options.version);
 	fprintf(stdout, BROWN "use colors: %d\n" NO_COLOR, options.use_colors);
+	fprintf(stdout, BROWN "optimize: %d\n" NO_COLOR, options.optimize);
+	fprintf(stdout, BROWN "lazy: %d\n" NO_COLOR, options.lazy);
+	fprintf(stdout, BROWN "time: %d\n" NO_COLOR, options.time);
+	fprintf(stdout, BROWN "cache: %d\n" NO_COLOR, options.cache);
+	fprintf(stdout, BROWN "gc step: %ld\n" NO_COLOR, options.gc_step);
+	fprintf(stdout, BROWN "gc concurrent: %d\n" NO_COLOR, options.gc_concurrent);
+	fprintf(stdout, BROWN "gc threads: %d\n" NO_COLOR, options.gc_threads);
+	fprintf(stdout, BROWN "gc compact: %d\n" NO_COLOR, options.gc_compact);
+	fprintf(stdout, BROWN "heap limit: %ld\n" NO_COLOR, options.heap_limit);
 	fprintf(stdout, BROWN "filename: %s\n" NO_COLOR, options.file_name);
 #endif
 
-	init_vm();
+	init_vm(NULL);
+	set_optimize_level(options.optimize);
+	vm.cache = options.cache;
+	vm.gcStepTime = options.gc_step;
+	vm.gcConcurrent = options.gc_concurrent;
+	vm.gcThreads = options.gc_threads;
+	vm.gcCompact = options.gc_compact;
+	vm.heapLimit = (size_t)options.heap_limit * 1024 * 1024;
 
-	if (argc == 1) {
+	if (strcmp(options.file_name, "-") == 0) {
 		run_repl();
-	} else if (argc == 2) {
-		run_file(options.file_name);
+	} else {
+		// The REPL reuses its line buffer, so only scripts can compile lazily.
+		vm.parser.lazy = options.lazy;
+		run_file(options.file_name, options.time);
 	}
 
 	// Chunk chunk;
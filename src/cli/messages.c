@@ -39,6 +39,15 @@ void options()
 	printf("OPTIONS: \n");
 	printf("    -v, --version           Prints %s version\n", __PROGRAM_NAME__);
 	printf("    -h, --help              Prints this help message\n");
+	printf("    -l, --lazy              Compiles function bodies on their first call\n");
+	printf("    -t, --time              Prints compile and run times when the script ends\n");
+	printf("    -O<level>               Sets the optimization level: 0, 1 (default) or 2\n");
+	printf("        --no-cache          Does not read or write the compiled .emoc cache\n");
+	printf("        --gc-step <us>      Collects garbage in steps of at most <us> microseconds\n");
+	printf("        --gc-concurrent     Marks garbage on a separate thread\n");
+	printf("        --gc-threads <n>    Shares the marking that stops the script between <n> threads\n");
+	printf("        --gc-compact        Moves objects out of sparse pages when the heap is fragmented\n");
+	printf("        --heap-limit <mb>   Stops the script with an error when its heap outgrows <mb> megabytes\n");
 	printf("        --no-color          Does not use colors/styles for printing\n\n");
 }
 
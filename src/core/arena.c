@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "core/arena.h"
+#include "core/memory.h"
+#include "core/vm.h"
+
+typedef struct {
+	int count;
+	int capacity;
+	ObjFunction **functions;
+} FunctionList;
+
+// Nested functions follow their parent in the order they are declared, which
+// keeps a function next to the helpers it is most likely to call.
+static void collect_functions(FunctionList *list, ObjFunction *function)
+{
+	if (function->source != NULL || function->chunk.packed)
+		return;
+	// Set early, since const fns can be in several constant pools.
+	function->chunk.packed = true;
+
+	if (list->capacity < list->count + 1) {
+		int oldCapacity = list->capacity;
+		list->capacity = GROW_CAPACITY(oldCapacity);
+		list->functions = GROW_ARRAY(list->functions, ObjFunction *, oldCapacity, list->capacity);
+	}
+	list->functions[list->count++] = function;
+
+	ValueArray *constants = &function->chunk.constants;
+	for (int i = 0; i < constants->count; i++) {
+		if (IS_FUNCTION(constants->values[i])) {
+			collect_functions(list, AS_FUNCTION(constants->values[i]));
+		}
+	}
+}
+
+static void shrink_constants(ValueArray *constants)
+{
+	if (constants->capacity == constants->count)
+		return;
+
+	constants->values = GROW_ARRAY(constants->values, Value, constants->capacity, constants->count);
+	constants->capacity = constants->count;
+}
+
+void pack_function(ObjFunction *function)
+{
+	push(OBJ_VAL(function));
+
+	FunctionList list = {0, 0, NULL};
+	collect_functions(&list, function);
+
+	// Checkpoints go first so that they stay aligned.
+	size_t checkpointBytes = 0;
+	size_t byteCount = 0;
+	for (int i = 0; i < list.count; i++) {
+		Chunk *chunk = &list.functions[i]->chunk;
+		checkpointBytes += sizeof(PositionCheckpoint) * chunk->positions.checkpointCount;
+		byteCount += chunk->positions.size + chunk->count;
+		shrink_constants(&chunk->constants);
+	}
+
+	if (list.count > 0) {
+		size_t size = checkpointBytes + byteCount;
+		CodeArena *arena = (CodeArena *)reallocate(NULL, 0, sizeof(CodeArena) + size);
+		arena->functionCount = list.count;
+		arena->size = size;
+
+		PositionCheckpoint *checkpoints = (PositionCheckpoint *)arena->bytes;
+		uint8_t *bytes = arena->bytes + checkpointBytes;
+		for (int i = 0; i < list.count; i++) {
+			Chunk *chunk = &list.functions[i]->chunk;
+			PositionTable *positions = &chunk->positions;
+			chunk->arena = arena;
+
+			memcpy(checkpoints, positions->checkpoints, sizeof(PositionCheckpoint) * positions->checkpointCount);
+			FREE_ARRAY(PositionCheckpoint, positions->checkpoints, positions->checkpointCount);
+			positions->checkpoints = checkpoints;
+			checkpoints += positions->checkpointCount;
+
+			memcpy(bytes, positions->data, positions->size);
+			FREE_ARRAY(uint8_t, positions->data, positions->size);
+			positions->data = bytes;
+			bytes += positions->size;
+
+			memcpy(bytes, chunk->code, chunk->count);
+			FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+			chunk->code = bytes;
+			chunk->capacity = chunk->count;
+			bytes += chunk->count;
+		}
+	}
+
+	FREE_ARRAY(ObjFunction *, list.functions, list.capacity);
+	pop();
+}
+
+void release_arena(CodeArena *arena)
+{
+	if (--arena->functionCount == 0)
+		reallocate(arena, sizeof(CodeArena) + arena->size, 0);
+}
@@ -0,0 +1,639 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "core/arena.h"
+#include "core/cache.h"
+#include "core/chunk.h"
+#include "core/memory.h"
+#include "core/optimizer.h"
+#include "core/vm.h"
+
+// A cache file is the header below followed by the script function. Every
+// integer is little-endian, so caches do not depend on the host.
+//
+//   "EMOC" u32:version u32:optimizeLevel u64:sourceHash u64:checksum function
+//
+//   The checksum is the FNV-1a hash of everything after it, so that a damaged
+//   file is compiled again rather than run.
+//
+//   function: u32:arity u32:upvalueCount string:name
+//             u32:count bytes:code
+//             u32:count bytes:positions
+//             u32:count constant*
+//   constant: u8:tag, then a u64 number, a u8 bool, a string or a function
+//   string:   u32:length bytes, or UINT32_MAX for no string
+
+#define CACHE_MAGIC "EMOC"
+#define NO_STRING UINT32_MAX
+
+typedef enum { TAG_BOOL, TAG_NUMBER, TAG_META, TAG_STRING, TAG_FUNCTION } ConstantTag;
+
+#define FNV_OFFSET 14695981039346656037u
+#define FNV_PRIME 1099511628211u
+#define CHECKSUM_OFFSET 20 // Just after the source hash.
+
+uint64_t hash_source(const char *source)
+{
+	uint64_t hash = FNV_OFFSET;
+
+	for (const char *c = source; *c != '\0'; c++) {
+		hash ^= (uint8_t)*c;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *bytes, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+char *cache_path(const char *path, size_t length)
+{
+	const char *suffix = length > 4 && memcmp(path + length - 4, ".emo", 4) == 0 ? "c" : ".emoc";
+	char *cachePath = ALLOCATE(char, length + strlen(suffix) + 1);
+	memcpy(cachePath, path, length);
+	strcpy(cachePath + length, suffix);
+	return cachePath;
+}
+
+typedef struct {
+	FILE *file;
+	uint64_t checksum; // Of what has been written since it was reset.
+} Writer;
+
+static void write_bytes(Writer *writer, const void *bytes, size_t count)
+{
+	fwrite(bytes, 1, count, writer->file);
+	writer->checksum = hash_bytes(writer->checksum, bytes, count);
+}
+
+static void write_u8(Writer *writer, uint8_t value)
+{
+	write_bytes(writer, &value, 1);
+}
+
+static void write_u32(Writer *writer, uint32_t value)
+{
+	uint8_t bytes[4];
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (value >> (8 * i)) & 0xff;
+	}
+	write_bytes(writer, bytes, 4);
+}
+
+static void write_u64(Writer *writer, uint64_t value)
+{
+	write_u32(writer, (uint32_t)value);
+	write_u32(writer, (uint32_t)(value >> 32));
+}
+
+static void write_string(Writer *writer, ObjString *string)
+{
+	if (string == NULL) {
+		write_u32(writer, NO_STRING);
+		return;
+	}
+	write_u32(writer, string->length);
+	write_bytes(writer, string->chars, string->length);
+}
+
+static bool write_function(Writer *writer, ObjFunction *function)
+{
+	if (function->source != NULL)
+		return false;
+
+	Chunk *chunk = &function->chunk;
+	write_u32(writer, function->arity);
+	write_u32(writer, function->upvalueCount);
+	write_string(writer, function->name);
+
+	write_u32(writer, chunk->count);
+	write_bytes(writer, chunk->code, chunk->count);
+
+	write_u32(writer, chunk->positions.size);
+	write_bytes(writer, chunk->positions.data, chunk->positions.size);
+
+	write_u32(writer, chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count; i++) {
+		Value value = chunk->constants.values[i];
+		switch (value.type) {
+		case VAL_BOOL:
+			write_u8(writer, TAG_BOOL);
+			write_u8(writer, AS_BOOL(value));
+			break;
+		case VAL_NUMBER: {
+			double number = AS_NUMBER(value);
+			uint64_t bits;
+			memcpy(&bits, &number, sizeof(bits));
+			write_u8(writer, TAG_NUMBER);
+			write_u64(writer, bits);
+			break;
+		}
+		case VAL_META:
+			write_u8(writer, TAG_META);
+			break;
+		case VAL_OBJ:
+			if (IS_STRING(value)) {
+				write_u8(writer, TAG_STRING);
+				write_string(writer, AS_STRING(value));
+			} else if (IS_FUNCTION(value)) {
+				write_u8(writer, TAG_FUNCTION);
+				if (!write_function(writer, AS_FUNCTION(value)))
+					return false;
+			} else {
+				return false;
+			}
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool write_cache(const char *path, ObjFunction *function, uint64_t sourceHash)
+{
+	// Write next to the cache and rename, so a concurrent run never maps a
+	// half-written file.
+	char temp[FILENAME_MAX];
+	if (snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid()) >= (int)sizeof(temp))
+		return false;
+
+	FILE *file = fopen(temp, "wb");
+	if (file == NULL)
+		return false;
+
+	Writer writer = {file, 0};
+	write_bytes(&writer, CACHE_MAGIC, 4);
+	write_u32(&writer, CACHE_VERSION);
+	write_u32(&writer, get_optimize_level());
+	write_u64(&writer, sourceHash);
+	write_u64(&writer, 0);
+
+	writer.checksum = FNV_OFFSET;
+	bool written = write_function(&writer, function);
+	if (written && fseek(file, CHECKSUM_OFFSET, SEEK_SET) == 0) {
+		write_u64(&writer, writer.checksum);
+	} else {
+		written = false;
+	}
+
+	if (fclose(file) != 0 || !written || rename(temp, path) != 0) {
+		remove(temp);
+		return false;
+	}
+	return true;
+}
+
+typedef struct {
+	const uint8_t *current;
+	const uint8_t *end;
+	// The module the code will run in, whose slots its module operands index.
+	ObjModule *module;
+	bool failed;
+} Reader;
+
+static const uint8_t *read_bytes(Reader *reader, size_t count)
+{
+	if (reader->failed || (size_t)(reader->end - reader->current) < count) {
+		reader->failed = true;
+		return NULL;
+	}
+
+	const uint8_t *bytes = reader->current;
+	reader->current += count;
+	return bytes;
+}
+
+static uint8_t read_u8(Reader *reader)
+{
+	const uint8_t *bytes = read_bytes(reader, 1);
+	return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t read_u32(Reader *reader)
+{
+	const uint8_t *bytes = read_bytes(reader, 4);
+	if (bytes == NULL)
+		return 0;
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t read_u64(Reader *reader)
+{
+	uint64_t low = read_u32(reader);
+	return low | ((uint64_t)read_u32(reader) << 32);
+}
+
+// Strings are interned straight from the mapping.
+static ObjString *read_string(Reader *reader)
+{
+	uint32_t length = read_u32(reader);
+	if (length == NO_STRING)
+		return NULL;
+
+	const uint8_t *chars = read_bytes(reader, length);
+	if (chars == NULL)
+		return NULL;
+	return copy_string((const char *)chars, (int)length);
+}
+
+static bool has_constant(Chunk *chunk, uint32_t index, ObjType type)
+{
+	return index < (uint32_t)chunk->constants.count && is_obj_type(chunk->constants.values[index], type);
+}
+
+typedef struct {
+	uint8_t op;
+	bool wide;
+	uint32_t operand;
+	// Where an OP_CLOSURE's isLocal and index pairs start.
+	int pairs;
+} Instruction;
+
+// Reads the instruction at `offset`, returning where the next one starts, or -1
+// if it runs off the end of the code or is not one the VM knows.
+static int decode(Chunk *chunk, int offset, Instruction *instruction)
+{
+	const uint8_t *code = chunk->code;
+	int count = chunk->count;
+
+	bool wide = code[offset] == OP_WIDE;
+	if (wide)
+		offset++;
+	if (offset == count)
+		return -1;
+
+	uint8_t op = code[offset++];
+	if (op == OP_CONSTANT_LONG) {
+		op = OP_CONSTANT;
+		wide = true;
+	}
+
+	int size;
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_CLOSURE:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_GET_MODULE:
+	case OP_DEFINE_MODULE:
+	case OP_SET_MODULE:
+		size = wide ? 3 : 1;
+		break;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_LOOP:
+		size = wide ? 3 : 2;
+		break;
+	case OP_ADD_MANY:
+	case OP_CALL:
+		if (wide)
+			return -1;
+		size = 1;
+		break;
+	default:
+		if (wide || op > OP_END_MODULE)
+			return -1;
+		size = 0;
+	}
+	if (count - offset < size)
+		return -1;
+
+	uint32_t operand = 0;
+	if (size == 3) {
+		operand = code[offset] | (code[offset + 1] << 8) | ((uint32_t)code[offset + 2] << 16);
+	} else if (size == 2) {
+		operand = (code[offset] << 8) | code[offset + 1];
+	} else if (size == 1) {
+		operand = code[offset];
+	}
+	offset += size;
+
+	instruction->op = op;
+	instruction->wide = wide;
+	instruction->operand = operand;
+	instruction->pairs = offset;
+	if (op == OP_CLOSURE) {
+		// Each upvalue is an isLocal byte and an index.
+		if (!has_constant(chunk, operand, OBJ_FUNCTION))
+			return -1;
+		int pairSize = wide ? 4 : 2;
+		int pairs = AS_FUNCTION(chunk->constants.values[operand])->upvalueCount;
+		if (pairs > (count - offset) / pairSize)
+			return -1;
+		offset += pairs * pairSize;
+	}
+	return offset;
+}
+
+// Checks what an instruction names without knowing the stack under it.
+static bool check_operands(Chunk *chunk, ObjFunction *function, ObjModule *module, Instruction *instruction)
+{
+	uint32_t operand = instruction->operand;
+	switch (instruction->op) {
+	case OP_CONSTANT:
+		return operand < (uint32_t)chunk->constants.count;
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+		return has_constant(chunk, operand, OBJ_STRING);
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+		return operand < (uint32_t)function->upvalueCount;
+	case OP_GET_MODULE:
+	case OP_SET_MODULE:
+		return operand < (uint32_t)module->slotCount;
+	case OP_DEFINE_MODULE:
+		// A module only defines its own names.
+		return operand < (uint32_t)module->slotCount && module->slots[operand].owner == module;
+	case OP_ADD_MANY:
+		return operand > 0;
+	default:
+		return true;
+	}
+}
+
+// Which bytes of a function's code start an instruction, the stack depth each
+// reachable one starts at, counting the callee's slot, or -1, and the reachable
+// ones still to follow.
+typedef struct {
+	bool *starts;
+	int *depths;
+	int *pending;
+	int pendingCount;
+} CodeMap;
+
+// Every way into an instruction must agree on the stack depth there.
+static bool reach(CodeMap *map, int target, int depth)
+{
+	if (!map->starts[target])
+		return false;
+	if (map->depths[target] == -1) {
+		map->depths[target] = depth;
+		map->pending[map->pendingCount++] = target;
+	}
+	return map->depths[target] == depth;
+}
+
+// The checksum catches damage, but the code must still only name constants,
+// upvalues, locals and module slots that exist, keep the stack balanced, land
+// its jumps on instructions and not run off its end, whatever wrote the file.
+// Only the top-level code of an imported module ends with OP_END_MODULE, which
+// is then its only way out.
+static bool check_code(CodeMap *map, ObjFunction *function, ObjModule *module, bool script)
+{
+	bool moduleCode = script && module != vm.main;
+	Chunk *chunk = &function->chunk;
+	int count = chunk->count;
+	Instruction instruction;
+
+	for (int i = 0; i < count; ++i) {
+		map->starts[i] = false;
+		map->depths[i] = -1;
+	}
+	for (int offset = 0; offset < count;) {
+		map->starts[offset] = true;
+		offset = decode(chunk, offset, &instruction);
+		if (offset == -1 || !check_operands(chunk, function, module, &instruction))
+			return false;
+	}
+
+	// Follow the code from its start, as the VM would run it.
+	map->pendingCount = 0;
+	reach(map, 0, function->arity + 1);
+	while (map->pendingCount > 0) {
+		int offset = map->pending[--map->pendingCount];
+		int depth = map->depths[offset];
+		offset = decode(chunk, offset, &instruction);
+		uint8_t op = instruction.op;
+		uint32_t operand = instruction.operand;
+
+		if ((op == OP_GET_LOCAL || op == OP_SET_LOCAL) && operand >= (uint32_t)depth)
+			return false;
+		if ((op == OP_RETURN && moduleCode) || (op == OP_END_MODULE && !moduleCode))
+			return false;
+		if (op == OP_CLOSURE) {
+			int pairSize = instruction.wide ? 4 : 2;
+			for (int pair = instruction.pairs; pair < offset; pair += pairSize) {
+				const uint8_t *code = chunk->code + pair;
+				uint32_t index = instruction.wide ? code[1] | (code[2] << 8) | ((uint32_t)code[3] << 16) : code[1];
+				if (index >= (uint32_t)(code[0] ? depth : function->upvalueCount))
+					return false;
+			}
+		}
+
+		int pops, pushes;
+		stack_effect(op, operand, &pops, &pushes);
+		// The callee's slot stays until the frame returns.
+		if (depth - pops < 1)
+			return false;
+		depth += pushes - pops;
+
+		switch (op) {
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+			if (operand >= (uint32_t)(count - offset) || !reach(map, offset + (int)operand, depth))
+				return false;
+			break;
+		case OP_LOOP:
+			if (operand > (uint32_t)offset || !reach(map, offset - (int)operand, depth))
+				return false;
+			break;
+		}
+		if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN && op != OP_END_MODULE) {
+			if (offset == count || !reach(map, offset, depth))
+				return false;
+		}
+	}
+	return true;
+}
+
+static bool check_function(ObjFunction *function, ObjModule *module, bool script)
+{
+	int count = function->chunk.count;
+	if (count == 0)
+		return false;
+
+	CodeMap map = {ALLOCATE(bool, count), ALLOCATE(int, count), ALLOCATE(int, count), 0};
+	bool valid = check_code(&map, function, module, script);
+	FREE_ARRAY(bool, map.starts, count);
+	FREE_ARRAY(int, map.depths, count);
+	FREE_ARRAY(int, map.pending, count);
+	return valid;
+}
+
+static ObjFunction *read_function(Reader *reader, bool script)
+{
+	ObjFunction *function = new_function();
+	push(OBJ_VAL(function));
+
+	Chunk *chunk = &function->chunk;
+	function->arity = (int)read_u32(reader);
+	function->upvalueCount = (int)read_u32(reader);
+	function->name = read_string(reader);
+
+	uint32_t count = read_u32(reader);
+	const uint8_t *code = read_bytes(reader, count);
+	if (code != NULL && count > 0) {
+		chunk->code = GROW_ARRAY(NULL, uint8_t, 0, count);
+		chunk->capacity = (int)count;
+		chunk->count = (int)count;
+		memcpy(chunk->code, code, count);
+	}
+
+	count = read_u32(reader);
+	const uint8_t *positions = read_bytes(reader, count);
+	if (positions != NULL && count > 0) {
+		// Each run is three varints, and the last one must end with the table.
+		uint32_t varints = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			varints += (positions[i] & 0x80) == 0;
+		}
+
+		if ((positions[count - 1] & 0x80) || varints % 3 != 0) {
+			reader->failed = true;
+		} else {
+			uint8_t *data = GROW_ARRAY(NULL, uint8_t, 0, count);
+			memcpy(data, positions, count);
+			load_positions(chunk, data, (int)count);
+		}
+	}
+
+	count = read_u32(reader);
+	for (uint32_t i = 0; i < count && !reader->failed; i++) {
+		switch (read_u8(reader)) {
+		case TAG_BOOL:
+			add_constant(chunk, BOOL_VAL(read_u8(reader) != 0));
+			break;
+		case TAG_NUMBER: {
+			uint64_t bits = read_u64(reader);
+			double number;
+			memcpy(&number, &bits, sizeof(number));
+			add_constant(chunk, NUMBER_VAL(number));
+			break;
+		}
+		case TAG_META:
+			add_constant(chunk, META_VAL);
+			break;
+		case TAG_STRING: {
+			ObjString *string = read_string(reader);
+			if (string != NULL)
+				add_constant(chunk, OBJ_VAL(string));
+			break;
+		}
+		case TAG_FUNCTION: {
+			ObjFunction *nested = read_function(reader, false);
+			if (nested != NULL)
+				add_constant(chunk, OBJ_VAL(nested));
+			break;
+		}
+		default:
+			reader->failed = true;
+		}
+	}
+
+	if (function->arity < 0 || function->arity > UINT8_MAX || function->upvalueCount < 0 ||
+		function->upvalueCount > UINT24_MAX)
+		reader->failed = true;
+	// Top-level code is called with nothing to take or capture.
+	if (script && (function->arity != 0 || function->upvalueCount != 0))
+		reader->failed = true;
+	if (!reader->failed && !check_function(function, reader->module, script))
+		reader->failed = true;
+
+	pop();
+	return reader->failed ? NULL : function;
+}
+
+static ObjFunction *read_cache(Reader *reader, uint64_t sourceHash)
+{
+	const uint8_t *magic = read_bytes(reader, 4);
+	if (magic == NULL || memcmp(magic, CACHE_MAGIC, 4) != 0)
+		return NULL;
+	if (read_u32(reader) != CACHE_VERSION || read_u32(reader) != (uint32_t)get_optimize_level())
+		return NULL;
+	if (read_u64(reader) != sourceHash)
+		return NULL;
+	uint64_t checksum = read_u64(reader);
+	if (reader->failed || hash_bytes(FNV_OFFSET, reader->current, reader->end - reader->current) != checksum)
+		return NULL;
+
+	ObjFunction *function = read_function(reader, true);
+	if (function == NULL || reader->current != reader->end)
+		return NULL;
+
+	pack_function(function);
+	return function;
+}
+
+#ifdef _WIN32
+ObjFunction *load_cache(const char *path, ObjModule *module, uint64_t sourceHash)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0L, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+
+	uint8_t *buffer = size > 0 ? ALLOCATE(uint8_t, size) : NULL;
+	ObjFunction *function = NULL;
+	if (buffer != NULL && fread(buffer, 1, size, file) == (size_t)size) {
+		Reader reader = {buffer, buffer + size, module, false};
+		function = read_cache(&reader, sourceHash);
+	}
+
+	if (buffer != NULL)
+		FREE_ARRAY(uint8_t, buffer, size);
+	fclose(file);
+	return function;
+}
+#else
+ObjFunction *load_cache(const char *path, ObjModule *module, uint64_t sourceHash)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat status;
+	if (fstat(fd, &status) != 0 || status.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t size = (size_t)status.st_size;
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	Reader reader = {mapping, (const uint8_t *)mapping + size, module, false};
+	ObjFunction *function = read_cache(&reader, sourceHash);
+
+	munmap(mapping, size);
+	return function;
+}
+#endif
@@ -5,46 +5,43 @@
 #include "core/memory.h"
 #include "core/vm.h"
 
-void init_line_record_array(LineRecordArray *array)
+static void init_position_table(PositionTable *table)
 {
-	array->linemarks = NULL;
-	array->capacity = 0;
-	array->count = 0;
+	table->count = 0;
+	table->capacity = 0;
+	table->runs = NULL;
+	table->size = 0;
+	table->data = NULL;
+	table->checkpointCount = 0;
+	table->checkpoints = NULL;
 }
 
-void write_line_record_array(LineRecordArray *array, int line)
+static void free_position_table(PositionTable *table)
 {
-	if (array->capacity < array->count + 1) {
-		int oldCapacity = array->capacity;
-		array->capacity = GROW_CAPACITY(oldCapacity);
-		array->linemarks = GROW_ARRAY(array->linemarks, LineRecord, oldCapacity, array->capacity);
-	}
-
-	encode_line_record_array(array, line);
+	FREE_ARRAY(Position, table->runs, table->capacity);
+	FREE_ARRAY(uint8_t, table->data, table->size);
+	FREE_ARRAY(PositionCheckpoint, table->checkpoints, table->checkpointCount);
+	init_position_table(table);
 }
 
-void encode_line_record_array(LineRecordArray *array, int line)
+static void add_position(PositionTable *table, int offset, int line, int column)
 {
-	if (array->count == 0) {
-		array->linemarks[0].linemark = line;
-		array->linemarks[0].offset = 0;
-		array->count++;
+	if (table->count > 0) {
+		Position *last = &table->runs[table->count - 1];
+		if (last->line == line && last->column == column)
+			return;
 	}
 
-	if (line == array->linemarks[array->count - 1].linemark) {
-		array->linemarks[array->count - 1].offset++;
-	} else {
-		int index = array->count;
-		array->linemarks[index].linemark = line;
-		array->linemarks[index].offset = 1;
-		array->count++;
+	if (table->capacity < table->count + 1) {
+		int oldCapacity = table->capacity;
+		table->capacity = GROW_CAPACITY(oldCapacity);
+		table->runs = GROW_ARRAY(table->runs, Position, oldCapacity, table->capacity);
 	}
-}
 
-void free_line_record_array(LineRecordArray *array)
-{
-	FREE_ARRAY(LineRecord, array->linemarks, array->capacity);
-	init_line_record_array(array);
+	Position *run = &table->runs[table->count++];
+	run->offset = offset;
+	run->line = line;
+	run->column = column;
 }
 
 void init_chunk(Chunk *chunk)
@@ -52,36 +49,46 @@ void init_chunk(Chunk *chunk)
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
-	// chunk->lines = NULL;
-	init_line_record_array(&chunk->lines);
+	init_position_table(&chunk->positions);
 	init_value_array(&chunk->constants);
+	chunk->packed = false;
+	chunk->arena = NULL;
 }
 
 void free_chunk(Chunk *chunk)
 {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	// FREE_ARRAY(int, chunk->lines, chunk->capacity);
-	free_line_record_array(&chunk->lines);
+	if (!chunk->packed) {
+		FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+		free_position_table(&chunk->positions);
+	}
 	free_value_array(&chunk->constants);
 	init_chunk(chunk);
 }
 
-void write_chunk(Chunk *chunk, uint8_t byte, int line)
+void write_chunk(Chunk *chunk, uint8_t byte, int line, int column)
 {
 	if (chunk->capacity < chunk->count + 1) {
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-		// chunk->lines = GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
 	}
 
-	write_line_record_array(&chunk->lines, line);
+	add_position(&chunk->positions, chunk->count, line, column);
 
 	chunk->code[chunk->count] = byte;
-	// chunk->lines[chunk->count] = line;
 	chunk->count++;
 }
 
+// Drops the code from `count` on, as if it had never been written.
+void truncate_chunk(Chunk *chunk, int count)
+{
+	chunk->count = count;
+	PositionTable *table = &chunk->positions;
+	while (table->count > 0 && table->runs[table->count - 1].offset >= count) {
+		table->count--;
+	}
+}
+
 int add_constant(Chunk *chunk, Value value)
 {
 	push(value);
@@ -90,31 +97,250 @@ int add_constant(Chunk *chunk, Value value)
 	return chunk->constants.count - 1;
 }
 
-void write_constant(Chunk *chunk, Value value, int line)
+static bool is_shareable_constant(Value value)
+{
+	if (IS_NUMBER(value)) {
+		// -0 compares equal to 0 but must keep its own slot.
+		return AS_NUMBER(value) != 0 || 1 / AS_NUMBER(value) > 0;
+	}
+	return IS_STRING(value);
+}
+
+int add_shared_constant(Chunk *chunk, Table *shared, Value value)
+{
+	bool shareable = is_shareable_constant(value);
+	Value slot;
+	if (shareable && table_get(shared, value, &slot)) {
+		return (int)AS_NUMBER(slot);
+	}
+
+	int constant = add_constant(chunk, value);
+	if (shareable && constant <= UINT24_MAX) {
+		table_set(shared, value, NUMBER_VAL(constant));
+	}
+	return constant;
+}
+
+void write_constant(Chunk *chunk, Value value, int line, int column)
 {
 	int index = add_constant(chunk, value);
 	if (index < 256) {
-		write_chunk(chunk, OP_CONSTANT, line);
-		write_chunk(chunk, (uint8_t)index, line);
+		write_chunk(chunk, OP_CONSTANT, line, column);
+		write_chunk(chunk, (uint8_t)index, line, column);
 	} else {
-		write_chunk(chunk, OP_CONSTANT_LONG, line);
-		write_chunk(chunk, (uint8_t)(index & 0xff), line);
-		write_chunk(chunk, (uint8_t)((index >> 8) & 0xff), line);
-		write_chunk(chunk, (uint8_t)((index >> 16) & 0xff), line);
+		write_chunk(chunk, OP_CONSTANT_LONG, line, column);
+		write_chunk(chunk, (uint8_t)(index & 0xff), line, column);
+		write_chunk(chunk, (uint8_t)((index >> 8) & 0xff), line, column);
+		write_chunk(chunk, (uint8_t)((index >> 16) & 0xff), line, column);
+	}
+}
+
+// Encodes `value` in LEB128 form into `data` (when not NULL) and returns its size.
+static int write_varint(uint8_t *data, uint32_t value)
+{
+	int size = 0;
+	do {
+		uint8_t byte = value & 0x7f;
+		value >>= 7;
+		if (data != NULL)
+			data[size] = value != 0 ? byte | 0x80 : byte;
+		size++;
+	} while (value != 0);
+	return size;
+}
+
+static uint32_t read_varint(const uint8_t *data, int *index)
+{
+	uint32_t value = 0;
+	int shift = 0;
+	uint8_t byte;
+	do {
+		byte = data[(*index)++];
+		value |= (uint32_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return value;
+}
+
+// Lines and columns can go back, so their deltas are zigzag encoded.
+static uint32_t zigzag(int value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int unzigzag(uint32_t value)
+{
+	return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+static int encode_run(uint8_t *data, Position *previous, Position *run)
+{
+	int size = write_varint(data, (uint32_t)(run->offset - previous->offset));
+	size += write_varint(data == NULL ? NULL : data + size, zigzag(run->line - previous->line));
+	size += write_varint(data == NULL ? NULL : data + size, zigzag(run->column - previous->column));
+	return size;
+}
+
+static void decode_run(const uint8_t *data, int *index, Position *position)
+{
+	position->offset += (int)read_varint(data, index);
+	position->line += unzigzag(read_varint(data, index));
+	position->column += unzigzag(read_varint(data, index));
+}
+
+static void index_positions(PositionTable *table)
+{
+	int runs = 0;
+	for (int index = 0; index < table->size; runs++) {
+		Position skipped = {0, 0, 0};
+		decode_run(table->data, &index, &skipped);
+	}
+
+	table->checkpointCount = (runs + POSITION_CHECKPOINT_INTERVAL - 1) / POSITION_CHECKPOINT_INTERVAL;
+	table->checkpoints = ALLOCATE(PositionCheckpoint, table->checkpointCount);
+
+	Position position = {0, 0, 0};
+	int index = 0;
+	for (int run = 0; run < runs; run++) {
+		decode_run(table->data, &index, &position);
+		if (run % POSITION_CHECKPOINT_INTERVAL == 0) {
+			PositionCheckpoint *checkpoint = &table->checkpoints[run / POSITION_CHECKPOINT_INTERVAL];
+			checkpoint->position = position;
+			checkpoint->index = index;
+		}
+	}
+}
+
+void finish_positions(Chunk *chunk)
+{
+	PositionTable *table = &chunk->positions;
+	if (table->runs == NULL)
+		return;
+
+	Position start = {0, 0, 0};
+	int size = 0;
+	for (int i = 0; i < table->count; i++) {
+		size += encode_run(NULL, i == 0 ? &start : &table->runs[i - 1], &table->runs[i]);
 	}
+
+	uint8_t *data = ALLOCATE(uint8_t, size);
+	int index = 0;
+	for (int i = 0; i < table->count; i++) {
+		index += encode_run(data + index, i == 0 ? &start : &table->runs[i - 1], &table->runs[i]);
+	}
+
+	free_position_table(table);
+	load_positions(chunk, data, size);
 }
 
-int get_line(LineRecordArray *array, int offset)
+void load_positions(Chunk *chunk, uint8_t *data, int size)
 {
-	int offsetLeft = offset;
+	PositionTable *table = &chunk->positions;
+	table->data = data;
+	table->size = size;
+	index_positions(table);
+}
+
+Position get_position(Chunk *chunk, int offset)
+{
+	PositionTable *table = &chunk->positions;
+	Position position = {0, -1, 0};
+
+	// Still being written: the runs can be searched directly.
+	if (table->runs != NULL) {
+		int low = 0, high = table->count - 1;
+		while (low <= high) {
+			int middle = low + (high - low) / 2;
+			if (table->runs[middle].offset <= offset) {
+				position = table->runs[middle];
+				low = middle + 1;
+			} else {
+				high = middle - 1;
+			}
+		}
+		return position;
+	}
 
-	for (int index = 0; index < array->count; index++) {
-		if (array->linemarks[index].offset > offsetLeft) {
-			return array->linemarks[index].linemark;
+	int low = 0, high = table->checkpointCount - 1, found = -1;
+	while (low <= high) {
+		int middle = low + (high - low) / 2;
+		if (table->checkpoints[middle].position.offset <= offset) {
+			found = middle;
+			low = middle + 1;
+		} else {
+			high = middle - 1;
 		}
-		offsetLeft -= array->linemarks[index].offset;
 	}
+	if (found == -1)
+		return position;
 
-	printf("Error : get_line() returns -1 \n");
-	return -1;
+	position = table->checkpoints[found].position;
+	int index = table->checkpoints[found].index;
+	while (index < table->size) {
+		Position next = position;
+		decode_run(table->data, &index, &next);
+		if (next.offset > offset)
+			break;
+		position = next;
+	}
+	return position;
+}
+
+int get_line(Chunk *chunk, int offset)
+{
+	return get_position(chunk, offset).line;
+}
+
+void stack_effect(uint8_t op, uint32_t operand, int *pops, int *pushes)
+{
+	*pops = 0;
+	*pushes = 1;
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_META:
+	case OP_GET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_GET_MODULE:
+	case OP_CLOSURE:
+		break;
+	case OP_SET_LOCAL:
+	case OP_SET_GLOBAL:
+	case OP_SET_UPVALUE:
+	case OP_SET_MODULE:
+	case OP_NOT:
+	case OP_NEGATE:
+	case OP_JUMP_IF_FALSE:
+		*pops = 1;
+		break;
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULO:
+	case OP_POW:
+		*pops = 2;
+		break;
+	case OP_ADD_MANY:
+		*pops = (int)operand;
+		break;
+	case OP_CALL:
+		*pops = (int)operand + 1;
+		break;
+	case OP_DEFINE_GLOBAL:
+	case OP_DEFINE_MODULE:
+	case OP_POP:
+	case OP_PRINT:
+	case OP_CLOSE_UPVALUE:
+	case OP_RETURN:
+		*pops = 1;
+		*pushes = 0;
+		break;
+	default:
+		*pushes = 0;
+	}
 }
@@ -1,23 +1,23 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "core/arena.h"
 #include "core/common.h"
 #include "core/compiler.h"
 #include "core/memory.h"
+#include "core/module.h"
+#include "core/optimizer.h"
 #include "core/scanner.h"
+#include "core/table.h"
+#include "core/vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "core/debug.h"
 #endif
 
-typedef struct {
-	Token current;
-	Token previous;
-	bool hadError;
-	bool panicMode;
-} Parser;
-
 typedef enum {
 	PREC_NONE,
 	PREC_ASSIGNMENT, // =
@@ -33,7 +33,7 @@ typedef enum {
 	PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 typedef struct {
 	ParseFn prefix;
@@ -48,37 +48,62 @@ typedef struct {
 } Local;
 
 typedef struct {
-	uint8_t index;
+	int index;
 	bool isLocal;
 } Upvalue;
 
-typedef enum { TYPE_FUNCTION, TYPE_SCRIPT } FunctionType;
+// A `const` declaration, whose uses compile to its value.
+typedef struct {
+	Token name;
+	int depth;
+	// Locals at this index and above were declared after it, and hide it.
+	int localCount;
+	Value value;
+} Const;
+
+typedef enum { TYPE_FUNCTION, TYPE_CONST_FN, TYPE_SCRIPT } FunctionType;
 
-typedef struct Compiler {
+struct Compiler {
 	struct Compiler *enclosing;
 	ObjFunction *function;
 	FunctionType type;
 
-	Local locals[UINT8_COUNT];
+	Local *locals;
 	int localCount;
-	Upvalue upvalues[UINT8_COUNT];
+	int localCapacity;
+	Upvalue *upvalues;
+	int upvalueCapacity;
+	Const *consts;
+	int constCount;
+	int constCapacity;
 	int scopeDepth;
-} Compiler;
+	// Compiling a const fn or a function inside one.
+	bool pure;
 
-Parser parser;
+	// Maps each string and number already in the constant pool to its slot.
+	Table constants;
 
-Compiler *current = NULL;
+	// Forward jumps get a 16-bit operand unless a previous attempt at this
+	// function overflowed one, in which case it is compiled again with wide jumps.
+	bool wideJumps;
+	bool jumpOverflow;
+};
+
+// Parsers in the middle of a compilation, whose functions are GC roots, innermost
+// first. Like the heap, the list is not locked: compiles only nest on the thread
+// that runs the VM.
+static Parser *activeParsers = NULL;
 
-static Chunk *current_chunk()
+static Chunk *current_chunk(Parser *parser)
 {
-	return &current->function->chunk;
+	return &parser->compiler->function->chunk;
 }
 
-static void error_at(Token *token, const char *message)
+static void error_at(Parser *parser, Token *token, const char *message)
 {
-	if (parser.panicMode)
+	if (parser->panicMode)
 		return;
-	parser.panicMode = true;
+	parser->panicMode = true;
 
 	fprintf(stderr, "[line %d] Error", token->line);
 
@@ -91,188 +116,308 @@ static void error_at(Token *token, const char *message)
 	}
 
 	fprintf(stderr, ": %s\n", message);
-	parser.hadError = true;
+	parser->hadError = true;
 }
 
-static void error(const char *message)
+static void error(Parser *parser, const char *message)
 {
-	error_at(&parser.previous, message);
+	error_at(parser, &parser->previous, message);
 }
 
-static void error_at_current(const char *message)
+static void error_at_current(Parser *parser, const char *message)
 {
-	error_at(&parser.current, message);
+	error_at(parser, &parser->current, message);
 }
 
-static void advance()
+static void advance(Parser *parser)
 {
-	parser.previous = parser.current;
+	parser->previous = parser->current;
 
 	for (;;) {
-		parser.current = scan_token();
-		if (parser.current.type != TOKEN_ERROR)
+		parser->current = scan_token(&parser->scanner);
+		if (parser->current.type != TOKEN_ERROR)
 			break;
 
-		error_at_current(parser.current.start);
+		error_at_current(parser, parser->current.start);
 	}
 }
 
-static void consume(TokenType type, const char *message)
+static void consume(Parser *parser, TokenType type, const char *message)
 {
-	if (parser.current.type == type) {
-		advance();
+	if (parser->current.type == type) {
+		advance(parser);
 		return;
 	}
 
-	error_at_current(message);
+	error_at_current(parser, message);
 }
 
-static bool check(TokenType type)
+static bool check(Parser *parser, TokenType type)
 {
-	return parser.current.type == type;
+	return parser->current.type == type;
 }
 
-static bool match(TokenType type)
+static bool match(Parser *parser, TokenType type)
 {
-	if (!check(type))
+	if (!check(parser, type))
 		return false;
-	advance();
+	advance(parser);
 	return true;
 }
 
-static void emit_byte(uint8_t byte)
+static void emit_byte(Parser *parser, uint8_t byte)
 {
-	write_chunk(current_chunk(), byte, parser.previous.line);
+	write_chunk(current_chunk(parser), byte, parser->previous.line, parser->previous.column);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2)
+static void emit_bytes(Parser *parser, uint8_t byte1, uint8_t byte2)
 {
-	emit_byte(byte1);
-	emit_byte(byte2);
+	emit_byte(parser, byte1);
+	emit_byte(parser, byte2);
 }
 
-static void emit_loop(int loopStart)
+static void emit_long(Parser *parser, int operand)
 {
-	emit_byte(OP_LOOP);
+	emit_byte(parser, operand & 0xff);
+	emit_byte(parser, (operand >> 8) & 0xff);
+	emit_byte(parser, (operand >> 16) & 0xff);
+}
 
-	int offset = current_chunk()->count - loopStart + 2;
-	if (offset > UINT16_MAX)
-		error("Loop body too large.");
+// Emits `instruction` with a single index operand, using the compact form
+// whenever the index fits in a byte.
+static void emit_operand(Parser *parser, uint8_t instruction, int operand)
+{
+	if (operand <= UINT8_MAX) {
+		emit_bytes(parser, instruction, (uint8_t)operand);
+	} else {
+		emit_bytes(parser, OP_WIDE, instruction);
+		emit_long(parser, operand);
+	}
+}
 
-	emit_byte((offset >> 8) & 0xff);
-	emit_byte(offset & 0xff);
+static void emit_loop(Parser *parser, int loopStart)
+{
+	int offset = current_chunk(parser)->count - loopStart + 3;
+	if (offset <= UINT16_MAX) {
+		emit_byte(parser, OP_LOOP);
+		emit_byte(parser, (offset >> 8) & 0xff);
+		emit_byte(parser, offset & 0xff);
+		return;
+	}
+
+	offset += 2;
+	if (offset > UINT24_MAX)
+		error(parser, "Loop body too large.");
+
+	emit_bytes(parser, OP_WIDE, OP_LOOP);
+	emit_long(parser, offset);
 }
 
-static int emit_jump(uint8_t instruction)
+static int emit_jump(Parser *parser, uint8_t instruction)
 {
-	emit_byte(instruction);
-	emit_byte(0xff);
-	emit_byte(0xff);
-	return current_chunk()->count - 2;
+	if (parser->compiler->wideJumps) {
+		emit_bytes(parser, OP_WIDE, instruction);
+		emit_long(parser, UINT24_MAX);
+		return current_chunk(parser)->count - 3;
+	}
+
+	emit_byte(parser, instruction);
+	emit_byte(parser, 0xff);
+	emit_byte(parser, 0xff);
+	return current_chunk(parser)->count - 2;
 }
 
-static void emit_return()
+static void emit_return(Parser *parser)
 {
-	emit_byte(OP_META);
-	emit_byte(OP_RETURN);
+	emit_byte(parser, OP_META);
+	emit_byte(parser, OP_RETURN);
 }
 
-static uint8_t make_constant(Value value)
+static int make_constant(Parser *parser, Value value)
 {
-	int constant = add_constant(current_chunk(), value);
-	if (constant > UINT8_MAX) {
-		error("Too many constants in one chunk.");
+	int constant = add_shared_constant(current_chunk(parser), &parser->compiler->constants, value);
+	if (constant > UINT24_MAX) {
+		error(parser, "Too many constants in one chunk.");
 		return 0;
 	}
+	return constant;
+}
 
-	return (uint8_t)constant;
+static void emit_constant(Parser *parser, Value value)
+{
+	int constant = make_constant(parser, value);
+	if (constant <= UINT8_MAX) {
+		emit_bytes(parser, OP_CONSTANT, (uint8_t)constant);
+	} else {
+		emit_byte(parser, OP_CONSTANT_LONG);
+		emit_long(parser, constant);
+	}
 }
 
-// static void emit_constant(Value value)
-// {
-// 	emit_bytes(OP_CONSTANT, make_constant(value));
-// }
+static void emit_closure(Parser *parser, ObjFunction *function, Upvalue *upvalues);
 
-static void emit_constant(Value value)
+static void emit_value(Parser *parser, Value value)
 {
-	write_constant(current_chunk(), value, parser.previous.line);
+	if (IS_BOOL(value)) {
+		emit_byte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	} else if (IS_META(value)) {
+		emit_byte(parser, OP_META);
+	} else if (IS_FUNCTION(value)) {
+		emit_closure(parser, AS_FUNCTION(value), NULL);
+	} else {
+		emit_constant(parser, value);
+	}
 }
 
-static void patch_jump(int offset)
+static void patch_jump(Parser *parser, int offset)
 {
+	uint8_t *code = current_chunk(parser)->code;
+
+	if (parser->compiler->wideJumps) {
+		// -3 to adjust for the bytecode for the jump offset itself.
+		int jump = current_chunk(parser)->count - offset - 3;
+		if (jump > UINT24_MAX) {
+			error(parser, "Too much code to jump over.");
+		}
+
+		code[offset] = jump & 0xff;
+		code[offset + 1] = (jump >> 8) & 0xff;
+		code[offset + 2] = (jump >> 16) & 0xff;
+		return;
+	}
+
 	// -2 to adjust for the bytecode for the jump offset itself.
-	int jump = current_chunk()->count - offset - 2;
+	int jump = current_chunk(parser)->count - offset - 2;
 
 	if (jump > UINT16_MAX) {
-		error("Too much code to jump over.");
+		// The caller recompiles the function with wide jumps.
+		parser->compiler->jumpOverflow = true;
 	}
 
-	current_chunk()->code[offset] = (jump >> 8) & 0xff;
-	current_chunk()->code[offset + 1] = jump & 0xff;
+	code[offset] = (jump >> 8) & 0xff;
+	code[offset + 1] = jump & 0xff;
 }
 
-static void init_compiler(Compiler *compiler, FunctionType type)
+static void add_local(Parser *parser, Token name);
+
+static void init_compiler(Parser *parser, Compiler *compiler, FunctionType type, bool wideJumps)
 {
-	compiler->enclosing = current;
+	compiler->enclosing = parser->compiler;
 	compiler->function = NULL;
 	compiler->type = type;
+	compiler->locals = NULL;
 	compiler->localCount = 0;
+	compiler->localCapacity = 0;
+	compiler->upvalues = NULL;
+	compiler->upvalueCapacity = 0;
+	compiler->consts = NULL;
+	compiler->constCount = 0;
+	compiler->constCapacity = 0;
 	compiler->scopeDepth = 0;
+	compiler->pure = type == TYPE_CONST_FN || (parser->compiler != NULL && parser->compiler->pure);
+	compiler->wideJumps = wideJumps;
+	compiler->jumpOverflow = false;
+	init_table(&compiler->constants);
 	compiler->function = new_function();
-	current = compiler;
+	compiler->function->module = parser->module;
+	parser->compiler = compiler;
 
 	if (type != TYPE_SCRIPT) {
-		current->function->name = copy_string(parser.previous.start, parser.previous.length);
+		parser->compiler->function->name = copy_string(parser->previous.start, parser->previous.length);
 	}
 
-	Local *local = &current->locals[current->localCount++];
-	local->depth = 0;
-	local->isCaptured = false;
-	local->name.start = "";
-	local->name.length = 0;
+	Token name;
+	name.start = "";
+	name.length = 0;
+	if (type == TYPE_CONST_FN) {
+		// The slot holds the running closure, so a const fn can call itself.
+		name = parser->previous;
+	}
+	add_local(parser, name);
+	parser->compiler->locals[0].depth = 0;
 }
 
-static ObjFunction *end_compiler()
+static void free_compiler(Compiler *compiler)
 {
-	emit_return();
-	ObjFunction *current_function = current->function;
+	FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+	FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+	FREE_ARRAY(Const, compiler->consts, compiler->constCapacity);
+	free_table(&compiler->constants);
+}
+
+// Whether top-level declarations define slots of the module rather than globals.
+static bool at_module_level(Parser *parser)
+{
+	return parser->compiler->type == TYPE_SCRIPT && parser->compiler->scopeDepth == 0 && parser->module != vm.main;
+}
+
+static ObjFunction *end_compiler(Parser *parser)
+{
+	if (parser->compiler->type == TYPE_SCRIPT && parser->module != vm.main) {
+		emit_byte(parser, OP_END_MODULE);
+	} else {
+		emit_return(parser);
+	}
+	ObjFunction *current_function = parser->compiler->function;
+	current_function->pure = parser->compiler->pure;
+	if (!parser->hadError && !parser->compiler->jumpOverflow) {
+		optimize_function(current_function, &parser->compiler->constants);
+	}
+	finish_positions(current_chunk(parser));
 #ifdef DEBUG_PRINT_CODE
-	if (!parser.hadError) {
-		disassemble_chunk(current_chunk(), current_function->name != NULL ? current_function->name->chars : "<script>");
+	if (!parser->hadError) {
+		disassemble_chunk(current_chunk(parser), current_function->name);
 	}
 #endif
-	current = current->enclosing;
+	parser->compiler = parser->compiler->enclosing;
 	return current_function;
 }
 
-static void begin_scope()
+static void begin_scope(Parser *parser)
 {
-	current->scopeDepth++;
+	parser->compiler->scopeDepth++;
 }
 
-static void end_scope()
+static void end_scope(Parser *parser)
 {
-	current->scopeDepth--;
+	parser->compiler->scopeDepth--;
 
-	while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-		if (current->locals[current->localCount - 1].isCaptured) {
-			emit_byte(OP_CLOSE_UPVALUE);
+	while (parser->compiler->localCount > 0 && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+		if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured) {
+			emit_byte(parser, OP_CLOSE_UPVALUE);
 		} else {
-			emit_byte(OP_POP);
+			emit_byte(parser, OP_POP);
 		}
-		current->localCount--;
+		parser->compiler->localCount--;
+	}
+
+	while (parser->compiler->constCount > 0 &&
+		   parser->compiler->consts[parser->compiler->constCount - 1].depth > parser->compiler->scopeDepth) {
+		parser->compiler->constCount--;
 	}
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
 static ParseRule *get_rule(TokenType type);
-static void parse_precedence(Precedence precedence);
+static void parse_precedence(Parser *parser, Precedence precedence);
 
-static uint8_t identifier_constant(Token *name)
+static int identifier_constant(Parser *parser, Token *name)
 {
-	return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+	return make_constant(parser, OBJ_VAL(copy_string(name->start, name->length)));
+}
+
+static int resolve_module(Parser *parser, Token *name)
+{
+	ObjModule *module = parser->module;
+	if (module == NULL || module->slotCount == 0)
+		return -1;
+
+	Value slot;
+	if (!table_get(&module->slotNames, OBJ_VAL(copy_string(name->start, name->length)), &slot))
+		return -1;
+	return (int)AS_NUMBER(slot);
 }
 
 static bool identifiers_equal(Token *a, Token *b)
@@ -282,13 +427,13 @@ static bool identifiers_equal(Token *a, Token *b)
 	return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolve_local(Compiler *compiler, Token *name)
+static int resolve_local(Parser *parser, Compiler *compiler, Token *name)
 {
 	for (int i = compiler->localCount - 1; i >= 0; i--) {
 		Local *local = &compiler->locals[i];
 		if (identifiers_equal(name, &local->name)) {
 			if (local->depth == -1) {
-				error("Cannot read local variable in its own initializer.");
+				error(parser, "Cannot read local variable in its own initializer.");
 			}
 			return i;
 		}
@@ -297,7 +442,94 @@ static int resolve_local(Compiler *compiler, Token *name)
 	return -1;
 }
 
-static int add_upvalue(Compiler *compiler, uint8_t index, bool isLocal)
+static int find_local(Compiler *compiler, Token *name)
+{
+	for (int i = compiler->localCount - 1; i >= 0; i--) {
+		if (identifiers_equal(name, &compiler->locals[i].name))
+			return i;
+	}
+	return -1;
+}
+
+static void add_const(Parser *parser, Token name, Value value)
+{
+	Compiler *compiler = parser->compiler;
+	push(value);
+	if (compiler->constCapacity < compiler->constCount + 1) {
+		int oldCapacity = compiler->constCapacity;
+		compiler->constCapacity = GROW_CAPACITY(oldCapacity);
+		compiler->consts = GROW_ARRAY(compiler->consts, Const, oldCapacity, compiler->constCapacity);
+	}
+	pop();
+
+	Const *constant = &compiler->consts[compiler->constCount++];
+	constant->name = name;
+	constant->depth = compiler->scopeDepth;
+	constant->localCount = compiler->localCount;
+	constant->value = value;
+}
+
+// Finds the value of the constant that `name` refers to, unless a variable
+// declared after it hides it. Constants from earlier compilations of the same
+// module, such as previous REPL lines, are kept in the module, and a lazily
+// compiled body only sees those declared before it.
+static bool resolve_const(Parser *parser, Token *name, Value *value)
+{
+	for (Compiler *compiler = parser->compiler; compiler != NULL; compiler = compiler->enclosing) {
+		int local = find_local(compiler, name);
+		for (int i = compiler->constCount - 1; i >= 0; i--) {
+			Const *constant = &compiler->consts[i];
+			if (identifiers_equal(name, &constant->name)) {
+				if (local >= constant->localCount)
+					return false;
+				*value = constant->value;
+				return true;
+			}
+		}
+		if (local != -1)
+			return false;
+	}
+
+	if (parser->module == NULL || parser->module->constants.count == 0)
+		return false;
+	Value index;
+	if (!table_get(&parser->module->constants, OBJ_VAL(copy_string(name->start, name->length)), &index) ||
+		AS_NUMBER(index) >= parser->constLimit)
+		return false;
+	*value = parser->module->constValues.values[(int)AS_NUMBER(index)];
+	return true;
+}
+
+static bool const_in_scope(Parser *parser, Token *name)
+{
+	Compiler *compiler = parser->compiler;
+	for (int i = compiler->constCount - 1; i >= 0 && compiler->consts[i].depth == compiler->scopeDepth; i--) {
+		if (identifiers_equal(name, &compiler->consts[i].name))
+			return true;
+	}
+
+	if (compiler->type != TYPE_SCRIPT || compiler->scopeDepth > 0 || parser->module == NULL ||
+		parser->module->constants.count == 0)
+		return false;
+	Value value;
+	return table_get(&parser->module->constants, OBJ_VAL(copy_string(name->start, name->length)), &value);
+}
+
+// Top-level constants stay visible to lazily compiled bodies and later REPL lines.
+static void publish_consts(Parser *parser)
+{
+	Compiler *compiler = parser->compiler;
+	for (int i = 0; i < compiler->constCount; ++i) {
+		Const *constant = &compiler->consts[i];
+		ObjString *name = copy_string(constant->name.start, constant->name.length);
+		push(OBJ_VAL(name));
+		table_set(&parser->module->constants, OBJ_VAL(name), NUMBER_VAL(parser->module->constValues.count));
+		write_value_array(&parser->module->constValues, constant->value);
+		pop();
+	}
+}
+
+static int add_upvalue(Parser *parser, Compiler *compiler, int index, bool isLocal)
 {
 	int upvalueCount = compiler->function->upvalueCount;
 
@@ -308,260 +540,365 @@ static int add_upvalue(Compiler *compiler, uint8_t index, bool isLocal)
 		}
 	}
 
-	if (upvalueCount == UINT8_COUNT) {
-		error("Too many closure variables in function.");
+	if (upvalueCount > UINT24_MAX) {
+		error(parser, "Too many closure variables in function.");
+		return 0;
+	}
+
+	if (compiler->type == TYPE_CONST_FN) {
+		error(parser, "A const fn cannot capture variables.");
 		return 0;
 	}
 
+	if (compiler->upvalueCapacity < upvalueCount + 1) {
+		int oldCapacity = compiler->upvalueCapacity;
+		compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+		compiler->upvalues = GROW_ARRAY(compiler->upvalues, Upvalue, oldCapacity, compiler->upvalueCapacity);
+	}
+
 	compiler->upvalues[upvalueCount].isLocal = isLocal;
 	compiler->upvalues[upvalueCount].index = index;
 	return compiler->function->upvalueCount++;
 }
 
-static int resolve_upvalue(Compiler *compiler, Token *name)
+static int resolve_upvalue(Parser *parser, Compiler *compiler, Token *name)
 {
 	if (compiler->enclosing == NULL)
 		return -1;
 
-	int local = resolve_local(compiler->enclosing, name);
+	int local = resolve_local(parser, compiler->enclosing, name);
 	if (local != -1) {
 		compiler->enclosing->locals[local].isCaptured = true;
-		return add_upvalue(compiler, (uint8_t)local, true);
+		return add_upvalue(parser, compiler, local, true);
 	}
 
-	int upvalue = resolve_upvalue(compiler->enclosing, name);
+	int upvalue = resolve_upvalue(parser, compiler->enclosing, name);
 	if (upvalue != -1) {
-		return add_upvalue(compiler, (uint8_t)upvalue, false);
+		return add_upvalue(parser, compiler, upvalue, false);
 	}
 
 	return -1;
 }
 
-static void add_local(Token name)
+static void add_local(Parser *parser, Token name)
 {
-	if (current->localCount == UINT8_COUNT) {
-		error("Too many local variables in function.");
+	if (parser->compiler->localCount > UINT24_MAX) {
+		error(parser, "Too many local variables in function.");
 		return;
 	}
 
-	Local *local = &current->locals[current->localCount++];
+	if (parser->compiler->localCapacity < parser->compiler->localCount + 1) {
+		int oldCapacity = parser->compiler->localCapacity;
+		parser->compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+		parser->compiler->locals = GROW_ARRAY(parser->compiler->locals, Local, oldCapacity, parser->compiler->localCapacity);
+	}
+
+	Local *local = &parser->compiler->locals[parser->compiler->localCount++];
 	local->name = name;
 	local->depth = -1;
 	local->isCaptured = false;
 }
 
-static void declare_variable()
+static void declare_variable(Parser *parser)
 {
+	Token *name = &parser->previous;
+	if (const_in_scope(parser, name)) {
+		error(parser, "Already a constant with this name in this scope.");
+	}
+
 	// Global variables are implicitly declared.
-	if (current->scopeDepth == 0)
+	if (parser->compiler->scopeDepth == 0)
 		return;
 
-	Token *name = &parser.previous;
-
-	for (int i = current->localCount - 1; i >= 0; i--) {
-		Local *local = &current->locals[i];
-		if (local->depth != -1 && local->depth < current->scopeDepth) {
+	for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+		Local *local = &parser->compiler->locals[i];
+		if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
 			break;
 		}
 
 		if (identifiers_equal(name, &local->name)) {
-			error("Variable with this name already declared in this scope.");
+			error(parser, "Variable with this name already declared in this scope.");
 		}
 	}
-	add_local(*name);
+	add_local(parser, *name);
 }
 
-static uint8_t parse_variable(const char *errorMessage)
+static int parse_variable(Parser *parser, const char *errorMessage)
 {
-	consume(TOKEN_IDENTIFIER, errorMessage);
+	consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-	declare_variable();
-	if (current->scopeDepth > 0)
+	declare_variable(parser);
+	if (parser->compiler->scopeDepth > 0)
 		return 0;
 
-	return identifier_constant(&parser.previous);
+	if (at_module_level(parser)) {
+		// declare_module() gave every top-level name a slot before compiling.
+		int slot = resolve_module(parser, &parser->previous);
+		if (slot == -1)
+			error(parser, "Cannot declare this name here.");
+		return slot;
+	}
+
+	return identifier_constant(parser, &parser->previous);
 }
 
-static void mark_initialized()
+static void mark_initialized(Parser *parser)
 {
-	if (current->scopeDepth == 0)
+	if (parser->compiler->scopeDepth == 0)
 		return;
-	current->locals[current->localCount - 1].depth = current->scopeDepth;
+	parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(Parser *parser, int global)
 {
-	if (current->scopeDepth > 0) {
-		mark_initialized();
+	if (parser->compiler->scopeDepth > 0) {
+		mark_initialized(parser);
 		return;
 	}
 
-	emit_bytes(OP_DEFINE_GLOBAL, global);
+	emit_operand(parser, at_module_level(parser) ? OP_DEFINE_MODULE : OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argument_list()
+static uint8_t argument_list(Parser *parser)
 {
 	uint8_t argCount = 0;
-	if (!check(TOKEN_RIGHT_PAREN)) {
+	if (!check(parser, TOKEN_RIGHT_PAREN)) {
 		do {
-			expression();
+			expression(parser);
 
 			if (argCount == 255) {
-				error("Cannot have more than 255 arguments.");
+				error(parser, "Cannot have more than 255 arguments.");
 			}
 
 			argCount++;
-		} while (match(TOKEN_COMMA));
+		} while (match(parser, TOKEN_COMMA));
 	}
 
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
 	return argCount;
 }
 
-static void binary(bool canAssign)
+// Whether the operand starting at the current token is a single literal, local
+// or constant, which cannot fail or run any code.
+static bool is_plain_operand(Parser *parser)
+{
+	Scanner lookahead = parser->scanner;
+	if (get_rule(scan_token(&lookahead).type)->precedence > PREC_TERM)
+		return false;
+
+	Token *token = &parser->current;
+	switch (token->type) {
+	case TOKEN_NUMBER:
+	case TOKEN_STRING:
+	case TOKEN_TRUE:
+	case TOKEN_FALSE:
+		return true;
+	case TOKEN_IDENTIFIER: {
+		Value value;
+		if (resolve_const(parser, token, &value))
+			return true;
+		for (Compiler *compiler = parser->compiler; compiler != NULL; compiler = compiler->enclosing) {
+			if (find_local(compiler, token) != -1)
+				return true;
+		}
+		return false;
+	}
+	default:
+		return false;
+	}
+}
+
+static void emit_add(Parser *parser, int operands)
+{
+	if (operands == 2) {
+		emit_byte(parser, OP_ADD);
+	} else {
+		emit_bytes(parser, OP_ADD_MANY, operands);
+	}
+}
+
+static void binary(Parser *parser, bool canAssign)
 {
 	// Remember the operator.
-	TokenType operatorType = parser.previous.type;
+	TokenType operatorType = parser->previous.type;
 
 	// Compile the right operand.
 	ParseRule *rule = get_rule(operatorType);
-	parse_precedence((Precedence)(rule->precedence + 1));
+	parse_precedence(parser, (Precedence)(rule->precedence + 1));
 
 	// Emit the operator instruction.
 	switch (operatorType) {
 	case TOKEN_BANG_EQUAL:
-		emit_bytes(OP_EQUAL, OP_NOT);
+		emit_bytes(parser, OP_EQUAL, OP_NOT);
 		break;
 	case TOKEN_EQUAL_EQUAL:
-		emit_byte(OP_EQUAL);
+		emit_byte(parser, OP_EQUAL);
 		break;
 	case TOKEN_GREATER:
-		emit_byte(OP_GREATER);
+		emit_byte(parser, OP_GREATER);
 		break;
 	case TOKEN_GREATER_EQUAL:
-		emit_bytes(OP_LESS, OP_NOT);
+		emit_bytes(parser, OP_LESS, OP_NOT);
 		break;
 	case TOKEN_LESS:
-		emit_byte(OP_LESS);
+		emit_byte(parser, OP_LESS);
 		break;
 	case TOKEN_LESS_EQUAL:
-		emit_bytes(OP_GREATER, OP_NOT);
+		emit_bytes(parser, OP_GREATER, OP_NOT);
 		break;
-	case TOKEN_PLUS:
-		emit_byte(OP_ADD);
+	case TOKEN_PLUS: {
+		// The rest of a `+` chain is added by the same instruction, up to an
+		// operand that runs code, which must only run once the additions
+		// before it have succeeded.
+		int operands = 2;
+		while (operands < UINT8_MAX && match(parser, TOKEN_PLUS)) {
+			if (!is_plain_operand(parser)) {
+				emit_add(parser, operands);
+				operands = 1;
+			}
+			parse_precedence(parser, (Precedence)(rule->precedence + 1));
+			operands++;
+		}
+		emit_add(parser, operands);
 		break;
+	}
 	case TOKEN_MINUS:
-		emit_bytes(OP_NEGATE, OP_ADD);
+		emit_bytes(parser, OP_NEGATE, OP_ADD);
 		break;
 	case TOKEN_STAR:
-		emit_byte(OP_MULTIPLY);
+		emit_byte(parser, OP_MULTIPLY);
 		break;
 	case TOKEN_SLASH:
-		emit_byte(OP_DIVIDE);
+		emit_byte(parser, OP_DIVIDE);
 		break;
 	case TOKEN_PERCENT:
-		emit_byte(OP_MODULO);
+		emit_byte(parser, OP_MODULO);
 		break;
 	case TOKEN_STAR_STAR:
-		emit_byte(OP_POW);
+		emit_byte(parser, OP_POW);
 		break;
 	default:
 		return; // Unreachable.
 	}
 }
 
-static void call(bool canAssign)
+static void call(Parser *parser, bool canAssign)
 {
-	uint8_t argCount = argument_list();
-	emit_bytes(OP_CALL, argCount);
+	uint8_t argCount = argument_list(parser);
+	emit_bytes(parser, OP_CALL, argCount);
 }
 
-static void literal(bool canAssign)
+static void literal(Parser *parser, bool canAssign)
 {
-	switch (parser.previous.type) {
+	switch (parser->previous.type) {
 	case TOKEN_FALSE:
-		emit_byte(OP_FALSE);
+		emit_byte(parser, OP_FALSE);
 		break;
 	case TOKEN_TRUE:
-		emit_byte(OP_TRUE);
+		emit_byte(parser, OP_TRUE);
 		break;
 	default:
 		return; // Unreachable.
 	}
 }
 
-static void grouping(bool canAssign)
+static void grouping(Parser *parser, bool canAssign)
 {
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign)
+static void number(Parser *parser, bool canAssign)
 {
-	double value = strtod(parser.previous.start, NULL);
-	emit_constant(NUMBER_VAL(value));
+	double value = strtod(parser->previous.start, NULL);
+	emit_constant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool canAssign)
+static void or_(Parser *parser, bool canAssign)
 {
-	int elseJump = emit_jump(OP_JUMP_IF_FALSE);
-	int endJump = emit_jump(OP_JUMP);
+	int elseJump = emit_jump(parser, OP_JUMP_IF_FALSE);
+	int endJump = emit_jump(parser, OP_JUMP);
 
-	patch_jump(elseJump);
-	emit_byte(OP_POP);
+	patch_jump(parser, elseJump);
+	emit_byte(parser, OP_POP);
 
-	parse_precedence(PREC_OR);
-	patch_jump(endJump);
+	parse_precedence(parser, PREC_OR);
+	patch_jump(parser, endJump);
 }
 
-static void string(bool canAssign)
+static void string(Parser *parser, bool canAssign)
 {
-	emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+	const char *chars = parser->previous.start + 1;
+	int length = parser->previous.length - 2;
+	ObjString *string = parser->borrowStrings ? borrow_string(chars, length) : copy_string(chars, length);
+	emit_constant(parser, OBJ_VAL(string));
 }
 
-static void named_variable(Token name, bool canAssign)
+static void named_variable(Parser *parser, Token name, bool canAssign)
 {
+	Value constant;
+	if (resolve_const(parser, &name, &constant)) {
+		if (canAssign && match(parser, TOKEN_EQUAL)) {
+			error(parser, "Cannot assign to a constant.");
+			expression(parser);
+		}
+		emit_value(parser, constant);
+		return;
+	}
+
 	uint8_t getOp, setOp;
-	int arg = resolve_local(current, &name);
+	bool readOnly = false;
+	int arg = resolve_local(parser, parser->compiler, &name);
 	if (arg != -1) {
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
-	} else if ((arg = resolve_upvalue(current, &name)) != -1) {
+	} else if ((arg = resolve_upvalue(parser, parser->compiler, &name)) != -1) {
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
+	} else if ((arg = resolve_module(parser, &name)) != -1) {
+		getOp = OP_GET_MODULE;
+		setOp = OP_SET_MODULE;
+		ModuleSlot *slot = &parser->module->slots[arg];
+		readOnly = slot->owner->values[slot->index].constant;
 	} else {
-		arg = identifier_constant(&name);
+		arg = identifier_constant(parser, &name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
 
-	if (canAssign && match(TOKEN_EQUAL)) {
-		expression();
-		emit_bytes(setOp, (uint8_t)arg);
+	if (parser->compiler->pure && (getOp == OP_GET_MODULE || getOp == OP_GET_GLOBAL)) {
+		error(parser, "A const fn can only use its parameters, locals and constants.");
+	}
+
+	if (canAssign && match(parser, TOKEN_EQUAL)) {
+		if (readOnly)
+			error(parser, "Cannot assign to a constant.");
+		expression(parser);
+		emit_operand(parser, setOp, arg);
 	} else {
-		emit_bytes(getOp, (uint8_t)arg);
+		emit_operand(parser, getOp, arg);
 	}
 }
 
-static void variable(bool canAssign)
+static void variable(Parser *parser, bool canAssign)
 {
-	named_variable(parser.previous, canAssign);
+	named_variable(parser, parser->previous, canAssign);
 }
 
-static void unary(bool canAssign)
+static void unary(Parser *parser, bool canAssign)
 {
-	TokenType operatorType = parser.previous.type;
+	TokenType operatorType = parser->previous.type;
 
 	// Compile the operand.
-	parse_precedence(PREC_UNARY);
+	parse_precedence(parser, PREC_UNARY);
 
 	// Emit the operator instruction.
 	switch (operatorType) {
 	case TOKEN_NOT:
-		emit_byte(OP_NOT);
+		emit_byte(parser, OP_NOT);
 		break;
 	case TOKEN_MINUS:
-		emit_byte(OP_NEGATE);
+		emit_byte(parser, OP_NEGATE);
 		break;
 	default:
 		return; // Unreachable.
@@ -593,11 +930,13 @@ ParseRule rules[] = {
 	{string, NULL, PREC_NONE},		 // TOKEN_STRING
 	{number, NULL, PREC_NONE},		 // TOKEN_NUMBER
 	{NULL, NULL, PREC_NONE},		 // TOKEN_AND
+	{NULL, NULL, PREC_NONE},		 // TOKEN_CONST
 	{NULL, NULL, PREC_NONE},		 // TOKEN_ELSE
 	{literal, NULL, PREC_NONE},		 // TOKEN_FALSE
 	{NULL, NULL, PREC_NONE},		 // TOKEN_FOR
 	{NULL, NULL, PREC_NONE},		 // TOKEN_FN
 	{NULL, NULL, PREC_NONE},		 // TOKEN_IF
+	{NULL, NULL, PREC_NONE},		 // TOKEN_IMPORT
 	{NULL, NULL, PREC_NONE},		 // TOKEN_LET
 	{NULL, or_, PREC_OR},			 // TOKEN_OR
 	{unary, NULL, PREC_NONE},		 // TOKEN_NOT
@@ -609,26 +948,26 @@ ParseRule rules[] = {
 	{NULL, NULL, PREC_NONE},		 // TOKEN_EOF
 };
 
-static void parse_precedence(Precedence precedence)
+static void parse_precedence(Parser *parser, Precedence precedence)
 {
-	advance();
-	ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+	advance(parser);
+	ParseFn prefix_rule = get_rule(parser->previous.type)->prefix;
 	if (prefix_rule == NULL) {
-		error("Expect expression.");
+		error(parser, "Expect expression.");
 		return;
 	}
 
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
-	prefix_rule(canAssign);
+	prefix_rule(parser, canAssign);
 
-	while (precedence <= get_rule(parser.current.type)->precedence) {
-		advance();
-		ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-		infix_rule(canAssign);
+	while (precedence <= get_rule(parser->current.type)->precedence) {
+		advance(parser);
+		ParseFn infix_rule = get_rule(parser->previous.type)->infix;
+		infix_rule(parser, canAssign);
 	}
 
-	if (canAssign && match(TOKEN_EQUAL)) {
-		error("Invalid assignment target.");
+	if (canAssign && match(parser, TOKEN_EQUAL)) {
+		error(parser, "Invalid assignment target.");
 	}
 }
 
@@ -637,87 +976,260 @@ static ParseRule *get_rule(TokenType type)
 	return &rules[type];
 }
 
-static void expression()
+static void expression(Parser *parser)
 {
-	parse_precedence(PREC_ASSIGNMENT);
+	parse_precedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block()
+static void block(Parser *parser)
 {
-	while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-		declaration();
+	while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+		declaration(parser);
 	}
 
-	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+	consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+static ObjFunction *function_body(Parser *parser, Compiler *compiler, FunctionType type, bool wideJumps)
 {
-	Compiler compiler;
-	init_compiler(&compiler, type);
-	begin_scope();
+	init_compiler(parser, compiler, type, wideJumps);
+	begin_scope(parser);
 
 	// Compile the parameter list.
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-	if (!check(TOKEN_RIGHT_PAREN)) {
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	if (!check(parser, TOKEN_RIGHT_PAREN)) {
 		do {
-			current->function->arity++;
-			if (current->function->arity > 255) {
-				error_at_current("Cannot have more than 255 parameters.");
+			parser->compiler->function->arity++;
+			if (parser->compiler->function->arity > 255) {
+				error_at_current(parser, "Cannot have more than 255 parameters.");
 			}
 
-			uint8_t paramConstant = parse_variable("Expect parameter name.");
-			define_variable(paramConstant);
-		} while (match(TOKEN_COMMA));
+			int paramConstant = parse_variable(parser, "Expect parameter name.");
+			define_variable(parser, paramConstant);
+		} while (match(parser, TOKEN_COMMA));
 	}
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
 
 	// The body.
-	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-	block();
+	consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	block(parser);
+
+	return end_compiler(parser);
+}
+
+static ObjFunction *compile_body(Parser *parser, Compiler *compiler, FunctionType type)
+{
+	// The checkpoint includes the scanner, so the body can be compiled again.
+	Parser checkpoint = *parser;
+
+	ObjFunction *function = function_body(parser, compiler, type, false);
+	if (compiler->jumpOverflow && !parser->hadError) {
+		free_compiler(compiler);
+		*parser = checkpoint;
+		function = function_body(parser, compiler, type, true);
+	}
+	return function;
+}
+
+// Checks the parameter list and skips the body, leaving it for compile_lazy()
+// to compile on the first call.
+static ObjFunction *lazy_function(Parser *parser)
+{
+	ObjFunction *function = new_function();
+	push(OBJ_VAL(function));
+	function->name = copy_string(parser->previous.start, parser->previous.length);
+	function->module = parser->module;
+	function->source = parser->current.start;
+	function->sourceLine = parser->current.line;
+	function->sourceColumn = parser->current.column;
+	// This script's constants are published after its own, in order.
+	function->constCount = parser->compiler->constCount;
+	if (parser->module != NULL)
+		function->constCount += parser->module->constValues.count;
+
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	if (!check(parser, TOKEN_RIGHT_PAREN)) {
+		do {
+			function->arity++;
+			if (function->arity > 255) {
+				error_at_current(parser, "Cannot have more than 255 parameters.");
+			}
+			consume(parser, TOKEN_IDENTIFIER, "Expect parameter name.");
+		} while (match(parser, TOKEN_COMMA));
+	}
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+	int depth = 1;
+	while (depth > 0 && !check(parser, TOKEN_EOF)) {
+		if (check(parser, TOKEN_LEFT_BRACE)) {
+			depth++;
+		} else if (check(parser, TOKEN_RIGHT_BRACE)) {
+			depth--;
+		}
+		advance(parser);
+	}
+	if (depth > 0) {
+		error_at_current(parser, "Expect '}' after block.");
+	}
 
-	// Create the function object.
-	ObjFunction *function = end_compiler();
-	emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+	pop();
+	return function;
+}
 
+static void emit_closure(Parser *parser, ObjFunction *function, Upvalue *upvalues)
+{
+	int constant = make_constant(parser, OBJ_VAL(function));
+	bool wide = constant > UINT8_MAX;
 	for (int i = 0; i < function->upvalueCount; ++i) {
-		emit_byte(compiler.upvalues[i].isLocal ? 1 : 0);
-		emit_byte(compiler.upvalues[i].index);
+		wide = wide || upvalues[i].index > UINT8_MAX;
+	}
+
+	if (wide) {
+		emit_bytes(parser, OP_WIDE, OP_CLOSURE);
+		emit_long(parser, constant);
+	} else {
+		emit_bytes(parser, OP_CLOSURE, (uint8_t)constant);
+	}
+
+	for (int i = 0; i < function->upvalueCount; ++i) {
+		emit_byte(parser, upvalues[i].isLocal ? 1 : 0);
+		if (wide) {
+			emit_long(parser, upvalues[i].index);
+		} else {
+			emit_byte(parser, (uint8_t)upvalues[i].index);
+		}
 	}
 }
 
-static void fn_declaration()
+static void function(Parser *parser, FunctionType type)
 {
-	uint8_t global = parse_variable("Expect function name.");
-	mark_initialized();
-	function(TYPE_FUNCTION);
-	define_variable(global);
+	// Top-level functions can only refer to globals, so their bodies do not
+	// need the enclosing compiler and can wait until they are called.
+	if (parser->lazy && parser->compiler->type == TYPE_SCRIPT && parser->compiler->scopeDepth == 0) {
+		emit_closure(parser, lazy_function(parser), NULL);
+		return;
+	}
+
+	Compiler compiler;
+	ObjFunction *function = compile_body(parser, &compiler, type);
+	emit_closure(parser, function, compiler.upvalues);
+	free_compiler(&compiler);
 }
 
-static void var_declaration()
+static void fn_declaration(Parser *parser)
 {
-	uint8_t global = parse_variable("Expect variable name.");
+	int global = parse_variable(parser, "Expect function name.");
+	mark_initialized(parser);
+	function(parser, TYPE_FUNCTION);
+	define_variable(parser, global);
+}
 
-	if (match(TOKEN_EQUAL)) {
-		expression();
+static void var_declaration(Parser *parser)
+{
+	int global = parse_variable(parser, "Expect variable name.");
+
+	if (match(parser, TOKEN_EQUAL)) {
+		expression(parser);
 	} else {
-		emit_byte(OP_META);
+		emit_byte(parser, OP_META);
+	}
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+	define_variable(parser, global);
+}
+
+static void declare_const(Parser *parser, Token *name)
+{
+	if (const_in_scope(parser, name)) {
+		error(parser, "Already a constant with this name in this scope.");
+	} else if (parser->compiler->scopeDepth > 0) {
+		int local = find_local(parser->compiler, name);
+		if (local != -1 && parser->compiler->locals[local].depth == parser->compiler->scopeDepth)
+			error(parser, "Variable with this name already declared in this scope.");
 	}
-	consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+}
+
+// Its body can only use its parameters, locals and constants, so a call with
+// constant arguments can run while compiling and leave just its result.
+static void const_fn_declaration(Parser *parser)
+{
+	consume(parser, TOKEN_IDENTIFIER, "Expect function name.");
+	Token name = parser->previous;
+	declare_const(parser, &name);
 
-	define_variable(global);
+	Compiler compiler;
+	ObjFunction *function = compile_body(parser, &compiler, TYPE_CONST_FN);
+	add_const(parser, name, OBJ_VAL(function));
+	free_compiler(&compiler);
+
+	if (at_module_level(parser)) {
+		emit_closure(parser, function, NULL);
+		emit_operand(parser, OP_DEFINE_MODULE, resolve_module(parser, &name));
+	}
 }
 
-static void expression_statement()
+// The initializer is compiled like any expression and then evaluated, and
+// its code is dropped: uses of the constant compile to the value itself.
+static void const_declaration(Parser *parser)
 {
-	expression();
-	emit_byte(OP_POP);
-	consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+	if (match(parser, TOKEN_FN)) {
+		const_fn_declaration(parser);
+		return;
+	}
+
+	consume(parser, TOKEN_IDENTIFIER, "Expect constant name.");
+	Token name = parser->previous;
+	declare_const(parser, &name);
+
+	consume(parser, TOKEN_EQUAL, "Expect '=' after constant name.");
+	Chunk *chunk = current_chunk(parser);
+	int start = chunk->count;
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+	if (parser->panicMode)
+		return;
+
+	Value value;
+	if (!evaluate_constant(chunk, start, &value)) {
+		error_at(parser, &name, "Constant must be initialized with a constant expression.");
+		return;
+	}
+	truncate_chunk(chunk, start);
+	add_const(parser, name, value);
+
+	if (at_module_level(parser)) {
+		// Importers read it through its slot, like any other top-level name.
+		emit_value(parser, value);
+		emit_operand(parser, OP_DEFINE_MODULE, resolve_module(parser, &name));
+	}
 }
 
-static void for_statement()
+// The imported names were declared before compiling, and the module's code
+// runs when one of them is first used, so nothing is emitted here.
+static void import_declaration(Parser *parser)
 {
-	begin_scope();
+	consume(parser, TOKEN_STRING, "Expect module path after 'import'.");
+	Token path = parser->previous;
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after module path.");
+
+	if (parser->compiler->type != TYPE_SCRIPT || parser->compiler->scopeDepth > 0) {
+		error_at(parser, &path, "Can only import at the top level.");
+	} else if (find_module(parser->module, path.start + 1, path.length - 2) == NULL) {
+		error_at(parser, &path, "Could not read module.");
+	}
+}
+
+static void expression_statement(Parser *parser)
+{
+	expression(parser);
+	emit_byte(parser, OP_POP);
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+}
+
+static void for_statement(Parser *parser)
+{
+	begin_scope(parser);
 
 	// 1: Grab the name and slot of the loop variable so we can refer to it later.
 	int loopVariable = -1;
@@ -725,157 +1237,162 @@ static void for_statement()
 	loopVariableName.start = NULL;
 	// end.
 
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-	if (match(TOKEN_LET)) {
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+	if (match(parser, TOKEN_LET)) {
 		// 1: Grab the name of the loop variable.
-		loopVariableName = parser.current;
+		loopVariableName = parser->current;
 		// end.
-		var_declaration();
+		var_declaration(parser);
 		// 1: And get its slot.
-		loopVariable = current->localCount - 1;
+		loopVariable = parser->compiler->localCount - 1;
 		// end.
-	} else if (match(TOKEN_SEMICOLON)) {
+	} else if (match(parser, TOKEN_SEMICOLON)) {
 		// No initializer.
 	} else {
-		expression_statement();
+		expression_statement(parser);
 	}
 
-	int loopStart = current_chunk()->count;
+	int loopStart = current_chunk(parser)->count;
 
 	int exitJump = -1;
-	if (!match(TOKEN_SEMICOLON)) {
-		expression();
-		consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+	if (!match(parser, TOKEN_SEMICOLON)) {
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
 		// Jump out of the loop if the condition is false.
-		exitJump = emit_jump(OP_JUMP_IF_FALSE);
-		emit_byte(OP_POP); // Condition.
+		exitJump = emit_jump(parser, OP_JUMP_IF_FALSE);
+		emit_byte(parser, OP_POP); // Condition.
 	}
 
-	if (!match(TOKEN_RIGHT_PAREN)) {
-		int bodyJump = emit_jump(OP_JUMP);
+	if (!match(parser, TOKEN_RIGHT_PAREN)) {
+		int bodyJump = emit_jump(parser, OP_JUMP);
 
-		int incrementStart = current_chunk()->count;
-		expression();
-		emit_byte(OP_POP);
-		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+		int incrementStart = current_chunk(parser)->count;
+		expression(parser);
+		emit_byte(parser, OP_POP);
+		consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-		emit_loop(loopStart);
+		emit_loop(parser, loopStart);
 		loopStart = incrementStart;
-		patch_jump(bodyJump);
+		patch_jump(parser, bodyJump);
 	}
 
 	// 1: If the loop declares a variable...
 	int innerVariable = -1;
 	if (loopVariable != -1) {
 		// 1: Create a scope for the copy...
-		begin_scope();
+		begin_scope(parser);
 		// 1: Define a new variable initialized with the current value of the loop
 		//    variable.
-		emit_bytes(OP_GET_LOCAL, (uint8_t)loopVariable);
-		add_local(loopVariableName);
-		mark_initialized();
+		emit_operand(parser, OP_GET_LOCAL, loopVariable);
+		add_local(parser, loopVariableName);
+		mark_initialized(parser);
 		// 1: Keep track of its slot.
-		innerVariable = current->localCount - 1;
+		innerVariable = parser->compiler->localCount - 1;
 	}
 	// end.
 
-	statement();
+	statement(parser);
 
 	// 3: If the loop declares a variable...
 	if (loopVariable != -1) {
 		// 3: Store the inner variable back in the loop variable.
-		emit_bytes(OP_GET_LOCAL, (uint8_t)innerVariable);
-		emit_bytes(OP_SET_LOCAL, (uint8_t)loopVariable);
-		emit_byte(OP_POP);
+		emit_operand(parser, OP_GET_LOCAL, innerVariable);
+		emit_operand(parser, OP_SET_LOCAL, loopVariable);
+		emit_byte(parser, OP_POP);
 
 		// 4: Close the temporary scope for the copy of the loop variable.
-		end_scope();
+		end_scope(parser);
 	}
 
-	emit_loop(loopStart);
+	emit_loop(parser, loopStart);
 
 	if (exitJump != -1) {
-		patch_jump(exitJump);
-		emit_byte(OP_POP); // Condition.
+		patch_jump(parser, exitJump);
+		emit_byte(parser, OP_POP); // Condition.
 	}
 
-	end_scope();
+	end_scope(parser);
 }
 
-static void if_statement()
+static void if_statement(Parser *parser)
 {
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int thenJump = emit_jump(OP_JUMP_IF_FALSE);
-	emit_byte(OP_POP);
-	statement();
+	int thenJump = emit_jump(parser, OP_JUMP_IF_FALSE);
+	emit_byte(parser, OP_POP);
+	statement(parser);
 
-	int elseJump = emit_jump(OP_JUMP);
-	patch_jump(thenJump);
-	emit_byte(OP_POP);
+	int elseJump = emit_jump(parser, OP_JUMP);
+	patch_jump(parser, thenJump);
+	emit_byte(parser, OP_POP);
 
-	if (match(TOKEN_ELSE))
-		statement();
+	if (match(parser, TOKEN_ELSE))
+		statement(parser);
 
-	patch_jump(elseJump);
+	patch_jump(parser, elseJump);
 }
 
-static void print_statement()
+static void print_statement(Parser *parser)
 {
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'print'.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
-	consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-	emit_byte(OP_PRINT);
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'print'.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+	if (parser->compiler->pure) {
+		error(parser, "A const fn cannot print.");
+	}
+	emit_byte(parser, OP_PRINT);
 }
 
-static void return_statement()
+static void return_statement(Parser *parser)
 {
-	if (current->type == TYPE_SCRIPT) {
-		error("Cannot return from top-level code.");
+	if (parser->compiler->type == TYPE_SCRIPT) {
+		error(parser, "Cannot return from top-level code.");
 	}
 
-	if (match(TOKEN_SEMICOLON)) {
-		emit_return();
+	if (match(parser, TOKEN_SEMICOLON)) {
+		emit_return(parser);
 	} else {
-		expression();
-		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-		emit_byte(OP_RETURN);
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+		emit_byte(parser, OP_RETURN);
 	}
 }
 
-static void while_statement()
+static void while_statement(Parser *parser)
 {
-	int loopStart = current_chunk()->count;
+	int loopStart = current_chunk(parser)->count;
 
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int exitJump = emit_jump(OP_JUMP_IF_FALSE);
+	int exitJump = emit_jump(parser, OP_JUMP_IF_FALSE);
 
-	emit_byte(OP_POP);
-	statement();
+	emit_byte(parser, OP_POP);
+	statement(parser);
 
-	emit_loop(loopStart);
+	emit_loop(parser, loopStart);
 
-	patch_jump(exitJump);
-	emit_byte(OP_POP);
+	patch_jump(parser, exitJump);
+	emit_byte(parser, OP_POP);
 }
 
-static void synchronize()
+static void synchronize(Parser *parser)
 {
-	parser.panicMode = false;
+	parser->panicMode = false;
 
-	while (parser.current.type != TOKEN_EOF) {
-		if (parser.previous.type == TOKEN_SEMICOLON)
+	while (parser->current.type != TOKEN_EOF) {
+		if (parser->previous.type == TOKEN_SEMICOLON)
 			return;
 
-		switch (parser.current.type) {
+		switch (parser->current.type) {
+		case TOKEN_CONST:
 		case TOKEN_FN:
+		case TOKEN_IMPORT:
 		case TOKEN_LET:
 		case TOKEN_FOR:
 		case TOKEN_IF:
@@ -889,67 +1406,167 @@ static void synchronize()
 			;
 		}
 
-		advance();
+		advance(parser);
 	}
 }
 
-static void declaration()
+static void declaration(Parser *parser)
 {
-	if (match(TOKEN_FN)) {
-		fn_declaration();
-	} else if (match(TOKEN_LET)) {
-		var_declaration();
+	if (match(parser, TOKEN_FN)) {
+		fn_declaration(parser);
+	} else if (match(parser, TOKEN_LET)) {
+		var_declaration(parser);
+	} else if (match(parser, TOKEN_CONST)) {
+		const_declaration(parser);
+	} else if (match(parser, TOKEN_IMPORT)) {
+		import_declaration(parser);
 	} else {
-		statement();
+		statement(parser);
 	}
 
-	if (parser.panicMode)
-		synchronize();
+	if (parser->panicMode)
+		synchronize(parser);
 }
 
-static void statement()
+static void statement(Parser *parser)
 {
-	if (match(TOKEN_PRINT)) {
-		print_statement();
-	} else if (match(TOKEN_FOR)) {
-		for_statement();
-	} else if (match(TOKEN_IF)) {
-		if_statement();
-	} else if (match(TOKEN_RETURN)) {
-		return_statement();
-	} else if (match(TOKEN_WHILE)) {
-		while_statement();
-	} else if (match(TOKEN_LEFT_BRACE)) {
-		begin_scope();
-		block();
-		end_scope();
+	if (match(parser, TOKEN_PRINT)) {
+		print_statement(parser);
+	} else if (match(parser, TOKEN_FOR)) {
+		for_statement(parser);
+	} else if (match(parser, TOKEN_IF)) {
+		if_statement(parser);
+	} else if (match(parser, TOKEN_RETURN)) {
+		return_statement(parser);
+	} else if (match(parser, TOKEN_WHILE)) {
+		while_statement(parser);
+	} else if (match(parser, TOKEN_LEFT_BRACE)) {
+		begin_scope(parser);
+		block(parser);
+		end_scope(parser);
 	} else {
-		expression_statement();
+		expression_statement(parser);
 	}
 }
 
-ObjFunction *compile(const char *source)
+static ObjFunction *script(Parser *parser, const char *source, bool wideJumps)
 {
-	init_scanner(source);
+	init_scanner(&parser->scanner, source);
+	parser->hadError = false;
+	parser->panicMode = false;
+
 	Compiler compiler;
-	init_compiler(&compiler, TYPE_SCRIPT);
-	parser.hadError = false;
-	parser.panicMode = false;
+	init_compiler(parser, &compiler, TYPE_SCRIPT, wideJumps);
+
+	advance(parser);
+	while (!match(parser, TOKEN_EOF)) {
+		declaration(parser);
+	}
 
-	advance();
-	while (!match(TOKEN_EOF)) {
-		declaration();
+	if (!parser->hadError && !compiler.jumpOverflow) {
+		publish_consts(parser);
 	}
+	ObjFunction *current_function = end_compiler(parser);
+	free_compiler(&compiler);
 
-	ObjFunction *current_function = end_compiler();
-	return parser.hadError ? NULL : current_function;
+	if (compiler.jumpOverflow && !wideJumps && !parser->hadError) {
+		return script(parser, source, true);
+	}
+	return parser->hadError ? NULL : current_function;
+}
+
+void init_parser(Parser *parser)
+{
+	parser->compiler = NULL;
+	parser->module = NULL;
+	parser->hadError = false;
+	parser->panicMode = false;
+	parser->lazy = false;
+	parser->borrowStrings = false;
+	parser->constLimit = INT_MAX;
+	parser->time = 0;
+	parser->next = NULL;
+}
+
+static void begin_compile(Parser *parser)
+{
+	parser->next = activeParsers;
+	activeParsers = parser;
+}
+
+static void end_compile(Parser *parser, clock_t start)
+{
+	Parser **link = &activeParsers;
+	while (*link != parser) {
+		link = &(*link)->next;
+	}
+	*link = parser->next;
+	parser->time += clock() - start;
+}
+
+ObjFunction *compile(Parser *parser, const char *source)
+{
+	clock_t start = clock();
+	begin_compile(parser);
+	ObjFunction *function = script(parser, source, false);
+	if (function != NULL) {
+		pack_function(function);
+	}
+	end_compile(parser, start);
+	return function;
+}
+
+bool compile_lazy(Parser *parser, ObjFunction *function)
+{
+	clock_t start = clock();
+	begin_compile(parser);
+	seek_scanner(&parser->scanner, function->source, function->sourceLine, function->sourceColumn);
+	parser->module = function->module;
+	int constLimit = parser->constLimit;
+	parser->constLimit = function->constCount;
+	parser->hadError = false;
+	parser->panicMode = false;
+
+	// Stand in for the name token the body was declared with.
+	parser->current.type = TOKEN_IDENTIFIER;
+	parser->current.start = function->name->chars;
+	parser->current.length = function->name->length;
+	parser->current.line = function->sourceLine;
+	parser->current.column = function->sourceColumn;
+	advance(parser);
+
+	Compiler compiler;
+	ObjFunction *compiled = compile_body(parser, &compiler, TYPE_FUNCTION);
+	free_compiler(&compiler);
+
+	if (!parser->hadError) {
+		function->chunk = compiled->chunk;
+		init_chunk(&compiled->chunk);
+		function->source = NULL;
+		pack_function(function);
+	}
+
+	parser->constLimit = constLimit;
+	end_compile(parser, start);
+	return !parser->hadError;
+}
+
+double compile_time(Parser *parser)
+{
+	return (double)parser->time / CLOCKS_PER_SEC;
 }
 
 void mark_compiler_roots()
 {
-	Compiler *compiler = current;
-	while (compiler != NULL) {
-		mark_object((Obj *)compiler->function);
-		compiler = compiler->enclosing;
+	for (Parser *parser = activeParsers; parser != NULL; parser = parser->next) {
+		mark_object((Obj *)parser->module);
+		Compiler *compiler = parser->compiler;
+		while (compiler != NULL) {
+			mark_object((Obj *)compiler->function);
+			for (int i = 0; i < compiler->constCount; ++i) {
+				mark_value(compiler->consts[i].value);
+			}
+			compiler = compiler->enclosing;
+		}
 	}
 }
@@ -5,9 +5,13 @@
 #include "core/object.h"
 #include "core/value.h"
 
-void disassemble_chunk(Chunk *chunk, const char *name)
+void disassemble_chunk(Chunk *chunk, ObjString *name)
 {
-	printf("== %s ==\n", name);
+	if (name == NULL) {
+		printf("== <script> ==\n");
+	} else {
+		printf("== %.*s ==\n", name->length, name->chars);
+	}
 
 	for (int offset = 0; offset < chunk->count;) {
 		offset = disassemble_instruction(chunk, offset);
@@ -23,9 +27,14 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset)
 	return offset + 2;
 }
 
+static uint32_t read_long(Chunk *chunk, int offset)
+{
+	return chunk->code[offset] | (chunk->code[offset + 1] << 8) | (chunk->code[offset + 2] << 16);
+}
+
 static int long_constant_instruction(const char *name, Chunk *chunk, int offset)
 {
-	uint32_t constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
+	uint32_t constant = read_long(chunk, offset + 1);
 	printf("%-16s %4u '", name, constant);
 	print_value(chunk->constants.values[constant]);
 	printf("'\n");
@@ -53,13 +62,86 @@ static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset
 	return offset + 3;
 }
 
+static int closure_instruction(const char *name, Chunk *chunk, int offset, bool wide)
+{
+	offset++;
+	uint32_t constant = wide ? read_long(chunk, offset) : chunk->code[offset];
+	offset += wide ? 3 : 1;
+	printf("%-16s %4u ", name, constant);
+	print_value(chunk->constants.values[constant]);
+	printf("\n");
+
+	ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+	for (int j = 0; j < function->upvalueCount; j++) {
+		int start = offset;
+		int isLocal = chunk->code[offset++];
+		uint32_t index = wide ? read_long(chunk, offset) : chunk->code[offset];
+		offset += wide ? 3 : 1;
+		printf("%04d      |                     %s %u\n", start, isLocal ? "local" : "upvalue", index);
+	}
+	return offset;
+}
+
+// The instruction after `OP_WIDE` carries 24-bit operands; `offset` points at
+// that instruction.
+static int wide_instruction(Chunk *chunk, int offset)
+{
+	uint32_t operand = read_long(chunk, offset + 1);
+
+	switch (chunk->code[offset]) {
+	case OP_CONSTANT:
+		return long_constant_instruction("OP_WIDE_CONSTANT", chunk, offset);
+	case OP_GET_GLOBAL:
+		return long_constant_instruction("OP_WIDE_GET_GLOBAL", chunk, offset);
+	case OP_DEFINE_GLOBAL:
+		return long_constant_instruction("OP_WIDE_DEFINE_GLOBAL", chunk, offset);
+	case OP_SET_GLOBAL:
+		return long_constant_instruction("OP_WIDE_SET_GLOBAL", chunk, offset);
+	case OP_GET_LOCAL:
+		printf("%-16s %4u\n", "OP_WIDE_GET_LOCAL", operand);
+		return offset + 4;
+	case OP_SET_LOCAL:
+		printf("%-16s %4u\n", "OP_WIDE_SET_LOCAL", operand);
+		return offset + 4;
+	case OP_GET_UPVALUE:
+		printf("%-16s %4u\n", "OP_WIDE_GET_UPVALUE", operand);
+		return offset + 4;
+	case OP_SET_UPVALUE:
+		printf("%-16s %4u\n", "OP_WIDE_SET_UPVALUE", operand);
+		return offset + 4;
+	case OP_GET_MODULE:
+		printf("%-16s %4u\n", "OP_WIDE_GET_MODULE", operand);
+		return offset + 4;
+	case OP_DEFINE_MODULE:
+		printf("%-16s %4u\n", "OP_WIDE_DEFINE_MODULE", operand);
+		return offset + 4;
+	case OP_SET_MODULE:
+		printf("%-16s %4u\n", "OP_WIDE_SET_MODULE", operand);
+		return offset + 4;
+	case OP_JUMP:
+		printf("%-16s %4d -> %u\n", "OP_WIDE_JUMP", offset - 1, offset + 4 + operand);
+		return offset + 4;
+	case OP_JUMP_IF_FALSE:
+		printf("%-16s %4d -> %u\n", "OP_WIDE_JUMP_IF_FALSE", offset - 1, offset + 4 + operand);
+		return offset + 4;
+	case OP_LOOP:
+		printf("%-16s %4d -> %u\n", "OP_WIDE_LOOP", offset - 1, offset + 4 - operand);
+		return offset + 4;
+	case OP_CLOSURE:
+		return closure_instruction("OP_WIDE_CLOSURE", chunk, offset, true);
+	default:
+		printf("Unknown wide opcode %d\n", chunk->code[offset]);
+		return offset + 1;
+	}
+}
+
 int disassemble_instruction(Chunk *chunk, int offset)
 {
 	printf("%04d ", offset);
 
-	int line = get_line(&chunk->lines, offset);
+	int line = get_line(chunk, offset);
 
-	if (offset > 0 && line == get_line(&chunk->lines, offset - 1)) {
+	if (offset > 0 && line == get_line(chunk, offset - 1)) {
 		printf("   | ");
 	} else {
 		printf("%4d ", line);
@@ -87,6 +169,12 @@ int disassemble_instruction(Chunk *chunk, int offset)
 		return byte_instruction("OP_GET_UPVALUE", chunk, offset);
 	case OP_SET_UPVALUE:
 		return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+	case OP_GET_MODULE:
+		return byte_instruction("OP_GET_MODULE", chunk, offset);
+	case OP_DEFINE_MODULE:
+		return byte_instruction("OP_DEFINE_MODULE", chunk, offset);
+	case OP_SET_MODULE:
+		return byte_instruction("OP_SET_MODULE", chunk, offset);
 	case OP_DEFINE_GLOBAL:
 		return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
 	case OP_SET_GLOBAL:
@@ -99,6 +187,8 @@ int disassemble_instruction(Chunk *chunk, int offset)
 		return simple_instruction("OP_LESS", offset);
 	case OP_ADD:
 		return simple_instruction("OP_ADD", offset);
+	case OP_ADD_MANY:
+		return byte_instruction("OP_ADD_MANY", chunk, offset);
 	case OP_MULTIPLY:
 		return simple_instruction("OP_MULTIPLY", offset);
 	case OP_DIVIDE:
@@ -121,27 +211,18 @@ int disassemble_instruction(Chunk *chunk, int offset)
 		return jump_instruction("OP_LOOP", -1, chunk, offset);
 	case OP_CALL:
 		return byte_instruction("OP_CALL", chunk, offset);
-	case OP_CLOSURE: {
-		offset++;
-		uint8_t constant = chunk->code[offset++];
-		printf("%-16s %4d ", "OP_CLOSURE", constant);
-		print_value(chunk->constants.values[constant]);
-		printf("\n");
-
-		ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-		for (int j = 0; j < function->upvalueCount; j++) {
-			int isLocal = chunk->code[offset++];
-			int index = chunk->code[offset++];
-			printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
-		}
-		return offset;
-	}
+	case OP_CLOSURE:
+		return closure_instruction("OP_CLOSURE", chunk, offset, false);
 	case OP_CLOSE_UPVALUE:
 		return simple_instruction("OP_CLOSE_UPVALUE", offset);
 	case OP_CONSTANT_LONG:
 		return long_constant_instruction("OP_CONSTANT_LONG", chunk, offset);
+	case OP_WIDE:
+		return wide_instruction(chunk, offset + 1);
 	case OP_RETURN:
 		return simple_instruction("OP_RETURN", offset);
+	case OP_END_MODULE:
+		return simple_instruction("OP_END_MODULE", offset);
 	default:
 		printf("Unknown opcode %d\n", instruction);
 		return offset + 1;
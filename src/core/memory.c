@@ -1,5 +1,16 @@
+#include <limits.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "core/arena.h"
 #include "core/common.h"
 #include "core/compiler.h"
 #include "core/memory.h"
@@ -7,37 +18,741 @@
 
 #ifdef DEBUG_LOG_GC
 #include "core/debug.h"
-#include <stdio.h>
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+// During an incremental collection, a step runs each time this many more bytes
+// are allocated, and checks the time after this many objects.
+#define GC_STEP_SIZE (64 * 1024)
+#define GC_STEP_WORK 64
+// Otherwise, that many more bytes sweep this many pages.
+#define GC_SWEEP_PAGES 16
+
+// The collector thread marks this many objects at a time, and lets the VM
+// store into the heap in between.
+#define GC_MARK_BATCH 256
+
+// Young objects are laid out back to back, so they can be walked.
+#define YOUNG_SIZE(size) (((size) + 7) & ~(size_t)7)
+
+// Old objects live in pages of PAGE_SIZE bytes, aligned on that size, which
+// hold cells of a single size, one of `cellSizes`. Larger objects get a page of
+// their own. The mark bits and the bits of the cells in
+// use are kept in the page header, one per granule, so neither sweeping nor
+// allocation reads the cells. Functions and modules own memory outside of the
+// heap, and are kept apart in pages that sweeping finalizes.
+#define PAGE_SIZE (64 * 1024)
+#define GRANULE 16
+#define CELL_MAX 512
+#define BITMAP_WORDS (PAGE_SIZE / GRANULE / 64)
+#define PAGE_HEADER ((sizeof(Page) + GRANULE - 1) & ~(size_t)(GRANULE - 1))
+// Empty pages kept for any class to reuse, rather than handed back.
+#define EMPTY_PAGES_MAX 16
+
+// With `vm.gcCompact`, a collection asks for compaction when the free cells of
+// its size classes, beyond a page for each, add up to at least COMPACT_MIN
+// bytes and to a quarter of the pages.
+#define COMPACT_MIN (1024 * 1024)
+#define COMPACT_FRACTION 4
+
+// Upvalues and closures with one upvalue take 32 bytes, and each more upvalue
+// 8 more. Strings take 33 and their length; modules 96 and functions 152.
+// Cells that are finalized start on a granule, so that sweeping can find them
+// from their bit: functions take 160.
+static const size_t cellSizes[] = {
+	16, 24, 32, 40, 48, 56, 64, 72, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+};
+
+#define CLASS_COUNT (int)(sizeof(cellSizes) / sizeof(cellSizes[0]))
+typedef struct sSizeClass SizeClass;
+
+typedef struct sPage {
+	// In `heap.pages` once swept, and in its class's `unswept` before.
+	struct sPage *next;
+	// In its class's `available` while it may have free cells.
+	struct sPage *nextAvailable;
+	SizeClass *sizeClass;
+	size_t cellSize;
+	int cellCount;
+	bool finalizes;
+	uint64_t marks[BITMAP_WORDS];
+	uint64_t used[BITMAP_WORDS];
+} Page;
+
+// Cells are taken from `current`, from `cursor` on, and then from the pages
+// swept so far. When those are full, the class sweeps one more of its pages.
+struct sSizeClass {
+	size_t cellSize;
+	Page *current;
+	int cursor;
+	Page *available;
+	Page *unswept;
+	// The bytes of the free cells its pages were swept with.
+	size_t freeBytes;
+};
+
+static struct {
+	Page *pages;
+	SizeClass classes[CLASS_COUNT];
+	SizeClass finalizing[CLASS_COUNT];
+	SizeClass large;
+	// The class of each size up to CELL_MAX, in steps of 8 bytes.
+	uint8_t classOf[CELL_MAX / 8 + 1];
+	int emptyCount;
+	Page *empty;
+	// Left to sweep before the next collection can start, and the bytes of
+	// the cells in the pages swept so far.
+	int unswept;
+	size_t sweptBytes;
+	// Copies of young objects that a young collection has yet to scan.
+	int promotedCount;
+	int promotedCapacity;
+	Obj **promoted;
+	// The bytes of the nursery, the pages' headers and the collector's stacks,
+	// which are not in `vm.bytesAllocated`. The stacks grow on the collector's
+	// threads too.
+	atomic_size_t overhead;
+} heap;
+
+// While the collector thread marks, it owns the gray stack, and both its
+// batches and the VM's stores into old objects hold `lock`. `waiting` counts
+// the VM's attempts to take it, which the thread makes way for.
+static struct {
+	pthread_t thread;
+	bool started;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	bool start;
+	bool quit;
+	atomic_bool done;
+	atomic_int waiting;
+} marker = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.done = true,
+};
+
+// Marking that stops the script is shared between `vm.gcThreads` workers: the
+// VM and as many helper threads. Each keeps its gray objects on a stack of its
+// own, and moves the oldest half into its deque whenever that is empty, for the
+// others to steal once they run out. A worker is active while it may still find
+// or make gray objects, and the marking is over when none is.
+#define DEQUE_SIZE 4096
+// A worker shares its gray objects once it has this many.
+#define SHARE_MIN 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address) ((void)(address))
+#endif
+
+typedef struct {
+	atomic_long top;
+	atomic_long bottom;
+	_Atomic(Obj *) items[DEQUE_SIZE];
+} Deque;
+
+typedef struct {
+	Deque deque;
+	int grayCount;
+	int grayCapacity;
+	Obj **grayStack;
+} Worker;
+
+static struct {
+	pthread_t threads[GC_THREADS_MAX];
+	int started;
+	Worker *workers;
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	long round;
+	int running;
+	bool quit;
+	atomic_int active;
+} markers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+// The worker of the running thread, while marking is shared.
+static _Thread_local Worker *worker;
+
+static void lock_heap()
+{
+	atomic_fetch_add(&marker.waiting, 1);
+	pthread_mutex_lock(&marker.lock);
+	atomic_fetch_sub(&marker.waiting, 1);
+}
+
+static void unlock_heap()
+{
+	pthread_mutex_unlock(&marker.lock);
+}
+
+static bool marking_concurrently()
+{
+	return vm.gcConcurrent && vm.gcPhase == GC_MARK;
+}
+
+static void step_garbage();
+static void begin_concurrent_marking();
+static bool sweep(int count);
+static void end_sweeping();
+
+// Loading code stores into objects without write barriers, so marking never
+// runs alongside it; that takes a whole collection.
+static void collect_when_due()
+{
+	if (vm.heapLimit > 0 && !vm.outOfMemory && heap_size() > vm.heapLimit) {
+		// The last chance: a collection that is under way may have started
+		// before the garbage it needs to free was made.
+		collect_garbage();
+		if (heap_size() > vm.heapLimit)
+			collect_garbage();
+		vm.outOfMemory = heap_size() > vm.heapLimit;
+		return;
+	}
+
+	if (marking_concurrently()) {
+		if (!atomic_load(&marker.done))
+			return;
+		finish_marking();
+	}
+
+#ifndef DEBUG_STRESS_GC
+	if (vm.gcPhase == GC_IDLE ? vm.bytesAllocated <= vm.nextGC : vm.bytesAllocated < vm.nextStep)
+		return;
+#endif
+
+	if (vm.gcConcurrent && vm.gcPhase == GC_IDLE && vm.loading == 0) {
+		begin_concurrent_marking();
+	} else if (vm.gcStepTime > 0 && (vm.gcPhase == GC_SWEEP || vm.loading == 0)) {
+		step_garbage();
+	} else if (vm.gcPhase == GC_SWEEP) {
+		// Allocation sweeps the pages of the classes it uses, and this the rest.
+		if (!sweep(GC_SWEEP_PAGES))
+			end_sweeping();
+		vm.nextStep = vm.bytesAllocated + GC_STEP_SIZE;
+	} else {
+		collect_garbage();
+	}
+}
+
+static void *reallocate_libc(void *pointer, size_t oldSize, size_t newSize, void *userData)
+{
+	(void)oldSize;
+	(void)userData;
+	if (newSize == 0) {
+		free(pointer);
+		return NULL;
+	}
+	return realloc(pointer, newSize);
+}
+
+static void *allocate_aligned_libc(size_t size, size_t alignment, void *userData)
+{
+	(void)userData;
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void *memory;
+	if (posix_memalign(&memory, alignment, size) != 0)
+		return NULL;
+	return memory;
+#endif
+}
+
+static void free_aligned_libc(void *pointer, size_t size, void *userData)
+{
+	(void)size;
+	(void)userData;
+#ifdef _WIN32
+	_aligned_free(pointer);
+#else
+	free(pointer);
+#endif
+}
+
+static void out_of_memory()
+{
+	fprintf(stderr, "Out of memory.\n");
+	exit(EXIT_FAILURE);
+}
 
 void *reallocate(void *previous, size_t oldSize, size_t newSize)
 {
 	vm.bytesAllocated += newSize - oldSize;
 
-	if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
+	if (newSize > oldSize)
+		collect_when_due();
+
+	void *result = vm.allocator.reallocate(previous, oldSize, newSize, vm.allocator.userData);
+	if (result == NULL && newSize > 0) {
 		collect_garbage();
+		result = vm.allocator.reallocate(previous, oldSize, newSize, vm.allocator.userData);
+		if (result == NULL)
+			out_of_memory();
+	}
+	return result;
+}
+
+// For the collector's own memory. It must not start a collection, and may run
+// on the collector's threads.
+static void *reallocate_gc(void *previous, size_t oldSize, size_t newSize)
+{
+	void *result = vm.allocator.reallocate(previous, oldSize, newSize, vm.allocator.userData);
+	if (result == NULL && newSize > 0)
+		out_of_memory();
+	atomic_fetch_add_explicit(&heap.overhead, newSize - oldSize, memory_order_relaxed);
+	return result;
+}
+
+size_t heap_size()
+{
+	return vm.bytesAllocated + atomic_load_explicit(&heap.overhead, memory_order_relaxed);
+}
+
+void *allocate_young(size_t size)
+{
+	size = YOUNG_SIZE(size);
+	// Calls the compiler makes keep everything old, as the compiler holds
+	// pointers that a young collection would not update.
+	if (size > NURSERY_MAX_OBJECT || vm.evaluating)
+		return NULL;
+
+#ifdef DEBUG_STRESS_GC
+	collect_young();
 #endif
-		if (vm.bytesAllocated > vm.nextGC) {
-			collect_garbage();
+	if (size > (size_t)(vm.nurseryEnd - vm.nurseryTop))
+		collect_young();
+
+	void *object = vm.nurseryTop;
+	vm.nurseryTop += size;
+	return object;
+}
+
+void init_heap(const Allocator *allocator)
+{
+	if (allocator != NULL) {
+		vm.allocator = *allocator;
+	} else {
+		vm.allocator.reallocate = reallocate_libc;
+		vm.allocator.allocateAligned = allocate_aligned_libc;
+		vm.allocator.freeAligned = free_aligned_libc;
+		vm.allocator.userData = NULL;
+	}
+
+	vm.nursery = reallocate_gc(NULL, 0, NURSERY_SIZE);
+	vm.nurseryTop = vm.nursery;
+	vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
+
+	int index = 0;
+	for (size_t size = 0; size <= CELL_MAX; size += 8) {
+		if (size > cellSizes[index])
+			index++;
+		heap.classOf[size / 8] = (uint8_t)index;
+	}
+	for (int i = 0; i < CLASS_COUNT; ++i) {
+		heap.classes[i].cellSize = cellSizes[i];
+		heap.finalizing[i].cellSize = cellSizes[i];
+	}
+}
+
+static int count_bits(uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_popcountll(bits);
+#else
+	int count = 0;
+	for (; bits != 0; bits &= bits - 1) {
+		count++;
+	}
+	return count;
+#endif
+}
+
+static int lowest_bit(uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(bits);
+#else
+	int index = 0;
+	for (; (bits & 1) == 0; bits >>= 1) {
+		index++;
+	}
+	return index;
+#endif
+}
+
+#define BIT(index) ((uint64_t)1 << ((index) % 64))
+
+static Page *page_of(void *cell)
+{
+	return (Page *)((uintptr_t)cell & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static size_t granule_of(Page *page, void *cell)
+{
+	return (size_t)((uint8_t *)cell - (uint8_t *)page) / GRANULE;
+}
+
+// Sets the mark of `object`, and tells whether it was not set yet. Young
+// objects keep theirs in their header. Marks are set from more than one thread
+// while marking is shared, or while it runs alongside the VM.
+static bool set_mark(Obj *object)
+{
+	if (is_young(object)) {
+		atomic_bool *mark = (atomic_bool *)&object->isMarked;
+		if (atomic_load_explicit(mark, memory_order_relaxed))
+			return false;
+		if (worker != NULL)
+			return !atomic_exchange_explicit(mark, true, memory_order_relaxed);
+		atomic_store_explicit(mark, true, memory_order_relaxed);
+		return true;
+	}
+
+	Page *page = page_of(object);
+	size_t granule = granule_of(page, object);
+	_Atomic uint64_t *word = (_Atomic uint64_t *)&page->marks[granule / 64];
+	uint64_t marks = atomic_load_explicit(word, memory_order_relaxed);
+	if (marks & BIT(granule))
+		return false;
+	if (worker != NULL || vm.gcConcurrent)
+		return !(atomic_fetch_or_explicit(word, BIT(granule), memory_order_relaxed) & BIT(granule));
+	atomic_store_explicit(word, marks | BIT(granule), memory_order_relaxed);
+	return true;
+}
+
+bool is_marked(Obj *object)
+{
+	if (is_young(object))
+		return object->isMarked;
+
+	Page *page = page_of(object);
+	size_t granule = granule_of(page, object);
+	return (page->marks[granule / 64] & BIT(granule)) != 0;
+}
+
+static Page *new_page(size_t size, SizeClass *sizeClass, size_t cellSize, int cellCount, bool finalizes)
+{
+	void *memory = NULL;
+	if (size == PAGE_SIZE && heap.empty != NULL) {
+		memory = heap.empty;
+		heap.empty = heap.empty->next;
+		heap.emptyCount--;
+	} else {
+		memory = vm.allocator.allocateAligned(size, PAGE_SIZE, vm.allocator.userData);
+		if (memory == NULL)
+			out_of_memory();
+		atomic_fetch_add_explicit(&heap.overhead, PAGE_HEADER, memory_order_relaxed);
+	}
+
+	Page *page = memory;
+	page->next = heap.pages;
+	page->nextAvailable = NULL;
+	page->sizeClass = sizeClass;
+	page->cellSize = cellSize;
+	page->cellCount = cellCount;
+	page->finalizes = finalizes;
+	memset(page->marks, 0, sizeof(page->marks));
+	memset(page->used, 0, sizeof(page->used));
+	heap.pages = page;
+	return page;
+}
+
+static void free_page(Page *page)
+{
+	size_t size = page->sizeClass == &heap.large ? PAGE_HEADER + page->cellSize : PAGE_SIZE;
+	atomic_fetch_sub_explicit(&heap.overhead, PAGE_HEADER, memory_order_relaxed);
+	vm.allocator.freeAligned(page, size, vm.allocator.userData);
+}
+
+static void finalize_object(Obj *object);
+
+// Frees the cells that were not marked, or the whole page if none was, and
+// clears the marks for the next collection.
+static void sweep_page(Page *page)
+{
+	int used = 0;
+	int live = 0;
+	for (int i = 0; i < BITMAP_WORDS; ++i) {
+		if (page->finalizes) {
+			for (uint64_t dead = page->used[i] & ~page->marks[i]; dead != 0; dead &= dead - 1) {
+				finalize_object((Obj *)((uint8_t *)page + (i * 64 + lowest_bit(dead)) * GRANULE));
+			}
 		}
+		used += count_bits(page->used[i]);
+		page->used[i] &= page->marks[i];
+		live += count_bits(page->used[i]);
+		page->marks[i] = 0;
 	}
 
-	if (newSize == 0) {
-		free(previous);
+	heap.unswept--;
+	vm.bytesAllocated -= (size_t)(used - live) * page->cellSize;
+	if (live == 0) {
+		if (page->sizeClass != &heap.large && heap.emptyCount < EMPTY_PAGES_MAX) {
+			page->next = heap.empty;
+			heap.empty = page;
+			heap.emptyCount++;
+		} else {
+			free_page(page);
+		}
+		return;
+	}
+
+	page->next = heap.pages;
+	heap.pages = page;
+	if (page->sizeClass != &heap.large) {
+		heap.sweptBytes += (size_t)page->cellCount * page->cellSize;
+		page->sizeClass->freeBytes += (size_t)(page->cellCount - live) * page->cellSize;
+	}
+	if (live < page->cellCount && page->sizeClass != &heap.large) {
+		page->nextAvailable = page->sizeClass->available;
+		page->sizeClass->available = page;
+	}
+}
+
+static void *allocate_large(size_t size)
+{
+	// Sweeping frees large objects before more of them are made.
+	if (heap.large.unswept != NULL) {
+		Page *page = heap.large.unswept;
+		heap.large.unswept = page->next;
+		sweep_page(page);
+		if (heap.unswept == 0)
+			end_sweeping();
+	}
+
+	Page *page = new_page(PAGE_HEADER + size, &heap.large, size, 1, false);
+	page->used[PAGE_HEADER / GRANULE / 64] |= BIT(PAGE_HEADER / GRANULE);
+	vm.bytesAllocated += size;
+	return (uint8_t *)page + PAGE_HEADER;
+}
+
+// Takes a free cell of at least `size` bytes.
+static void *allocate_cell(size_t size, bool finalizes)
+{
+	if (size > CELL_MAX)
+		return allocate_large(size);
+
+	int index = heap.classOf[(size + 7) / 8];
+	SizeClass *sizeClass = finalizes ? &heap.finalizing[index] : &heap.classes[index];
+	size_t cellSize = sizeClass->cellSize;
+
+	for (;;) {
+		Page *page = sizeClass->current;
+		if (page != NULL) {
+			for (int i = sizeClass->cursor; i < page->cellCount; ++i) {
+				size_t granule = (PAGE_HEADER + i * cellSize) / GRANULE;
+				if ((page->used[granule / 64] & BIT(granule)) == 0) {
+					page->used[granule / 64] |= BIT(granule);
+					sizeClass->cursor = i + 1;
+					vm.bytesAllocated += cellSize;
+					return (uint8_t *)page + PAGE_HEADER + i * cellSize;
+				}
+			}
+		}
+
+		sizeClass->cursor = 0;
+		if (sizeClass->available != NULL) {
+			sizeClass->current = sizeClass->available;
+			sizeClass->available = sizeClass->current->nextAvailable;
+		} else if (sizeClass->unswept != NULL) {
+			sizeClass->current = NULL;
+			page = sizeClass->unswept;
+			sizeClass->unswept = page->next;
+			sweep_page(page);
+			if (heap.unswept == 0)
+				end_sweeping();
+		} else {
+			sizeClass->current =
+				new_page(PAGE_SIZE, sizeClass, cellSize, (int)((PAGE_SIZE - PAGE_HEADER) / cellSize), finalizes);
+		}
+	}
+}
+
+void *allocate_old(size_t size, ObjType type)
+{
+	collect_when_due();
+
+	void *object = allocate_cell(size, type == OBJ_FUNCTION || type == OBJ_MODULE);
+	// Marking will not come back for it.
+	if (vm.gcPhase == GC_MARK)
+		set_mark(object);
+	return object;
+}
+
+void remember_object(Obj *object)
+{
+	object->isRemembered = true;
+
+	if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+		int oldCapacity = vm.rememberedCapacity;
+		vm.rememberedCapacity = GROW_CAPACITY(oldCapacity);
+		vm.remembered =
+			reallocate_gc(vm.remembered, sizeof(Obj *) * oldCapacity, sizeof(Obj *) * vm.rememberedCapacity);
+	}
+
+	vm.remembered[vm.rememberedCount++] = object;
+}
+
+// Incremental marking must not miss the new value. Marking on the collector
+// thread snapshots what young objects point at, and has to be told about the
+// old value, which it may not have reached yet.
+void write_value_marking(Obj *object, Value *field, Value value)
+{
+	if (!vm.gcConcurrent) {
+		*field = value;
+		mark_value(value);
+		return;
+	}
+	if (is_young(object)) {
+		*field = value;
+		return;
+	}
+
+	lock_heap();
+	Value old = *field;
+	*field = value;
+	unlock_heap();
+	if (IS_OBJ(old))
+		shade_object(AS_OBJ(old));
+}
+
+void write_object_marking(Obj *object, Obj **field, Obj *value)
+{
+	if (!vm.gcConcurrent) {
+		*field = value;
+		mark_object(value);
+		return;
+	}
+	if (is_young(object)) {
+		*field = value;
+		return;
+	}
+
+	lock_heap();
+	Obj *old = *field;
+	*field = value;
+	unlock_heap();
+	if (old != NULL)
+		shade_object(old);
+}
+
+void shade_object(Obj *object)
+{
+	if (!vm.gcConcurrent) {
+		mark_object(object);
+		return;
+	}
+	if (is_young(object))
+		return;
+
+	if (vm.satbCapacity < vm.satbCount + 1) {
+		int oldCapacity = vm.satbCapacity;
+		vm.satbCapacity = GROW_CAPACITY(oldCapacity);
+		vm.satb = reallocate_gc(vm.satb, sizeof(Obj *) * oldCapacity, sizeof(Obj *) * vm.satbCapacity);
+	}
+
+	vm.satb[vm.satbCount++] = object;
+}
+
+static void push_gray(Obj *object)
+{
+	if (vm.grayCapacity < vm.grayCount + 1) {
+		int oldCapacity = vm.grayCapacity;
+		vm.grayCapacity = GROW_CAPACITY(oldCapacity);
+		vm.grayStack = reallocate_gc(vm.grayStack, sizeof(Obj *) * oldCapacity, sizeof(Obj *) * vm.grayCapacity);
+	}
+
+	vm.grayStack[vm.grayCount++] = object;
+}
+
+static void push_worker(Worker *self, Obj *object)
+{
+	if (self->grayCapacity < self->grayCount + 1) {
+		int oldCapacity = self->grayCapacity;
+		self->grayCapacity = GROW_CAPACITY(oldCapacity);
+		self->grayStack =
+			reallocate_gc(self->grayStack, sizeof(Obj *) * oldCapacity, sizeof(Obj *) * self->grayCapacity);
+	}
+
+	self->grayStack[self->grayCount++] = object;
+}
+
+// Only the owner puts objects in its deque, and only when it is empty.
+static void share_gray(Worker *self)
+{
+	Deque *deque = &self->deque;
+	long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	if (top < bottom)
+		return;
+
+	int count = self->grayCount / 2 < DEQUE_SIZE ? self->grayCount / 2 : DEQUE_SIZE;
+	for (int i = 0; i < count; ++i) {
+		atomic_store_explicit(&deque->items[(bottom + i) % DEQUE_SIZE], self->grayStack[i], memory_order_relaxed);
+	}
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, bottom + count, memory_order_relaxed);
+
+	self->grayCount -= count;
+	memmove(self->grayStack, self->grayStack + count, sizeof(Obj *) * self->grayCount);
+}
+
+// Only the owner takes from the bottom.
+static Obj *take_deque(Deque *deque)
+{
+	long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+	if (top > bottom) {
+		atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
 		return NULL;
 	}
 
-	return realloc(previous, newSize);
+	Obj *object = atomic_load_explicit(&deque->items[bottom % DEQUE_SIZE], memory_order_relaxed);
+	if (top == bottom) {
+		// The last one: a thief may be after it too.
+		if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+													 memory_order_relaxed))
+			object = NULL;
+		atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+	}
+	return object;
+}
+
+static Obj *steal_deque(Deque *deque)
+{
+	long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	if (top >= bottom)
+		return NULL;
+
+	Obj *object = atomic_load_explicit(&deque->items[top % DEQUE_SIZE], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+												 memory_order_relaxed))
+		return NULL;
+	return object;
 }
 
 void mark_object(Obj *object)
 {
 	if (object == NULL)
 		return;
-	if (object->isMarked)
+	// Young collections may move them under the collector thread.
+	if (vm.gcConcurrent && is_young(object))
+		return;
+	if (!set_mark(object))
 		return;
 
 #ifdef DEBUG_LOG_GC
@@ -46,14 +761,11 @@ void mark_object(Obj *object)
 	printf("\n");
 #endif
 
-	object->isMarked = true;
-
-	if (vm.grayCapacity < vm.grayCount + 1) {
-		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-		vm.grayStack = realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+	if (worker != NULL) {
+		push_worker(worker, object);
+	} else {
+		push_gray(object);
 	}
-
-	vm.grayStack[vm.grayCount++] = object;
 }
 
 void mark_value(Value value)
@@ -70,35 +782,34 @@ static void mark_array(ValueArray *array)
 	}
 }
 
-static void free_object(Obj *object)
+// Frees what a dead object owns outside of its cell.
+static void finalize_object(Obj *object)
 {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %d\n", (void *)object, object->type);
 #endif
 
 	switch (object->type) {
-	case OBJ_CLOSURE: {
-		ObjClosure *closure = (ObjClosure *)object;
-		FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-		FREE(ObjClosure, object);
-		break;
-	}
 	case OBJ_FUNCTION: {
-		ObjFunction *function = (ObjFunction *)object;
-		free_chunk(&function->chunk);
-		FREE(ObjFunction, object);
+		Chunk *chunk = &((ObjFunction *)object)->chunk;
+		if (chunk->arena != NULL)
+			release_arena(chunk->arena);
+		free_chunk(chunk);
 		break;
 	}
-	case OBJ_NATIVE:
-		FREE(ObjNative, object);
-		break;
-	case OBJ_STRING: {
-		ObjString *string = (ObjString *)object;
-		reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+	case OBJ_MODULE: {
+		ObjModule *module = (ObjModule *)object;
+		FREE_ARRAY(ModuleValue, module->values, module->valueCapacity);
+		free_value_array(&module->constValues);
+		free_table(&module->constants);
+		free_table(&module->slotNames);
+		FREE_ARRAY(ModuleSlot, module->slots, module->slotCapacity);
 		break;
 	}
+	case OBJ_CLOSURE:
+	case OBJ_NATIVE:
+	case OBJ_STRING:
 	case OBJ_UPVALUE:
-		FREE(ObjUpvalue, object);
 		break;
 	}
 }
@@ -114,6 +825,10 @@ static void blacken_object(Obj *object)
 	switch (object->type) {
 	case OBJ_CLOSURE: {
 		ObjClosure *closure = (ObjClosure *)object;
+		// Their headers are fetched together rather than one after another.
+		for (int i = 0; i < closure->upvalueCount; ++i) {
+			PREFETCH(closure->upvalues[i]);
+		}
 		mark_object((Obj *)closure->function);
 		for (int i = 0; i < closure->upvalueCount; ++i) {
 			mark_object((Obj *)closure->upvalues[i]);
@@ -123,9 +838,26 @@ static void blacken_object(Obj *object)
 	case OBJ_FUNCTION: {
 		ObjFunction *function = (ObjFunction *)object;
 		mark_object((Obj *)function->name);
+		mark_object((Obj *)function->module);
+		mark_object((Obj *)function->closure);
 		mark_array(&function->chunk.constants);
 		break;
 	}
+	case OBJ_MODULE: {
+		ObjModule *module = (ObjModule *)object;
+		mark_object((Obj *)module->path);
+		for (int i = 0; i < module->valueCount; ++i) {
+			mark_object((Obj *)module->values[i].name);
+			mark_value(module->values[i].value);
+		}
+		mark_array(&module->constValues);
+		mark_table(&module->constants);
+		mark_table(&module->slotNames);
+		for (int i = 0; i < module->slotCount; ++i) {
+			mark_object((Obj *)module->slots[i].owner);
+		}
+		break;
+	}
 	case OBJ_UPVALUE:
 		mark_value(((ObjUpvalue *)object)->closed);
 		break;
@@ -145,80 +877,912 @@ static void mark_roots()
 		mark_object((Obj *)vm.frames[i].closure);
 	}
 
-	for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-		mark_object((Obj *)upvalue);
+	for (Value *slot = vm.stack; slot < vm.stackTop; ++slot) {
+		mark_object((Obj *)vm.openUpvalues[slot - vm.stack]);
 	}
 
 	mark_table(&vm.globals);
+	mark_table(&vm.modules);
+	mark_object((Obj *)vm.main);
 	mark_compiler_roots();
+
+	// Marking does not follow young objects when it may run on the collector
+	// thread, so what they point at is marked here instead.
+	if (vm.gcConcurrent) {
+		for (uint8_t *cursor = vm.nursery; cursor < vm.nurseryTop;) {
+			Obj *object = (Obj *)cursor;
+			blacken_object(object);
+			cursor += YOUNG_SIZE(object->size);
+		}
+	}
 }
 
-static void trace_references()
+// Blackens up to `count` gray objects, and tells whether any are left.
+static bool trace_references(int count)
 {
 	while (vm.grayCount > 0) {
+		if (count-- == 0)
+			return true;
 		Obj *object = vm.grayStack[--vm.grayCount];
 		blacken_object(object);
 	}
+	return false;
 }
 
-static void sweep()
+// Its own objects first, then those in its deque, then the other workers',
+// from the next one on.
+static Obj *find_gray(Worker *self)
 {
-	Obj *previous = NULL;
-	Obj *object = vm.objects;
-	while (object != NULL) {
-		if (object->isMarked) {
-			object->isMarked = false;
-			previous = object;
-			object = object->next;
-		} else {
-			Obj *unreached = object;
+	if (self->grayCount > 0)
+		return self->grayStack[--self->grayCount];
 
-			// FIXME？Skip native to avoid failure caused by debug mode.
-			// But No special treatment is required under normal circumstances.
-			if (unreached->type == OBJ_NATIVE)
-				break;
+	Obj *object = take_deque(&self->deque);
+	if (object != NULL)
+		return object;
 
-			object = object->next;
-			if (previous != NULL) {
-				previous->next = object;
-			} else {
-				vm.objects = object;
-			}
+	int index = (int)(self - markers.workers);
+	for (int i = 1; object == NULL && i < markers.count; ++i) {
+		object = steal_deque(&markers.workers[(index + i) % markers.count].deque);
+	}
+	return object;
+}
 
-			free_object(unreached);
-		}
+static bool gray_left()
+{
+	for (int i = 0; i < markers.count; ++i) {
+		Deque *deque = &markers.workers[i].deque;
+		if (atomic_load(&deque->top) < atomic_load(&deque->bottom))
+			return true;
 	}
+	return false;
 }
 
-void collect_garbage()
+// Blackens gray objects until there are none this worker can find.
+static void drain(Worker *self)
 {
-#ifdef DEBUG_LOG_GC
-	printf("-- gc begin\n");
-	size_t before = vm.bytesAllocated;
-#endif
+	for (;;) {
+		if (self->grayCount >= SHARE_MIN)
+			share_gray(self);
+		Obj *object = find_gray(self);
+		if (object == NULL)
+			return;
+		blacken_object(object);
+	}
+}
 
-	mark_roots();
-	trace_references();
-	table_remove_white(&vm.strings);
-	sweep();
+static void run_worker(Worker *self)
+{
+	worker = self;
+	for (;;) {
+		drain(self);
+		atomic_fetch_sub(&markers.active, 1);
+		for (;;) {
+			if (atomic_load(&markers.active) == 0) {
+				worker = NULL;
+				return;
+			}
+			if (gray_left()) {
+				atomic_fetch_add(&markers.active, 1);
+				break;
+			}
+			sched_yield();
+		}
+	}
+}
+
+static void *help_marking(void *argument)
+{
+	int index = (int)(intptr_t)argument;
+	long round = 0;
+
+	pthread_mutex_lock(&markers.lock);
+	for (;;) {
+		while (markers.round == round && !markers.quit) {
+			pthread_cond_wait(&markers.wake, &markers.lock);
+		}
+		if (markers.quit)
+			break;
+		round = markers.round;
+		if (index >= markers.count)
+			continue;
+		pthread_mutex_unlock(&markers.lock);
+
+		run_worker(&markers.workers[index]);
+
+		pthread_mutex_lock(&markers.lock);
+		if (--markers.running == 0)
+			pthread_cond_signal(&markers.idle);
+	}
+	pthread_mutex_unlock(&markers.lock);
+	return NULL;
+}
+
+// Blackens every gray object with `vm.gcThreads` workers, or fewer if helper
+// threads cannot be started.
+static void trace_in_parallel()
+{
+	if (markers.workers == NULL) {
+		markers.workers = reallocate_gc(NULL, 0, sizeof(Worker) * GC_THREADS_MAX);
+		memset(markers.workers, 0, sizeof(Worker) * GC_THREADS_MAX);
+	}
+	while (markers.started < vm.gcThreads - 1) {
+		if (pthread_create(&markers.threads[markers.started], NULL, help_marking,
+						   (void *)(intptr_t)(markers.started + 1)) != 0)
+			break;
+		markers.started++;
+	}
+
+	int count = markers.started + 1 < vm.gcThreads ? markers.started + 1 : vm.gcThreads;
+	for (int i = 0; i < count; ++i) {
+		Worker *each = &markers.workers[i];
+		atomic_init(&each->deque.top, 0);
+		atomic_init(&each->deque.bottom, 0);
+	}
+	// The VM starts with the roots, and the others steal from it.
+	while (vm.grayCount > 0) {
+		push_worker(&markers.workers[0], vm.grayStack[--vm.grayCount]);
+	}
+
+	pthread_mutex_lock(&markers.lock);
+	markers.count = count;
+	markers.running = count - 1;
+	atomic_store(&markers.active, count);
+	markers.round++;
+	pthread_cond_broadcast(&markers.wake);
+	pthread_mutex_unlock(&markers.lock);
+
+	run_worker(&markers.workers[0]);
+
+	pthread_mutex_lock(&markers.lock);
+	while (markers.running > 0) {
+		pthread_cond_wait(&markers.idle, &markers.lock);
+	}
+	pthread_mutex_unlock(&markers.lock);
+}
+
+// Sweeps up to `count` pages that allocation has not swept yet, and tells
+// whether any are left.
+static bool sweep(int count)
+{
+	for (int i = 0; i < CLASS_COUNT * 2 + 1; ++i) {
+		SizeClass *sizeClass = i < CLASS_COUNT		 ? &heap.classes[i]
+							   : i < CLASS_COUNT * 2 ? &heap.finalizing[i - CLASS_COUNT]
+													 : &heap.large;
+		while (sizeClass->unswept != NULL) {
+			if (count-- == 0)
+				return true;
+			Page *page = sizeClass->unswept;
+			sizeClass->unswept = page->next;
+			sweep_page(page);
+		}
+	}
+	return false;
+}
+
+static Obj **forwarding(Obj *object)
+{
+	return (Obj **)(object + 1);
+}
+
+// Copies a young object into the old space the first time it is reached, and
+// forwards it to the copy.
+static Obj *promote(Obj *object)
+{
+	if (object->isForwarded)
+		return *forwarding(object);
+
+	// Not through allocate_old(): a full collection must not start halfway.
+	Obj *copy = allocate_cell(object->size, false);
+	memcpy(copy, object, object->size);
+
+	if (object->type == OBJ_STRING) {
+		ObjString *string = (ObjString *)copy;
+		string->chars = string->storage;
+	} else if (object->type == OBJ_UPVALUE) {
+		ObjUpvalue *upvalue = (ObjUpvalue *)copy;
+		if (upvalue->location == &((ObjUpvalue *)object)->closed)
+			upvalue->location = &upvalue->closed;
+	}
+
+	// Anything the collector thread did not find from its snapshot is new, so
+	// it is live.
+	if (object->isMarked || marking_concurrently())
+		set_mark(copy);
+	copy->isMarked = false;
+
+	if (heap.promotedCapacity < heap.promotedCount + 1) {
+		int oldCapacity = heap.promotedCapacity;
+		heap.promotedCapacity = GROW_CAPACITY(oldCapacity);
+		heap.promoted =
+			reallocate_gc(heap.promoted, sizeof(Obj *) * oldCapacity, sizeof(Obj *) * heap.promotedCapacity);
+	}
+	heap.promoted[heap.promotedCount++] = copy;
+
+	object->isForwarded = true;
+	*forwarding(object) = copy;
+	return copy;
+}
+
+static void forward_object(Obj **slot)
+{
+	if (*slot != NULL && is_young(*slot))
+		*slot = promote(*slot);
+}
+
+static void forward_value(Value *value)
+{
+	if (IS_OBJ(*value))
+		forward_object(&value->as.obj);
+}
+
+static void forward_table(Table *table)
+{
+	for (int i = 0; i <= table->capacity; ++i) {
+		Entry *entry = &table->entries[i];
+		if (IS_META(entry->key))
+			continue;
+		forward_value(&entry->key);
+		forward_value(&entry->value);
+	}
+}
+
+static void forward_references(Obj *object)
+{
+	switch (object->type) {
+	case OBJ_CLOSURE: {
+		ObjClosure *closure = (ObjClosure *)object;
+		forward_object((Obj **)&closure->function);
+		for (int i = 0; i < closure->upvalueCount; ++i) {
+			forward_object((Obj **)&closure->upvalues[i]);
+		}
+		break;
+	}
+	case OBJ_FUNCTION: {
+		ObjFunction *function = (ObjFunction *)object;
+		forward_object((Obj **)&function->closure);
+		for (int i = 0; i < function->chunk.constants.count; ++i) {
+			forward_value(&function->chunk.constants.values[i]);
+		}
+		break;
+	}
+	case OBJ_MODULE: {
+		ObjModule *module = (ObjModule *)object;
+		for (int i = 0; i < module->valueCount; ++i) {
+			forward_value(&module->values[i].value);
+		}
+		for (int i = 0; i < module->constValues.count; ++i) {
+			forward_value(&module->constValues.values[i]);
+		}
+		forward_table(&module->constants);
+		break;
+	}
+	case OBJ_UPVALUE:
+		forward_value(&((ObjUpvalue *)object)->closed);
+		break;
+	case OBJ_NATIVE:
+	case OBJ_STRING:
+		break;
+	}
+}
+
+// The stack, the frames, open upvalues and globals are the roots, along with
+// the remembered objects; old objects that are not remembered point at no
+// young one. Globals are not behind a write barrier, so they are all scanned.
+// Copies wait in `heap.promoted` to be scanned.
+void collect_young()
+{
+	if (vm.nurseryTop == vm.nursery)
+		return;
+
+#ifdef DEBUG_LOG_GC
+	printf("-- young gc begin\n");
+	size_t before = vm.bytesAllocated;
+#endif
+
+	bool locked = marking_concurrently();
+	if (locked)
+		lock_heap();
+
+	for (Value *slot = vm.stack; slot < vm.stackTop; ++slot) {
+		forward_value(slot);
+	}
+	for (int i = 0; i < vm.frameCount; ++i) {
+		forward_object((Obj **)&vm.frames[i].closure);
+	}
+	for (Value *slot = vm.stack; slot < vm.stackTop; ++slot) {
+		forward_object((Obj **)&vm.openUpvalues[slot - vm.stack]);
+	}
+	forward_table(&vm.globals);
+	// Incremental marking may be under way.
+	if (!vm.gcConcurrent) {
+		for (int i = 0; i < vm.grayCount; ++i) {
+			forward_object(&vm.grayStack[i]);
+		}
+	}
+
+	for (int i = 0; i < vm.rememberedCount; ++i) {
+		vm.remembered[i]->isRemembered = false;
+		forward_references(vm.remembered[i]);
+	}
+	vm.rememberedCount = 0;
+
+	while (heap.promotedCount > 0) {
+		forward_references(heap.promoted[--heap.promotedCount]);
+	}
+
+	// Interned strings follow their copies out, or leave with the nursery.
+	for (uint8_t *cursor = vm.nursery; cursor < vm.nurseryTop;) {
+		Obj *object = (Obj *)cursor;
+		cursor += YOUNG_SIZE(object->size);
+		if (object->type != OBJ_STRING)
+			continue;
+		if (object->isForwarded) {
+			table_replace_key(&vm.strings, OBJ_VAL(object), OBJ_VAL(*forwarding(object)));
+		} else {
+			table_delete(&vm.strings, OBJ_VAL(object));
+		}
+	}
+	vm.nurseryTop = vm.nursery;
+	if (locked)
+		unlock_heap();
+
+#ifdef DEBUG_LOG_GC
+	printf("-- young gc end\n");
+	printf("   promoted %zu bytes\n", vm.bytesAllocated - before);
+#endif
+
+	collect_when_due();
+}
+
+// Forgets the remembered objects that are about to be freed.
+static void sweep_remembered()
+{
+	int count = 0;
+	for (int i = 0; i < vm.rememberedCount; ++i) {
+		if (is_marked(vm.remembered[i]))
+			vm.remembered[count++] = vm.remembered[i];
+	}
+	vm.rememberedCount = count;
+}
 
+// Young objects are marked and traced like old ones, but they are not swept.
+static void unmark_young()
+{
+	for (uint8_t *cursor = vm.nursery; cursor < vm.nurseryTop;) {
+		Obj *object = (Obj *)cursor;
+		object->isMarked = false;
+		cursor += YOUNG_SIZE(object->size);
+	}
+}
+
+static void begin_marking()
+{
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin\n");
+#endif
+
+	vm.gcPhase = GC_MARK;
+	mark_roots();
+}
+
+// Every page is left for allocation to sweep, or for sweep() if allocation
+// does not get to it first. Cells are only taken from swept pages, so objects
+// allocated from now on stay unmarked without being freed.
+static void begin_sweeping()
+{
+	vm.gcPhase = GC_SWEEP;
+	vm.nextStep = vm.bytesAllocated + GC_STEP_SIZE;
+
+	heap.sweptBytes = 0;
+	for (int i = 0; i < CLASS_COUNT; ++i) {
+		heap.classes[i].current = NULL;
+		heap.classes[i].available = NULL;
+		heap.classes[i].freeBytes = 0;
+		heap.finalizing[i].current = NULL;
+		heap.finalizing[i].available = NULL;
+		heap.finalizing[i].freeBytes = 0;
+	}
+	while (heap.pages != NULL) {
+		Page *page = heap.pages;
+		heap.pages = page->next;
+		page->next = page->sizeClass->unswept;
+		page->sizeClass->unswept = page;
+		heap.unswept++;
+	}
+
+	if (heap.unswept == 0)
+		end_sweeping();
+}
+
+// A class cannot give back its last page, however few cells it uses.
+static bool is_fragmented()
+{
+	size_t reclaimable = 0;
+	for (int i = 0; i < CLASS_COUNT; ++i) {
+		if (heap.classes[i].freeBytes > PAGE_SIZE)
+			reclaimable += heap.classes[i].freeBytes - PAGE_SIZE;
+		if (heap.finalizing[i].freeBytes > PAGE_SIZE)
+			reclaimable += heap.finalizing[i].freeBytes - PAGE_SIZE;
+	}
+	return reclaimable >= COMPACT_MIN && reclaimable >= heap.sweptBytes / COMPACT_FRACTION;
+}
+
+static void end_sweeping()
+{
+	vm.gcPhase = GC_IDLE;
 	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+	if (vm.heapLimit > 0 && vm.nextGC > vm.heapLimit)
+		vm.nextGC = vm.heapLimit;
+	if (vm.gcCompact && is_fragmented())
+		vm.compactDue = true;
 
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
-	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before,
-		   vm.bytesAllocated, vm.nextGC);
+	printf("   %zu bytes allocated, next at %zu\n", vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+static void *mark_in_background(void *unused)
+{
+	(void)unused;
+	pthread_mutex_lock(&marker.lock);
+	for (;;) {
+		while (!marker.start && !marker.quit) {
+			pthread_cond_wait(&marker.wake, &marker.lock);
+		}
+		if (marker.quit)
+			break;
+		marker.start = false;
+
+		while (trace_references(GC_MARK_BATCH)) {
+			pthread_mutex_unlock(&marker.lock);
+			while (atomic_load(&marker.waiting) > 0) {
+				sched_yield();
+			}
+			pthread_mutex_lock(&marker.lock);
+		}
+
+		atomic_store(&marker.done, true);
+		pthread_cond_signal(&marker.idle);
+	}
+	pthread_mutex_unlock(&marker.lock);
+	return NULL;
+}
+
+// Marks the roots here and leaves the rest to the collector thread.
+static void begin_concurrent_marking()
+{
+	begin_marking();
+	vm.nextStep = 0;
+
+	if (!marker.started) {
+		if (pthread_create(&marker.thread, NULL, mark_in_background, NULL) != 0) {
+			// Marking goes on without the thread.
+			vm.gcConcurrent = false;
+			return;
+		}
+		marker.started = true;
+	}
+
+	pthread_mutex_lock(&marker.lock);
+	atomic_store(&marker.done, false);
+	marker.start = true;
+	pthread_cond_signal(&marker.wake);
+	pthread_mutex_unlock(&marker.lock);
+}
+
+static void wait_for_marker()
+{
+	pthread_mutex_lock(&marker.lock);
+	while (!atomic_load(&marker.done)) {
+		pthread_cond_wait(&marker.idle, &marker.lock);
+	}
+	pthread_mutex_unlock(&marker.lock);
+}
+
+void finish_marking()
+{
+	if (vm.gcPhase != GC_MARK)
+		return;
+
+	if (vm.gcConcurrent) {
+		wait_for_marker();
+		for (int i = 0; i < vm.satbCount; ++i) {
+			mark_object(vm.satb[i]);
+		}
+		vm.satbCount = 0;
+	}
+
+	// Nothing guards stores into the roots, so they are marked again.
+	mark_roots();
+	if (vm.gcThreads > 1)
+		trace_in_parallel();
+	trace_references(INT_MAX);
+	table_remove_white(&vm.strings);
+	sweep_remembered();
+	unmark_young();
+
+	begin_sweeping();
+}
+
+// Works on the collection for up to `vm.gcStepTime` microseconds, starting it
+// if needed. A heap that outgrows the collection gets it finished instead.
+static void step_garbage()
+{
+	clock_t deadline = clock() + (clock_t)((double)vm.gcStepTime * CLOCKS_PER_SEC / 1000000);
+	bool finish = vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR;
+
+	if (vm.gcPhase == GC_IDLE)
+		begin_marking();
+
+	while (vm.gcPhase == GC_MARK) {
+		if (!trace_references(GC_STEP_WORK)) {
+			finish_marking();
+		} else if (!finish && clock() >= deadline) {
+			break;
+		}
+	}
+
+	while (vm.gcPhase == GC_SWEEP) {
+		if (!sweep(GC_SWEEP_PAGES)) {
+			end_sweeping();
+		} else if (!finish && clock() >= deadline) {
+			break;
+		}
+	}
+
+	vm.nextStep = vm.bytesAllocated + GC_STEP_SIZE;
+}
+
+void collect_garbage()
+{
+	if (vm.gcPhase == GC_IDLE)
+		begin_marking();
+	finish_marking();
+	if (vm.gcPhase == GC_SWEEP) {
+		sweep(INT_MAX);
+		end_sweeping();
+	}
+}
+
+// Compaction forwards the objects it moves the way a young collection does,
+// and then updates every reference to them.
+static void relocate_object(Obj **slot)
+{
+	if (*slot != NULL && (*slot)->isForwarded)
+		*slot = *forwarding(*slot);
+}
+
+static void relocate_value(Value *value)
+{
+	if (IS_OBJ(*value))
+		relocate_object(&value->as.obj);
+}
+
+// Keys keep their hash, so they stay where they are.
+static void relocate_table(Table *table)
+{
+	for (int i = 0; i <= table->capacity; ++i) {
+		Entry *entry = &table->entries[i];
+		if (IS_META(entry->key))
+			continue;
+		relocate_value(&entry->key);
+		relocate_value(&entry->value);
+	}
+}
+
+static void relocate_references(Obj *object)
+{
+	switch (object->type) {
+	case OBJ_CLOSURE: {
+		ObjClosure *closure = (ObjClosure *)object;
+		relocate_object((Obj **)&closure->function);
+		for (int i = 0; i < closure->upvalueCount; ++i) {
+			relocate_object((Obj **)&closure->upvalues[i]);
+		}
+		break;
+	}
+	case OBJ_FUNCTION: {
+		ObjFunction *function = (ObjFunction *)object;
+		relocate_object((Obj **)&function->name);
+		relocate_object((Obj **)&function->module);
+		relocate_object((Obj **)&function->closure);
+		for (int i = 0; i < function->chunk.constants.count; ++i) {
+			relocate_value(&function->chunk.constants.values[i]);
+		}
+		break;
+	}
+	case OBJ_MODULE: {
+		ObjModule *module = (ObjModule *)object;
+		relocate_object((Obj **)&module->path);
+		for (int i = 0; i < module->valueCount; ++i) {
+			relocate_object((Obj **)&module->values[i].name);
+			relocate_value(&module->values[i].value);
+		}
+		for (int i = 0; i < module->constValues.count; ++i) {
+			relocate_value(&module->constValues.values[i]);
+		}
+		relocate_table(&module->constants);
+		relocate_table(&module->slotNames);
+		for (int i = 0; i < module->slotCount; ++i) {
+			relocate_object((Obj **)&module->slots[i].owner);
+		}
+		break;
+	}
+	case OBJ_UPVALUE:
+		relocate_value(&((ObjUpvalue *)object)->closed);
+		break;
+	case OBJ_NATIVE:
+	case OBJ_STRING:
+		break;
+	}
+}
+
+static void relocate_roots()
+{
+	for (Value *slot = vm.stack; slot < vm.stackTop; ++slot) {
+		relocate_value(slot);
+		relocate_object((Obj **)&vm.openUpvalues[slot - vm.stack]);
+	}
+	for (int i = 0; i < vm.frameCount; ++i) {
+		relocate_object((Obj **)&vm.frames[i].closure);
+	}
+	for (int i = 0; i < vm.rememberedCount; ++i) {
+		relocate_object(&vm.remembered[i]);
+	}
+	relocate_table(&vm.globals);
+	relocate_table(&vm.modules);
+	relocate_table(&vm.strings);
+	relocate_object((Obj **)&vm.main);
+}
+
+static Obj *cell_at(Page *page, int index)
+{
+	return (Obj *)((uint8_t *)page + PAGE_HEADER + index * page->cellSize);
+}
+
+static bool is_used(Page *page, int index)
+{
+	size_t granule = (PAGE_HEADER + index * page->cellSize) / GRANULE;
+	return (page->used[granule / 64] & BIT(granule)) != 0;
+}
+
+static int count_used(Page *page)
+{
+	int used = 0;
+	for (int i = 0; i < BITMAP_WORDS; ++i) {
+		used += count_bits(page->used[i]);
+	}
+	return used;
+}
+
+typedef struct {
+	Page *page;
+	int used;
+} PageUse;
+
+// By class, and the emptiest first.
+static int compare_use(const void *a, const void *b)
+{
+	const PageUse *left = a;
+	const PageUse *right = b;
+	if (left->page->sizeClass != right->page->sizeClass)
+		return (uintptr_t)left->page->sizeClass < (uintptr_t)right->page->sizeClass ? -1 : 1;
+	return left->used - right->used;
+}
+
+// Takes the emptiest pages of each class out of the heap for as long as their
+// objects fit in the free cells of the pages left, which become the only ones
+// cells are taken from. Returns them, linked through `next`.
+static Page *choose_evacuated()
+{
+	int count = 0;
+	for (Page *page = heap.pages; page != NULL; page = page->next) {
+		count++;
+	}
+	PageUse *uses = reallocate_gc(NULL, 0, sizeof(PageUse) * (count > 0 ? count : 1));
+
+	int small = 0;
+	Page *large = NULL;
+	while (heap.pages != NULL) {
+		Page *page = heap.pages;
+		heap.pages = page->next;
+		if (page->sizeClass == &heap.large) {
+			page->next = large;
+			large = page;
+		} else {
+			uses[small].page = page;
+			uses[small].used = count_used(page);
+			small++;
+		}
+	}
+	heap.pages = large;
+	qsort(uses, small, sizeof(PageUse), compare_use);
+
+	for (int i = 0; i < CLASS_COUNT; ++i) {
+		heap.classes[i].current = NULL;
+		heap.classes[i].available = NULL;
+		heap.finalizing[i].current = NULL;
+		heap.finalizing[i].available = NULL;
+	}
+
+	Page *evacuated = NULL;
+	for (int start = 0, end; start < small; start = end) {
+		SizeClass *sizeClass = uses[start].page->sizeClass;
+		int room = 0;
+		for (end = start; end < small && uses[end].page->sizeClass == sizeClass; ++end) {
+			room += uses[end].page->cellCount - uses[end].used;
+		}
+
+		int moving = 0;
+		bool evacuating = true;
+		for (int i = start; i < end; ++i) {
+			Page *page = uses[i].page;
+			room -= page->cellCount - uses[i].used;
+			evacuating = evacuating && moving + uses[i].used <= room;
+			if (evacuating) {
+				moving += uses[i].used;
+				page->next = evacuated;
+				evacuated = page;
+				continue;
+			}
+
+			page->next = heap.pages;
+			heap.pages = page;
+			if (uses[i].used < page->cellCount) {
+				page->nextAvailable = sizeClass->available;
+				sizeClass->available = page;
+			}
+		}
+	}
+
+	reallocate_gc(uses, sizeof(PageUse) * (count > 0 ? count : 1), 0);
+	return evacuated;
+}
+
+// Moves an object out of a page that is about to be freed.
+static void evacuate(Obj *object, bool finalizes)
+{
+	Obj *copy = allocate_cell(object->size, finalizes);
+	memcpy(copy, object, object->size);
+
+	if (object->type == OBJ_STRING) {
+		ObjString *string = (ObjString *)copy;
+		if (string->ownsChars)
+			string->chars = string->storage;
+	} else if (object->type == OBJ_UPVALUE) {
+		ObjUpvalue *upvalue = (ObjUpvalue *)copy;
+		if (upvalue->location == &((ObjUpvalue *)object)->closed)
+			upvalue->location = &upvalue->closed;
+	}
+
+	object->isForwarded = true;
+	*forwarding(object) = copy;
+}
+
+void compact_heap()
+{
+	// The compiler holds objects that are not roots.
+	if (vm.loading > 0 || vm.evaluating)
+		return;
+
+	collect_young();
+	collect_garbage();
+	vm.compactDue = false;
+
+#ifdef DEBUG_LOG_GC
+	printf("-- compact begin\n");
+	int moved = 0;
+	int freed = 0;
+#endif
+
+	Page *evacuated = choose_evacuated();
+	for (Page *page = evacuated; page != NULL; page = page->next) {
+		for (int i = 0; i < page->cellCount; ++i) {
+			if (is_used(page, i)) {
+				evacuate(cell_at(page, i), page->finalizes);
+#ifdef DEBUG_LOG_GC
+				moved++;
+#endif
+			}
+		}
+	}
+
+	relocate_roots();
+	for (Page *page = heap.pages; page != NULL; page = page->next) {
+		for (int i = 0; i < page->cellCount; ++i) {
+			if (is_used(page, i))
+				relocate_references(cell_at(page, i));
+		}
+	}
+
+	// The objects live on in their copies, so nothing is finalized.
+	while (evacuated != NULL) {
+		Page *page = evacuated;
+		evacuated = page->next;
+		vm.bytesAllocated -= (size_t)count_used(page) * page->cellSize;
+		free_page(page);
+#ifdef DEBUG_LOG_GC
+		freed++;
+#endif
+	}
+	while (heap.empty != NULL) {
+		Page *page = heap.empty;
+		heap.empty = page->next;
+		free_page(page);
+	}
+	heap.emptyCount = 0;
+#ifdef __GLIBC__
+	// Pages are small enough for malloc to keep them in its arenas.
+	if (vm.allocator.allocateAligned == allocate_aligned_libc)
+		malloc_trim(0);
+#endif
+
+#ifdef DEBUG_LOG_GC
+	printf("-- compact end\n");
+	printf("   moved %d objects, freed %d pages\n", moved, freed);
 #endif
 }
 
+static void free_pages(Page *page)
+{
+	while (page != NULL) {
+		Page *next = page->next;
+		if (page->finalizes) {
+			for (int i = 0; i < BITMAP_WORDS; ++i) {
+				for (uint64_t used = page->used[i]; used != 0; used &= used - 1) {
+					finalize_object((Obj *)((uint8_t *)page + (i * 64 + lowest_bit(used)) * GRANULE));
+				}
+			}
+		}
+		free_page(page);
+		page = next;
+	}
+}
+
 void free_objects()
 {
-	Obj *object = vm.objects;
-	while (object != NULL) {
-		Obj *next = object->next;
-		free_object(object);
-		object = next;
+	if (marker.started) {
+		wait_for_marker();
+		pthread_mutex_lock(&marker.lock);
+		marker.quit = true;
+		pthread_cond_signal(&marker.wake);
+		pthread_mutex_unlock(&marker.lock);
+		pthread_join(marker.thread, NULL);
+		marker.started = false;
 	}
 
-	free(vm.grayStack);
+	if (markers.started > 0) {
+		pthread_mutex_lock(&markers.lock);
+		markers.quit = true;
+		pthread_cond_broadcast(&markers.wake);
+		pthread_mutex_unlock(&markers.lock);
+		for (int i = 0; i < markers.started; ++i) {
+			pthread_join(markers.threads[i], NULL);
+		}
+		markers.started = 0;
+		markers.quit = false;
+	}
+	if (markers.workers != NULL) {
+		for (int i = 0; i < GC_THREADS_MAX; ++i) {
+			Worker *each = &markers.workers[i];
+			reallocate_gc(each->grayStack, sizeof(Obj *) * each->grayCapacity, 0);
+		}
+		reallocate_gc(markers.workers, sizeof(Worker) * GC_THREADS_MAX, 0);
+		markers.workers = NULL;
+	}
+
+	free_pages(heap.pages);
+	for (int i = 0; i < CLASS_COUNT; ++i) {
+		free_pages(heap.classes[i].unswept);
+		free_pages(heap.finalizing[i].unswept);
+	}
+	free_pages(heap.large.unswept);
+	free_pages(heap.empty);
+	reallocate_gc(heap.promoted, sizeof(Obj *) * heap.promotedCapacity, 0);
+	reallocate_gc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity, 0);
+	reallocate_gc(vm.remembered, sizeof(Obj *) * vm.rememberedCapacity, 0);
+	reallocate_gc(vm.satb, sizeof(Obj *) * vm.satbCapacity, 0);
+	reallocate_gc(vm.nursery, NURSERY_SIZE, 0);
+	memset(&heap, 0, sizeof(heap));
 }
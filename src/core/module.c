@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/cache.h"
+#include "core/memory.h"
+#include "core/module.h"
+#include "core/scanner.h"
+#include "core/vm.h"
+
+// Modules are declared when they are imported: a quick scan finds their
+// top-level names and imports, which is all their importers need to compile.
+// Their code is only compiled and run when one of their names is first used.
+
+static bool is_absolute(const char *path, int length)
+{
+#ifdef _WIN32
+	if (length > 1 && path[1] == ':')
+		return true;
+	if (length > 0 && path[0] == '\\')
+		return true;
+#endif
+	return length > 0 && path[0] == '/';
+}
+
+static bool is_separator(char c)
+{
+#ifdef _WIN32
+	if (c == '\\')
+		return true;
+#endif
+	return c == '/';
+}
+
+// Import paths are relative to the directory of the importing file, or to the
+// working directory when there is none.
+static ObjString *resolve_path(ObjModule *importer, const char *path, int length)
+{
+	ObjString *base = importer->path;
+	int directory = 0;
+	if (base != NULL && !is_absolute(path, length)) {
+		for (directory = base->length; directory > 0 && !is_separator(base->chars[directory - 1]); directory--)
+			;
+	}
+
+	ObjString *resolved = make_string(directory + length);
+	if (directory > 0)
+		memcpy(resolved->chars, base->chars, directory);
+	memcpy(resolved->chars + directory, path, length);
+	resolved->chars[directory + length] = '\0';
+	return hash_string(resolved);
+}
+
+static void add_slot(ObjModule *module, ObjString *name, ObjModule *owner, int index)
+{
+	if (module->slotCapacity < module->slotCount + 1) {
+		int oldCapacity = module->slotCapacity;
+		module->slotCapacity = GROW_CAPACITY(oldCapacity);
+		module->slots = GROW_ARRAY(module->slots, ModuleSlot, oldCapacity, module->slotCapacity);
+	}
+
+	module->slots[module->slotCount].owner = owner;
+	module->slots[module->slotCount].index = index;
+	table_set(&module->slotNames, OBJ_VAL(name), NUMBER_VAL(module->slotCount));
+	module->slotCount++;
+}
+
+static void declare_name(ObjModule *module, const char *chars, int length, bool constant)
+{
+	ObjString *name = copy_string(chars, length);
+	Value slot;
+	if (table_get(&module->slotNames, OBJ_VAL(name), &slot))
+		return;
+
+	push(OBJ_VAL(name));
+	if (module->valueCapacity < module->valueCount + 1) {
+		int oldCapacity = module->valueCapacity;
+		module->valueCapacity = GROW_CAPACITY(oldCapacity);
+		module->values = GROW_ARRAY(module->values, ModuleValue, oldCapacity, module->valueCapacity);
+	}
+
+	ModuleValue *value = &module->values[module->valueCount];
+	value->name = name;
+	value->value = META_VAL;
+	value->defined = false;
+	value->constant = constant;
+	add_slot(module, name, module, module->valueCount++);
+	pop();
+}
+
+// The main script's own names are globals, but they still hide imported ones,
+// as a module's own names do.
+static void declare_global(ObjModule *module, const char *chars, int length)
+{
+	ObjString *name = copy_string(chars, length);
+	push(OBJ_VAL(name));
+	table_set(&module->slotNames, OBJ_VAL(name), NUMBER_VAL(-1));
+	pop();
+}
+
+// Names the importer already has, its own included, are not replaced.
+static void import_names(ObjModule *importer, ObjModule *module)
+{
+	for (int i = 0; i < module->valueCount; ++i) {
+		ObjString *name = module->values[i].name;
+		Value slot;
+		if (!table_get(&importer->slotNames, OBJ_VAL(name), &slot)) {
+			add_slot(importer, name, module, i);
+		}
+	}
+}
+
+// Returns the next token outside of any braces or parentheses.
+static Token next_top_level(Scanner *scanner, int *depth)
+{
+	for (;;) {
+		Token token = scan_token(scanner);
+		switch (token.type) {
+		case TOKEN_LEFT_BRACE:
+		case TOKEN_LEFT_PAREN:
+			(*depth)++;
+			break;
+		case TOKEN_RIGHT_BRACE:
+		case TOKEN_RIGHT_PAREN:
+			if (*depth > 0)
+				(*depth)--;
+			break;
+		default:
+			if (*depth == 0 || token.type == TOKEN_EOF)
+				return token;
+		}
+	}
+}
+
+// Own names come first, so that a module importing this one back while its
+// imports load still sees all of them.
+void declare_module(ObjModule *module, const char *source)
+{
+	Scanner scanner;
+	int depth;
+
+	init_scanner(&scanner, source);
+	depth = 0;
+	TokenType previous = TOKEN_EOF;
+	bool constant = false;
+	for (Token token = next_top_level(&scanner, &depth); token.type != TOKEN_EOF;
+		 token = next_top_level(&scanner, &depth)) {
+		if (token.type == TOKEN_IDENTIFIER &&
+			(previous == TOKEN_LET || previous == TOKEN_FN || previous == TOKEN_CONST)) {
+			if (module == vm.main) {
+				declare_global(module, token.start, token.length);
+			} else {
+				declare_name(module, token.start, token.length, constant || previous == TOKEN_CONST);
+			}
+		}
+		// `const fn name`
+		constant = previous == TOKEN_CONST && token.type == TOKEN_FN;
+		previous = token.type;
+	}
+
+	// Most scripts import nothing, and a substring search is much faster than a scan.
+	if (strstr(source, "import") == NULL)
+		return;
+
+	init_scanner(&scanner, source);
+	depth = 0;
+	previous = TOKEN_EOF;
+	for (Token token = next_top_level(&scanner, &depth); token.type != TOKEN_EOF;
+		 token = next_top_level(&scanner, &depth)) {
+		if (token.type == TOKEN_STRING && previous == TOKEN_IMPORT) {
+			// Unreadable modules are reported when the import is compiled.
+			ObjModule *imported = load_module(module, token.start + 1, token.length - 2);
+			if (imported != NULL)
+				import_names(module, imported);
+		}
+		previous = token.type;
+	}
+}
+
+ObjModule *find_module(ObjModule *importer, const char *path, int length)
+{
+	Value module;
+	if (!table_get(&vm.modules, OBJ_VAL(resolve_path(importer, path, length)), &module))
+		return NULL;
+	return AS_MODULE(module);
+}
+
+ObjModule *load_module(ObjModule *importer, const char *path, int length)
+{
+	ObjString *resolved = resolve_path(importer, path, length);
+	Value found;
+	if (table_get(&vm.modules, OBJ_VAL(resolved), &found))
+		return AS_MODULE(found);
+
+	push(OBJ_VAL(resolved));
+	Source *source = load_source(resolved->chars, resolved->length);
+	if (source == NULL) {
+		pop();
+		return NULL;
+	}
+
+	ObjModule *module = new_module(resolved);
+	module->source = source;
+	push(OBJ_VAL(module));
+	table_set(&vm.modules, OBJ_VAL(resolved), OBJ_VAL(module));
+	pop();
+	pop();
+
+	declare_module(module, source->chars);
+	return module;
+}
+
+// Compiled code refers to names by slot, and was checked against which of them
+// are constant, so a cache must match the slots as well as the source.
+static uint64_t cache_hash(ObjModule *module)
+{
+	uint64_t hash = hash_source(module->source->chars);
+	for (int i = 0; i < module->slotCount; ++i) {
+		ModuleSlot *slot = &module->slots[i];
+		ModuleValue *value = &slot->owner->values[slot->index];
+		hash = (hash ^ value->name->hash) * 1099511628211u;
+		hash = (hash ^ (uint32_t)value->name->length) * 1099511628211u;
+		hash = (hash ^ (uint32_t)value->constant) * 1099511628211u;
+	}
+	return hash;
+}
+
+static void adopt_function(ObjFunction *function, ObjModule *module)
+{
+	function->module = module;
+	for (int i = 0; i < function->chunk.constants.count; ++i) {
+		Value constant = function->chunk.constants.values[i];
+		if (IS_FUNCTION(constant))
+			adopt_function(AS_FUNCTION(constant), module);
+	}
+}
+
+ObjFunction *compile_module(ObjModule *module)
+{
+	char *cachePath = vm.cache && module->path != NULL ? cache_path(module->path->chars, module->path->length) : NULL;
+	uint64_t hash = cachePath != NULL ? cache_hash(module) : 0;
+	ObjFunction *function = cachePath != NULL ? load_cache(cachePath, module, hash) : NULL;
+
+	if (function != NULL) {
+		adopt_function(function, module);
+	} else {
+		ObjModule *enclosing = vm.parser.module;
+		vm.parser.module = module;
+		vm.parser.borrowStrings = true;
+		function = compile(&vm.parser, module->source->chars);
+		vm.parser.module = enclosing;
+
+		if (function != NULL && cachePath != NULL) {
+			push(OBJ_VAL(function));
+			write_cache(cachePath, function, hash);
+			pop();
+		}
+	}
+
+	if (cachePath != NULL)
+		FREE_ARRAY(char, cachePath, strlen(cachePath) + 1);
+	return function;
+}
@@ -10,11 +10,12 @@
 
 static Obj *allocate_object(size_t size, ObjType type)
 {
-	Obj *object = (Obj *)reallocate(NULL, 0, size);
+	Obj *object = (Obj *)allocate_old(size, type);
 	object->type = type;
 	object->isMarked = false;
-	object->next = vm.objects;
-	vm.objects = object;
+	object->isRemembered = false;
+	object->isForwarded = false;
+	object->size = (uint32_t)size;
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", (void *)object, size, type);
@@ -23,20 +24,43 @@ static Obj *allocate_object(size_t size, ObjType type)
 	return object;
 }
 
-ObjClosure *new_closure(ObjFunction *function)
+// Falls back to the old space when the nursery does not take the object.
+static Obj *allocate_young_object(size_t size, ObjType type)
 {
-	ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
-	for (int i = 0; i < function->upvalueCount; ++i) {
-		upvalues[i] = NULL;
-	}
+	Obj *object = (Obj *)allocate_young(size);
+	if (object == NULL)
+		return allocate_object(size, type);
+
+	object->type = type;
+	object->isMarked = false;
+	object->isRemembered = false;
+	object->isForwarded = false;
+	object->size = (uint32_t)size;
+	return object;
+}
 
-	ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+static ObjClosure *init_closure(ObjClosure *closure, ObjFunction *function)
+{
 	closure->function = function;
-	closure->upvalues = upvalues;
 	closure->upvalueCount = function->upvalueCount;
+	for (int i = 0; i < function->upvalueCount; ++i) {
+		closure->upvalues[i] = NULL;
+	}
 	return closure;
 }
 
+ObjClosure *new_closure(ObjFunction *function)
+{
+	size_t size = sizeof(ObjClosure) + sizeof(ObjUpvalue *) * function->upvalueCount;
+	return init_closure((ObjClosure *)allocate_object(size, OBJ_CLOSURE), function);
+}
+
+ObjClosure *new_young_closure(ObjFunction *function)
+{
+	size_t size = sizeof(ObjClosure) + sizeof(ObjUpvalue *) * function->upvalueCount;
+	return init_closure((ObjClosure *)allocate_young_object(size, OBJ_CLOSURE), function);
+}
+
 ObjNative *new_native(NativeFn function)
 {
 	ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
@@ -51,69 +75,137 @@ ObjFunction *new_function()
 	function->arity = 0;
 	function->upvalueCount = 0;
 	function->name = NULL;
+	function->module = NULL;
+	function->closure = NULL;
+	function->pure = false;
+	function->source = NULL;
+	function->sourceLine = 0;
+	function->constCount = 0;
+	function->sourceColumn = 0;
 	init_chunk(&function->chunk);
 	return function;
 }
 
+ObjModule *new_module(ObjString *path)
+{
+	ObjModule *module = ALLOCATE_OBJ(ObjModule, OBJ_MODULE);
+	module->path = path;
+	module->source = NULL;
+	module->state = MODULE_UNLOADED;
+	module->valueCount = 0;
+	module->valueCapacity = 0;
+	module->values = NULL;
+	init_value_array(&module->constValues);
+	init_table(&module->constants);
+	init_table(&module->slotNames);
+	module->slotCount = 0;
+	module->slotCapacity = 0;
+	module->slots = NULL;
+	return module;
+}
+
 // TODO: Maybe we can try `halfsiphash-1-3` or `ahash`
 // Now, we use the FNV 1a hash algorithm.
 static uint32_t hash_chars(const char *key, int length)
 {
 	register uint32_t hash = 2166136261u;
 
-	for (int i = length; i != 0; i--) {
-		hash ^= key[i];
+	for (int i = 0; i < length; i++) {
+		hash ^= (uint8_t)key[i];
 		hash *= 16777619;
 	}
 
-	hash ^= key[0];
-	hash *= 16777619;
-
 	return hash;
 }
 
-ObjString *make_string(int length)
+// Marking may not have reached an interned string yet, and it may be garbage
+// that nothing else leads to any more.
+static ObjString *reuse_string(ObjString *string)
+{
+	if (vm.gcPhase == GC_MARK)
+		shade_object((Obj *)string);
+	return string;
+}
+
+static ObjString *intern_string(ObjString *string, uint32_t hash)
+{
+	string->hash = hash;
+
+	push(OBJ_VAL(string));
+	table_set(&vm.strings, OBJ_VAL(string), META_VAL);
+	pop();
+
+	return string;
+}
+
+static ObjString *init_string(ObjString *string, int length)
 {
-	ObjString *string = (ObjString *)allocate_object(sizeof(ObjString) + length + 1, OBJ_STRING);
+	string->ownsChars = true;
 	string->length = length;
+	string->chars = string->storage;
 	return string;
 }
 
+ObjString *make_string(int length)
+{
+	return init_string((ObjString *)allocate_object(sizeof(ObjString) + length + 1, OBJ_STRING), length);
+}
+
+ObjString *make_young_string(int length)
+{
+	return init_string((ObjString *)allocate_young_object(sizeof(ObjString) + length + 1, OBJ_STRING), length);
+}
+
 ObjString *copy_string(const char *chars, int length)
 {
+	// Look the characters up first so that an interned string costs no allocation.
+	uint32_t hash = hash_chars(chars, length);
+	ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+
+	if (interned != NULL)
+		return reuse_string(interned);
+
 	ObjString *string = make_string(length);
 
 	memcpy(string->chars, chars, length);
 	string->chars[length] = '\0';
 
-	ObjString *hashString = hash_string(string);
+	return intern_string(string, hash);
+}
+
+ObjString *borrow_string(const char *chars, int length)
+{
+	uint32_t hash = hash_chars(chars, length);
+	ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+
+	if (interned != NULL)
+		return reuse_string(interned);
+
+	ObjString *string = (ObjString *)allocate_object(sizeof(ObjString), OBJ_STRING);
+	string->ownsChars = false;
+	string->length = length;
+	string->chars = (char *)chars;
 
-	return hashString;
+	return intern_string(string, hash);
 }
 
 ObjString *hash_string(ObjString *string)
 {
 	uint32_t hash = hash_chars(string->chars, string->length);
+	string->hash = hash;
 	ObjString *interned = table_find_string(&vm.strings, string->chars, string->length, hash);
 
 	if (interned != NULL)
-		return interned;
-
-	string->hash = hash;
-
-	push(OBJ_VAL(string));
-	table_set(&vm.strings, OBJ_VAL(string), META_VAL);
-	pop();
+		return reuse_string(interned);
 
-	return string;
+	return intern_string(string, hash);
 }
 
 ObjUpvalue *new_upvalue(Value *slot)
 {
-	ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+	ObjUpvalue *upvalue = (ObjUpvalue *)allocate_young_object(sizeof(ObjUpvalue), OBJ_UPVALUE);
 	upvalue->closed = META_VAL;
 	upvalue->location = slot;
-	upvalue->next = NULL;
 	return upvalue;
 }
 
@@ -123,7 +215,7 @@ static void print_function(ObjFunction *function)
 		printf("<script>");
 		return;
 	}
-	printf("<fn %s>", function->name->chars);
+	printf("<fn %.*s>", function->name->length, function->name->chars);
 }
 
 void print_object(Value value)
@@ -135,11 +227,20 @@ void print_object(Value value)
 	case OBJ_FUNCTION:
 		print_function(AS_FUNCTION(value));
 		break;
+	case OBJ_MODULE: {
+		ObjString *path = AS_MODULE(value)->path;
+		if (path == NULL) {
+			printf("<module>");
+		} else {
+			printf("<module %.*s>", path->length, path->chars);
+		}
+		break;
+	}
 	case OBJ_NATIVE:
 		printf("<native fn>");
 		break;
 	case OBJ_STRING:
-		printf("%s", AS_CSTRING(value));
+		printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));
 		break;
 	case OBJ_UPVALUE:
 		printf("<upvalue>");
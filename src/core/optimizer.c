@@ -0,0 +1,1324 @@
+#include <string.h>
+
+#include "core/common.h"
+#include "core/math.h"
+#include "core/memory.h"
+#include "core/optimizer.h"
+#include "core/vm.h"
+
+// The optimizer decodes a finished chunk into a list of instructions whose
+// jumps point at other instructions rather than byte offsets, runs its passes
+// over that list, and then encodes it back, choosing compact or wide operands.
+
+typedef enum {
+	OPERAND_NONE,
+	OPERAND_BYTE,	  // A raw byte that is never widened.
+	OPERAND_INDEX,	  // A local or upvalue slot.
+	OPERAND_CONSTANT, // An index into the constant pool.
+	OPERAND_JUMP,
+	OPERAND_LOOP,
+} OperandKind;
+
+typedef struct {
+	uint8_t op;
+	uint32_t operand; // For jumps, the index of the target instruction.
+	int line;
+	int column;
+	bool dead;
+	// OP_CLOSURE: where its upvalue pairs start in the original code.
+	int upvalues;
+	bool upvaluesWide;
+	// Used while encoding.
+	bool wideJump;
+	int offset;
+} Instruction;
+
+typedef struct {
+	ObjFunction *function;
+	Table *constants;
+	int count;
+	int capacity;
+	Instruction *code;
+	int *jumpsIn; // How many jumps land on each instruction.
+} Ir;
+
+typedef bool (*PassFn)(Ir *ir);
+
+typedef struct {
+	const char *name;
+	int level;
+	PassFn run;
+} Pass;
+
+static int optimizeLevel = OPTIMIZE_DEFAULT;
+
+void set_optimize_level(int level)
+{
+	optimizeLevel = level;
+}
+
+int get_optimize_level()
+{
+	return optimizeLevel;
+}
+
+static OperandKind operand_kind(uint8_t op)
+{
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_CLOSURE:
+		return OPERAND_CONSTANT;
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_GET_MODULE:
+	case OP_DEFINE_MODULE:
+	case OP_SET_MODULE:
+		return OPERAND_INDEX;
+	case OP_ADD_MANY:
+	case OP_CALL:
+		return OPERAND_BYTE;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+		return OPERAND_JUMP;
+	case OP_LOOP:
+		return OPERAND_LOOP;
+	default:
+		return OPERAND_NONE;
+	}
+}
+
+static bool is_jump(Instruction *instruction)
+{
+	OperandKind kind = operand_kind(instruction->op);
+	return kind == OPERAND_JUMP || kind == OPERAND_LOOP;
+}
+
+static uint32_t read_long(uint8_t *code)
+{
+	return code[0] | (code[1] << 8) | (code[2] << 16);
+}
+
+static int closure_upvalue_count(Ir *ir, Instruction *instruction)
+{
+	return AS_FUNCTION(ir->function->chunk.constants.values[instruction->operand])->upvalueCount;
+}
+
+static void decode(Ir *ir)
+{
+	Chunk *chunk = &ir->function->chunk;
+	uint8_t *code = chunk->code;
+	PositionTable *positions = &chunk->positions;
+
+	// Maps the byte offset of every instruction to its index.
+	int *indices = ALLOCATE(int, chunk->count + 1);
+	ir->code = ALLOCATE(Instruction, chunk->count);
+	ir->count = 0;
+	ir->capacity = chunk->count;
+
+	int run = 0;
+
+	for (int offset = 0; offset < chunk->count;) {
+		while (run + 1 < positions->count && positions->runs[run + 1].offset <= offset) {
+			run++;
+		}
+
+		Instruction *instruction = &ir->code[ir->count];
+		indices[offset] = ir->count++;
+		instruction->line = positions->runs[run].line;
+		instruction->column = positions->runs[run].column;
+		instruction->dead = false;
+		instruction->wideJump = false;
+
+		bool wide = code[offset] == OP_WIDE;
+		if (wide)
+			offset++;
+		instruction->op = code[offset++];
+
+		if (instruction->op == OP_CONSTANT_LONG) {
+			instruction->op = OP_CONSTANT;
+			wide = true;
+		}
+
+		switch (operand_kind(instruction->op)) {
+		case OPERAND_NONE:
+			break;
+		case OPERAND_BYTE:
+			instruction->operand = code[offset++];
+			break;
+		case OPERAND_INDEX:
+		case OPERAND_CONSTANT:
+			instruction->operand = wide ? read_long(&code[offset]) : code[offset];
+			offset += wide ? 3 : 1;
+			break;
+		case OPERAND_JUMP:
+		case OPERAND_LOOP: {
+			uint32_t jump = wide ? read_long(&code[offset]) : (uint32_t)((code[offset] << 8) | code[offset + 1]);
+			offset += wide ? 3 : 2;
+			// Byte offset of the target for now; converted to an index below.
+			instruction->operand = operand_kind(instruction->op) == OPERAND_JUMP ? offset + jump : offset - jump;
+			break;
+		}
+		}
+
+		if (instruction->op == OP_CLOSURE) {
+			instruction->upvalues = offset;
+			instruction->upvaluesWide = wide;
+			offset += closure_upvalue_count(ir, instruction) * (wide ? 4 : 2);
+		}
+	}
+	indices[chunk->count] = ir->count;
+
+	for (int i = 0; i < ir->count; ++i) {
+		if (is_jump(&ir->code[i])) {
+			ir->code[i].operand = indices[ir->code[i].operand];
+		}
+	}
+
+	FREE_ARRAY(int, indices, chunk->count + 1);
+	ir->jumpsIn = ALLOCATE(int, ir->capacity + 1);
+}
+
+static void count_jumps(Ir *ir)
+{
+	memset(ir->jumpsIn, 0, sizeof(int) * (ir->count + 1));
+	for (int i = 0; i < ir->count; ++i) {
+		if (is_jump(&ir->code[i])) {
+			ir->jumpsIn[ir->code[i].operand]++;
+		}
+	}
+}
+
+// Drops dead instructions. A jump to a dead instruction lands on the next live
+// one instead, so passes may only kill jump targets that behave as no-ops.
+static void compact(Ir *ir)
+{
+	int *remap = ALLOCATE(int, ir->count + 1);
+	int live = 0;
+	for (int i = 0; i < ir->count; ++i) {
+		remap[i] = live;
+		if (!ir->code[i].dead)
+			live++;
+	}
+	remap[ir->count] = live;
+
+	live = 0;
+	for (int i = 0; i < ir->count; ++i) {
+		Instruction instruction = ir->code[i];
+		if (instruction.dead)
+			continue;
+		if (is_jump(&instruction))
+			instruction.operand = remap[instruction.operand];
+		ir->code[live++] = instruction;
+	}
+
+	FREE_ARRAY(int, remap, ir->count + 1);
+	ir->count = live;
+}
+
+static bool is_constant(Instruction *instruction)
+{
+	switch (instruction->op) {
+	case OP_CONSTANT:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_META:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static Value constant_value(Ir *ir, Instruction *instruction)
+{
+	switch (instruction->op) {
+	case OP_TRUE:
+		return BOOL_VAL(true);
+	case OP_FALSE:
+		return BOOL_VAL(false);
+	case OP_META:
+		return META_VAL;
+	default:
+		return ir->function->chunk.constants.values[instruction->operand];
+	}
+}
+
+static bool set_constant(Ir *ir, Instruction *instruction, Value value)
+{
+	if (IS_BOOL(value)) {
+		instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+		return true;
+	}
+
+	if (ir->function->chunk.constants.count > UINT24_MAX)
+		return false;
+
+	instruction->op = OP_CONSTANT;
+	instruction->operand = add_shared_constant(&ir->function->chunk, ir->constants, value);
+	return true;
+}
+
+static bool is_falsey(Value value)
+{
+	return IS_META(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Mirrors the VM, and declines anything that would raise a runtime error.
+static bool fold_binary(uint8_t op, Value a, Value b, Value *result)
+{
+	if (op == OP_EQUAL) {
+		*result = BOOL_VAL(values_equal(a, b));
+		return true;
+	}
+
+	if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+		ObjString *left = AS_STRING(a);
+		ObjString *right = AS_STRING(b);
+		int length = left->length + right->length;
+		ObjString *string = make_string(length);
+		memcpy(string->chars, left->chars, left->length);
+		memcpy(string->chars + left->length, right->chars, right->length);
+		string->chars[length] = '\0';
+		*result = OBJ_VAL(hash_string(string));
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b))
+		return false;
+
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	switch (op) {
+	case OP_GREATER:
+		*result = BOOL_VAL(x > y);
+		return true;
+	case OP_LESS:
+		*result = BOOL_VAL(x < y);
+		return true;
+	case OP_ADD:
+		*result = NUMBER_VAL(x + y);
+		return true;
+	case OP_MULTIPLY:
+		*result = NUMBER_VAL(x * y);
+		return true;
+	case OP_DIVIDE:
+		*result = NUMBER_VAL(x / y);
+		return true;
+	case OP_MODULO:
+		if (y == 0)
+			return false;
+		*result = NUMBER_VAL(x > 0 && y < 0 ? -mod(x, y) : mod(x, y));
+		return true;
+	case OP_POW:
+		*result = NUMBER_VAL(pow(x, y));
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool fold_unary(uint8_t op, Value a, Value *result)
+{
+	switch (op) {
+	case OP_NOT:
+		*result = BOOL_VAL(is_falsey(a));
+		return true;
+	case OP_NEGATE:
+		if (!IS_NUMBER(a))
+			return false;
+		*result = NUMBER_VAL(-AS_NUMBER(a));
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Folds the constants that end an OP_ADD_MANY, each of which is a whole operand.
+// Strings at the end can be joined early, but numbers are only summed when every
+// operand is constant, since rounding depends on the order of the additions.
+static bool fold_add_many(Ir *ir, int i)
+{
+	Instruction *add = &ir->code[i];
+	int count = (int)add->operand;
+
+	int constants = 0;
+	while (constants < count && constants < i) {
+		Instruction *instruction = &ir->code[i - constants - 1];
+		if (instruction->dead || !is_constant(instruction) || ir->jumpsIn[i - constants] > 0)
+			break;
+		constants++;
+	}
+
+	if (constants < count) {
+		int strings = 0;
+		while (strings < constants && IS_STRING(constant_value(ir, &ir->code[i - strings - 1]))) {
+			strings++;
+		}
+		constants = strings;
+	}
+
+	if (constants < 2)
+		return false;
+
+	// The partial results are kept on the stack, out of the collector's way.
+	Instruction *first = &ir->code[i - constants];
+	push(constant_value(ir, first));
+	for (int j = i - constants + 1; j < i; ++j) {
+		Value result;
+		if (!fold_binary(OP_ADD, vm.stackTop[-1], constant_value(ir, &ir->code[j]), &result)) {
+			pop();
+			return false;
+		}
+		pop();
+		push(result);
+	}
+
+	bool folded = set_constant(ir, first, vm.stackTop[-1]);
+	pop();
+	if (!folded)
+		return false;
+
+	for (int j = i - constants + 1; j < i; ++j) {
+		ir->code[j].dead = true;
+	}
+
+	add->operand -= constants - 1;
+	if (add->operand == 1) {
+		add->dead = true;
+	} else if (add->operand == 2) {
+		add->op = OP_ADD;
+	}
+	return true;
+}
+
+// Only values that a constant pool can hold, and that the cache can write.
+static bool is_foldable(Value value)
+{
+	return IS_NUMBER(value) || IS_BOOL(value) || IS_META(value) || IS_STRING(value);
+}
+
+static void push_closure(ObjFunction *function)
+{
+	if (function->closure == NULL) {
+		push(OBJ_VAL(function));
+		function->closure = new_closure(function);
+		pop();
+	}
+	push(OBJ_VAL(function->closure));
+}
+
+// Makes a call to a const fn with constant arguments now, and loads its result
+// instead. Calls that fail are left to fail at run time.
+static bool fold_call(Ir *ir, int i)
+{
+	int argCount = (int)ir->code[i].operand;
+	int callee = i - argCount - 1;
+	if (callee < 0 || ir->code[callee].dead || ir->code[callee].op != OP_CLOSURE)
+		return false;
+
+	ObjFunction *function = AS_FUNCTION(ir->function->chunk.constants.values[ir->code[callee].operand]);
+	if (!function->pure || function->upvalueCount > 0)
+		return false;
+
+	for (int j = callee + 1; j <= i; ++j) {
+		if (ir->code[j].dead || ir->jumpsIn[j] > 0 || (j < i && !is_constant(&ir->code[j])))
+			return false;
+	}
+
+	push_closure(function);
+	for (int j = callee + 1; j < i; ++j) {
+		push(constant_value(ir, &ir->code[j]));
+	}
+	if (!evaluate_call(argCount))
+		return false;
+
+	bool folded = is_foldable(vm.stackTop[-1]) && set_constant(ir, &ir->code[callee], vm.stackTop[-1]);
+	pop();
+	if (!folded)
+		return false;
+
+	for (int j = callee + 1; j <= i; ++j) {
+		ir->code[j].dead = true;
+	}
+	return true;
+}
+
+static bool fold_constants(Ir *ir)
+{
+	bool changed = false;
+
+	for (int i = 0; i + 1 < ir->count; ++i) {
+		Instruction *first = &ir->code[i];
+		Instruction *second = &ir->code[i + 1];
+		if (first->op == OP_ADD_MANY && !first->dead && fold_add_many(ir, i)) {
+			changed = true;
+			continue;
+		}
+		if (first->op == OP_CALL && !first->dead && fold_call(ir, i)) {
+			changed = true;
+			continue;
+		}
+		if (first->dead || second->dead || !is_constant(first) || ir->jumpsIn[i + 1] > 0)
+			continue;
+
+		Value result;
+		if (fold_unary(second->op, constant_value(ir, first), &result)) {
+			if (set_constant(ir, first, result)) {
+				second->dead = true;
+				changed = true;
+			}
+			continue;
+		}
+
+		if (i + 2 >= ir->count || !is_constant(second) || ir->jumpsIn[i + 2] > 0)
+			continue;
+
+		Instruction *operator = &ir->code[i + 2];
+		if (!fold_binary(operator->op, constant_value(ir, first), constant_value(ir, second), &result))
+			continue;
+		// A joined string is only held here until it is in the pool.
+		push(result);
+		bool folded = set_constant(ir, first, result);
+		pop();
+		if (folded) {
+			second->dead = true;
+			operator->dead = true;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+// A constant condition decides its branch, and a constant that is popped
+// straight away need not be pushed at all.
+static bool simplify_branches(Ir *ir)
+{
+	bool changed = false;
+
+	for (int i = 0; i + 1 < ir->count; ++i) {
+		Instruction *value = &ir->code[i];
+		Instruction *next = &ir->code[i + 1];
+		if (value->dead || next->dead || !is_constant(value) || ir->jumpsIn[i + 1] > 0)
+			continue;
+
+		if (next->op == OP_JUMP_IF_FALSE) {
+			if (is_falsey(constant_value(ir, value))) {
+				next->op = OP_JUMP;
+			} else {
+				next->dead = true;
+			}
+			changed = true;
+		} else if (next->op == OP_POP) {
+			value->dead = true;
+			next->dead = true;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+static bool remove_dead_code(Ir *ir)
+{
+	bool changed = false;
+
+	bool *reached = ALLOCATE(bool, ir->count);
+	int *worklist = ALLOCATE(int, ir->count);
+	int pending = 0;
+	for (int i = 0; i < ir->count; ++i) {
+		reached[i] = false;
+	}
+
+	if (ir->count > 0) {
+		reached[0] = true;
+		worklist[pending++] = 0;
+	}
+
+	while (pending > 0) {
+		int i = worklist[--pending];
+		Instruction *instruction = &ir->code[i];
+
+		int successors[2];
+		int successorCount = 0;
+		if (instruction->op != OP_RETURN && instruction->op != OP_END_MODULE && instruction->op != OP_JUMP &&
+			instruction->op != OP_LOOP)
+			successors[successorCount++] = i + 1;
+		if (is_jump(instruction))
+			successors[successorCount++] = instruction->operand;
+
+		for (int j = 0; j < successorCount; ++j) {
+			int successor = successors[j];
+			if (successor < ir->count && !reached[successor]) {
+				reached[successor] = true;
+				worklist[pending++] = successor;
+			}
+		}
+	}
+
+	for (int i = 0; i < ir->count; ++i) {
+		Instruction *instruction = &ir->code[i];
+		if (!reached[i] || (operand_kind(instruction->op) == OPERAND_JUMP && instruction->operand == (uint32_t)i + 1)) {
+			instruction->dead = true;
+			changed = true;
+		}
+	}
+
+	FREE_ARRAY(bool, reached, ir->count);
+	FREE_ARRAY(int, worklist, ir->count);
+	return changed;
+}
+
+static bool thread_jumps(Ir *ir)
+{
+	bool changed = false;
+
+	for (int i = 0; i < ir->count; ++i) {
+		Instruction *instruction = &ir->code[i];
+		if (operand_kind(instruction->op) != OPERAND_JUMP)
+			continue;
+
+		// Forward jumps only ever lead further forward, so this terminates.
+		uint32_t target = instruction->operand;
+		while (target < (uint32_t)ir->count && ir->code[target].op == OP_JUMP) {
+			target = ir->code[target].operand;
+		}
+
+		if (target != instruction->operand) {
+			instruction->operand = target;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+static uint8_t getter_for(uint8_t setter)
+{
+	switch (setter) {
+	case OP_SET_LOCAL:
+		return OP_GET_LOCAL;
+	case OP_SET_GLOBAL:
+		return OP_GET_GLOBAL;
+	case OP_SET_UPVALUE:
+		return OP_GET_UPVALUE;
+	case OP_SET_MODULE:
+		return OP_GET_MODULE;
+	default:
+		return OP_RETURN;
+	}
+}
+
+// `x = ...; x` stores and pops a value only to load it again; keep it instead.
+static bool remove_redundant_loads(Ir *ir)
+{
+	bool changed = false;
+
+	for (int i = 0; i + 2 < ir->count; ++i) {
+		Instruction *store = &ir->code[i];
+		Instruction *pop = &ir->code[i + 1];
+		Instruction *load = &ir->code[i + 2];
+		if (store->dead || pop->op != OP_POP || load->op != getter_for(store->op) || load->operand != store->operand)
+			continue;
+		if (pop->dead || load->dead || ir->jumpsIn[i + 1] > 0 || ir->jumpsIn[i + 2] > 0)
+			continue;
+
+		pop->dead = true;
+		load->dead = true;
+		changed = true;
+	}
+
+	return changed;
+}
+
+// The stack depth each instruction starts at, counting the callee's slot, or -1
+// where nothing reaches it. The compiler keeps the depth the same on every way
+// into an instruction.
+static int *stack_depths(Ir *ir)
+{
+	int *depths = ALLOCATE(int, ir->count + 1);
+	int *worklist = ALLOCATE(int, ir->count + 1);
+	int pending = 0;
+	for (int i = 0; i <= ir->count; ++i) {
+		depths[i] = -1;
+	}
+
+	depths[0] = ir->function->arity + 1;
+	worklist[pending++] = 0;
+	while (pending > 0) {
+		int i = worklist[--pending];
+		if (i == ir->count)
+			continue;
+		Instruction *instruction = &ir->code[i];
+
+		int pops, pushes;
+		stack_effect(instruction->op, instruction->operand, &pops, &pushes);
+		int depth = depths[i] - pops + pushes;
+
+		int successors[2];
+		int successorCount = 0;
+		if (instruction->op != OP_RETURN && instruction->op != OP_END_MODULE && instruction->op != OP_JUMP &&
+			instruction->op != OP_LOOP)
+			successors[successorCount++] = i + 1;
+		if (is_jump(instruction))
+			successors[successorCount++] = instruction->operand;
+
+		for (int j = 0; j < successorCount; ++j) {
+			int successor = successors[j];
+			if (depths[successor] == -1) {
+				depths[successor] = depth;
+				worklist[pending++] = successor;
+			}
+		}
+	}
+
+	FREE_ARRAY(int, worklist, ir->count + 1);
+	return depths;
+}
+
+// Which local slots a closure made in the function captures. Calls can change
+// those behind the function's back.
+static bool *captured_slots(Ir *ir, int slotCount)
+{
+	bool *captured = ALLOCATE(bool, slotCount);
+	memset(captured, 0, sizeof(bool) * slotCount);
+
+	for (int i = 0; i < ir->count; ++i) {
+		Instruction *instruction = &ir->code[i];
+		if (instruction->op != OP_CLOSURE)
+			continue;
+
+		uint8_t *pairs = &ir->function->chunk.code[instruction->upvalues];
+		int step = instruction->upvaluesWide ? 4 : 2;
+		for (int j = 0; j < closure_upvalue_count(ir, instruction); ++j) {
+			uint32_t index = instruction->upvaluesWide ? read_long(&pairs[j * step + 1]) : pairs[j * step + 1];
+			if (pairs[j * step] && index < (uint32_t)slotCount)
+				captured[index] = true;
+		}
+	}
+	return captured;
+}
+
+// Instructions that compute a value from the stack, constants and locals alone,
+// and so give the same result, or fail the same way, for the same inputs.
+static bool is_pure(uint8_t op)
+{
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_META:
+	case OP_GET_LOCAL:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_ADD_MANY:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULO:
+	case OP_POW:
+	case OP_NOT:
+	case OP_NEGATE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Where the pure expression whose value instruction `end` pushes starts, or -1
+// if it involves anything else. Nothing may jump into its middle.
+static int expression_start(Ir *ir, int end)
+{
+	int needed = 1;
+	for (int i = end; i >= 0; --i) {
+		Instruction *instruction = &ir->code[i];
+		if (instruction->dead || !is_pure(instruction->op) || (i < end && ir->jumpsIn[i + 1] > 0))
+			return -1;
+
+		int pops, pushes;
+		stack_effect(instruction->op, instruction->operand, &pops, &pushes);
+		needed -= pushes;
+		if (needed < 0)
+			return -1;
+		needed += pops;
+		if (needed == 0)
+			return i;
+	}
+	return -1;
+}
+
+// Whether the expression from `start` to `end` loads any of the slots from
+// `slot` up, or a captured one.
+static bool reads_slot(Ir *ir, int start, int end, uint32_t slot, bool *captured, int slotCount)
+{
+	for (int i = start; i <= end; ++i) {
+		Instruction *instruction = &ir->code[i];
+		if (instruction->op != OP_GET_LOCAL)
+			continue;
+		if (instruction->operand >= slot || instruction->operand >= (uint32_t)slotCount ||
+			captured[instruction->operand])
+			return true;
+	}
+	return false;
+}
+
+static bool loads_slot(Ir *ir, int start, int end, uint32_t slot)
+{
+	for (int i = start; i <= end; ++i) {
+		if (ir->code[i].op == OP_GET_LOCAL && ir->code[i].operand == slot)
+			return true;
+	}
+	return false;
+}
+
+static bool same_code(Ir *ir, int a, int b, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		Instruction *x = &ir->code[a + i];
+		Instruction *y = &ir->code[b + i];
+		if (x->dead || y->dead || x->op != y->op || x->operand != y->operand || (i > 0 && ir->jumpsIn[b + i] > 0))
+			return false;
+	}
+	return true;
+}
+
+// `a * b + a * b`: while the first result is still on the stack, later copies of
+// the expression load it from its slot instead of computing it again.
+static bool eliminate_common_subexpressions(Ir *ir)
+{
+	bool changed = false;
+	int *depths = stack_depths(ir);
+	int slotCount = ir->function->arity + 1 + ir->count;
+	bool *captured = captured_slots(ir, slotCount);
+
+	for (int end = 0; end < ir->count; ++end) {
+		int start = expression_start(ir, end);
+		if (start == -1 || start == end || depths[start] == -1)
+			continue;
+
+		// The slot its value is left in, which may become a local.
+		uint32_t slot = (uint32_t)depths[start];
+		if (captured[slot] || reads_slot(ir, start, end, slot, captured, slotCount))
+			continue;
+
+		int length = end - start + 1;
+		for (int i = end + 1; i < ir->count;) {
+			Instruction *instruction = &ir->code[i];
+			if (ir->jumpsIn[i] > 0 || instruction->dead || depths[i] == -1 || instruction->op == OP_JUMP ||
+				instruction->op == OP_LOOP)
+				break;
+
+			if (i + length <= ir->count && same_code(ir, start, i, length)) {
+				instruction->op = OP_GET_LOCAL;
+				instruction->operand = slot;
+				for (int j = i + 1; j < i + length; ++j) {
+					ir->code[j].dead = true;
+				}
+				changed = true;
+				i += length;
+				continue;
+			}
+
+			// Stop where the value, or a local it was computed from, may change.
+			if (instruction->op == OP_SET_LOCAL &&
+				(instruction->operand == slot || loads_slot(ir, start, end, instruction->operand)))
+				break;
+			int pops, pushes;
+			stack_effect(instruction->op, instruction->operand, &pops, &pushes);
+			if (depths[i] - pops <= (int)slot)
+				break;
+			i++;
+		}
+	}
+
+	FREE_ARRAY(int, depths, ir->count + 1);
+	FREE_ARRAY(bool, captured, slotCount);
+	return changed;
+}
+
+static bool captures_from(Ir *ir, Instruction *instruction, uint32_t slot)
+{
+	uint8_t *pairs = &ir->function->chunk.code[instruction->upvalues];
+	int step = instruction->upvaluesWide ? 4 : 2;
+	for (int j = 0; j < closure_upvalue_count(ir, instruction); ++j) {
+		uint32_t index = instruction->upvaluesWide ? read_long(&pairs[j * step + 1]) : pairs[j * step + 1];
+		if (pairs[j * step] && index >= slot)
+			return true;
+	}
+	return false;
+}
+
+// The last instruction of the loop whose back edge is `back`, which is the last
+// one that jumps back into it, as the end of a for loop's body jumps back to the
+// increment.
+static int loop_end(Ir *ir, int back)
+{
+	uint32_t header = ir->code[back].operand;
+	int end = back;
+	for (int i = back + 1; i < ir->count; ++i) {
+		Instruction *instruction = &ir->code[i];
+		if (instruction->op == OP_LOOP && instruction->operand >= header && instruction->operand <= (uint32_t)end)
+			end = i;
+	}
+	return end;
+}
+
+// A loop that is only entered at its header, whose one way out is a jump from
+// its condition to the OP_POP of that condition right after it, and that keeps
+// the stack above where it was at the header.
+static bool is_simple_loop(Ir *ir, int *depths, int header, int end)
+{
+	int exit = end + 1;
+	if (exit + 1 >= ir->count || ir->code[exit].op != OP_POP || ir->jumpsIn[exit + 1] > 0 || depths[header] == -1 ||
+		depths[exit] != depths[header] + 1)
+		return false;
+
+	for (int i = 0; i < ir->count; ++i) {
+		Instruction *instruction = &ir->code[i];
+		bool inside = i >= header && i <= end;
+		if (inside) {
+			int pops, pushes;
+			stack_effect(instruction->op, instruction->operand, &pops, &pushes);
+			if (depths[i] == -1 || depths[i] - pops < depths[header])
+				return false;
+			// Its slots move up, and the pairs cannot be changed.
+			if (instruction->op == OP_CLOSURE && captures_from(ir, instruction, (uint32_t)depths[header]))
+				return false;
+		}
+
+		if (!is_jump(instruction))
+			continue;
+		int target = (int)instruction->operand;
+		if (inside ? target < header || (target > end && target != exit) : (target > header && target <= exit))
+			return false;
+	}
+	return true;
+}
+
+static bool stores_slot(Ir *ir, int start, int end, int from, int to)
+{
+	for (int i = start; i <= end; ++i) {
+		if (ir->code[i].op == OP_SET_LOCAL && loads_slot(ir, from, to, ir->code[i].operand))
+			return true;
+	}
+	return false;
+}
+
+// Moves the pure expression that starts a loop's condition, if the loop changes
+// none of its inputs, in front of the loop. Its value stays on the stack below
+// the loop's own locals until the loop ends.
+static bool hoist_invariant(Ir *ir, int *depths, bool *captured, int slotCount, int header, int end)
+{
+	uint32_t slot = (uint32_t)depths[header];
+	int from = -1;
+	int to = -1;
+	// Only what always runs first, after nothing but loads of constants and
+	// locals, so that errors still come in the same order.
+	int firstComputed = end + 1;
+	for (int i = header; i <= end && is_pure(ir->code[i].op); ++i) {
+		int pops, pushes;
+		stack_effect(ir->code[i].op, ir->code[i].operand, &pops, &pushes);
+		if (pops > 0 && firstComputed > i)
+			firstComputed = i;
+
+		int start = expression_start(ir, i);
+		if (start < header || start == i || start > firstComputed)
+			continue;
+		if (reads_slot(ir, start, i, slot, captured, slotCount) || stores_slot(ir, header, end, start, i))
+			continue;
+		// The largest such expression.
+		if (from == -1 || start <= from) {
+			from = start;
+			to = i;
+		}
+	}
+	if (from == -1)
+		return false;
+
+	int length = to - from + 1;
+	int exit = end + 1;
+	int capacity = ir->count + length + 1;
+	Instruction *code = ALLOCATE(Instruction, capacity);
+	int *remap = ALLOCATE(int, ir->count + 1);
+
+	int count = 0;
+	for (int i = 0; i < ir->count; ++i) {
+		if (i == header) {
+			for (int j = from; j <= to; ++j) {
+				code[count++] = ir->code[j];
+			}
+		}
+
+		remap[i] = count;
+		Instruction instruction = ir->code[i];
+		bool inside = i >= header && i <= end;
+		if (inside && (instruction.op == OP_GET_LOCAL || instruction.op == OP_SET_LOCAL) && instruction.operand >= slot)
+			instruction.operand++;
+		if (i == from) {
+			instruction.op = OP_GET_LOCAL;
+			instruction.operand = slot;
+		} else if (i > from && i <= to) {
+			instruction.dead = true;
+		}
+		code[count++] = instruction;
+
+		// Its condition is popped on the way out, and then the value.
+		if (i == exit)
+			code[count++] = ir->code[exit];
+	}
+	remap[ir->count] = count;
+
+	for (int i = 0; i < ir->count; ++i) {
+		Instruction *instruction = &code[remap[i]];
+		if (!is_jump(instruction))
+			continue;
+		int target = (int)instruction->operand;
+		bool inside = i >= header && i <= end;
+		instruction->operand = target == header && !inside ? remap[header] - length : remap[target];
+	}
+
+	FREE_ARRAY(int, remap, ir->count + 1);
+	FREE_ARRAY(Instruction, ir->code, ir->capacity);
+	ir->jumpsIn = GROW_ARRAY(ir->jumpsIn, int, ir->capacity + 1, capacity + 1);
+	ir->code = code;
+	ir->count = count;
+	ir->capacity = capacity;
+	return true;
+}
+
+// `while (i < n * 2)`: computes what the loop cannot change once, before it.
+static bool hoist_loop_invariants(Ir *ir)
+{
+	bool changed = false;
+	int count = ir->count;
+	int *depths = stack_depths(ir);
+	int slotCount = ir->function->arity + 1 + ir->count;
+	bool *captured = captured_slots(ir, slotCount);
+
+	for (int i = 0; i < ir->count; ++i) {
+		Instruction *instruction = &ir->code[i];
+		if (instruction->op != OP_LOOP || depths[i] == -1)
+			continue;
+
+		int header = (int)instruction->operand;
+		int end = loop_end(ir, i);
+		if (is_simple_loop(ir, depths, header, end) && hoist_invariant(ir, depths, captured, slotCount, header, end)) {
+			// The code has moved; the next round looks for more.
+			changed = true;
+			break;
+		}
+	}
+
+	FREE_ARRAY(int, depths, count + 1);
+	FREE_ARRAY(bool, captured, slotCount);
+	return changed;
+}
+
+static Pass passes[] = {
+	{"fold-constants", OPTIMIZE_BASIC, fold_constants},
+	{"simplify-branches", OPTIMIZE_BASIC, simplify_branches},
+	{"remove-dead-code", OPTIMIZE_BASIC, remove_dead_code},
+	{"thread-jumps", OPTIMIZE_FULL, thread_jumps},
+	{"remove-redundant-loads", OPTIMIZE_FULL, remove_redundant_loads},
+	{"eliminate-common-subexpressions", OPTIMIZE_FULL, eliminate_common_subexpressions},
+	{"hoist-loop-invariants", OPTIMIZE_FULL, hoist_loop_invariants},
+};
+
+#define PASS_COUNT (int)(sizeof(passes) / sizeof(passes[0]))
+#define MAX_ROUNDS 8
+
+static void run_passes(Ir *ir)
+{
+	for (int round = 0; round < MAX_ROUNDS; ++round) {
+		bool changed = false;
+
+		for (int i = 0; i < PASS_COUNT; ++i) {
+			if (passes[i].level > optimizeLevel)
+				continue;
+
+			count_jumps(ir);
+			if (passes[i].run(ir)) {
+				compact(ir);
+				changed = true;
+			}
+		}
+
+		if (!changed)
+			break;
+	}
+}
+
+static bool closure_is_wide(Ir *ir, Instruction *instruction)
+{
+	if (instruction->operand > UINT8_MAX)
+		return true;
+
+	uint8_t *pairs = &ir->function->chunk.code[instruction->upvalues];
+	int step = instruction->upvaluesWide ? 4 : 2;
+	for (int i = 0; i < closure_upvalue_count(ir, instruction); ++i) {
+		uint32_t index = instruction->upvaluesWide ? read_long(&pairs[i * step + 1]) : pairs[i * step + 1];
+		if (index > UINT8_MAX)
+			return true;
+	}
+	return false;
+}
+
+static int instruction_size(Ir *ir, Instruction *instruction)
+{
+	switch (operand_kind(instruction->op)) {
+	case OPERAND_NONE:
+		return 1;
+	case OPERAND_BYTE:
+		return 2;
+	case OPERAND_INDEX:
+		return instruction->operand > UINT8_MAX ? 5 : 2;
+	case OPERAND_CONSTANT:
+		if (instruction->op == OP_CLOSURE) {
+			bool wide = closure_is_wide(ir, instruction);
+			return (wide ? 5 : 2) + closure_upvalue_count(ir, instruction) * (wide ? 4 : 2);
+		}
+		if (instruction->op == OP_CONSTANT)
+			return instruction->operand > UINT8_MAX ? 4 : 2;
+		return instruction->operand > UINT8_MAX ? 5 : 2;
+	case OPERAND_JUMP:
+	case OPERAND_LOOP:
+		return instruction->wideJump ? 5 : 3;
+	}
+	return 1;
+}
+
+static uint32_t jump_distance(Ir *ir, Instruction *instruction, int end)
+{
+	int target = instruction->operand < (uint32_t)ir->count ? ir->code[instruction->operand].offset : end;
+	int next = instruction->offset + instruction_size(ir, instruction);
+	return operand_kind(instruction->op) == OPERAND_LOOP ? next - target : target - next;
+}
+
+// Lays the instructions out, widening any jump that does not fit in 16 bits
+// until every jump fits. Returns the size of the code.
+static int layout(Ir *ir)
+{
+	for (;;) {
+		int offset = 0;
+		for (int i = 0; i < ir->count; ++i) {
+			ir->code[i].offset = offset;
+			offset += instruction_size(ir, &ir->code[i]);
+		}
+
+		bool widened = false;
+		for (int i = 0; i < ir->count; ++i) {
+			Instruction *instruction = &ir->code[i];
+			if (is_jump(instruction) && !instruction->wideJump && jump_distance(ir, instruction, offset) > UINT16_MAX) {
+				instruction->wideJump = true;
+				widened = true;
+			}
+		}
+
+		if (!widened)
+			return offset;
+	}
+}
+
+static void write_long(Chunk *chunk, uint32_t operand, int line, int column)
+{
+	write_chunk(chunk, operand & 0xff, line, column);
+	write_chunk(chunk, (operand >> 8) & 0xff, line, column);
+	write_chunk(chunk, (operand >> 16) & 0xff, line, column);
+}
+
+static void encode(Ir *ir)
+{
+	Chunk *chunk = &ir->function->chunk;
+	int end = layout(ir);
+
+	Chunk out;
+	init_chunk(&out);
+
+	for (int i = 0; i < ir->count; ++i) {
+		Instruction *instruction = &ir->code[i];
+		int line = instruction->line;
+		int column = instruction->column;
+
+		switch (operand_kind(instruction->op)) {
+		case OPERAND_NONE:
+			write_chunk(&out, instruction->op, line, column);
+			break;
+		case OPERAND_BYTE:
+			write_chunk(&out, instruction->op, line, column);
+			write_chunk(&out, (uint8_t)instruction->operand, line, column);
+			break;
+		case OPERAND_INDEX:
+		case OPERAND_CONSTANT: {
+			bool wide = instruction->op == OP_CLOSURE ? closure_is_wide(ir, instruction)
+													  : instruction->operand > UINT8_MAX;
+			if (!wide) {
+				write_chunk(&out, instruction->op, line, column);
+				write_chunk(&out, (uint8_t)instruction->operand, line, column);
+			} else {
+				if (instruction->op == OP_CONSTANT) {
+					write_chunk(&out, OP_CONSTANT_LONG, line, column);
+				} else {
+					write_chunk(&out, OP_WIDE, line, column);
+					write_chunk(&out, instruction->op, line, column);
+				}
+				write_long(&out, instruction->operand, line, column);
+			}
+
+			if (instruction->op == OP_CLOSURE) {
+				uint8_t *pairs = &chunk->code[instruction->upvalues];
+				int step = instruction->upvaluesWide ? 4 : 2;
+				for (int j = 0; j < closure_upvalue_count(ir, instruction); ++j) {
+					uint32_t index = instruction->upvaluesWide ? read_long(&pairs[j * step + 1]) : pairs[j * step + 1];
+					write_chunk(&out, pairs[j * step], line, column);
+					if (wide) {
+						write_long(&out, index, line, column);
+					} else {
+						write_chunk(&out, (uint8_t)index, line, column);
+					}
+				}
+			}
+			break;
+		}
+		case OPERAND_JUMP:
+		case OPERAND_LOOP: {
+			uint32_t distance = jump_distance(ir, instruction, end);
+			if (instruction->wideJump) {
+				write_chunk(&out, OP_WIDE, line, column);
+				write_chunk(&out, instruction->op, line, column);
+				write_long(&out, distance, line, column);
+			} else {
+				write_chunk(&out, instruction->op, line, column);
+				write_chunk(&out, (distance >> 8) & 0xff, line, column);
+				write_chunk(&out, distance & 0xff, line, column);
+			}
+			break;
+		}
+		}
+	}
+
+	// The constants stay where they are; only the code and positions are replaced.
+	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(Position, chunk->positions.runs, chunk->positions.capacity);
+	chunk->code = out.code;
+	chunk->count = out.count;
+	chunk->capacity = out.capacity;
+	chunk->positions = out.positions;
+}
+
+void optimize_function(ObjFunction *function, Table *constants)
+{
+	if (optimizeLevel == OPTIMIZE_NONE || function->chunk.count == 0)
+		return;
+
+	Ir ir;
+	ir.function = function;
+	ir.constants = constants;
+	decode(&ir);
+
+	run_passes(&ir);
+	encode(&ir);
+
+	FREE_ARRAY(Instruction, ir.code, ir.capacity);
+	FREE_ARRAY(int, ir.jumpsIn, ir.capacity + 1);
+}
+
+// Runs the code that the compiler just emitted from `start` on, as long as it
+// only computes with constants. The values being worked on stay on the stack.
+bool evaluate_constant(Chunk *chunk, int start, Value *result)
+{
+	int base = (int)(vm.stackTop - vm.stack);
+	bool constant = true;
+
+	for (int offset = start; constant && offset < chunk->count;) {
+		uint8_t op = chunk->code[offset++];
+		int depth = (int)(vm.stackTop - vm.stack) - base;
+		Value folded;
+
+		// Other wide instructions are not constant, and fall through to the default.
+		bool wide = op == OP_WIDE;
+		if (wide)
+			op = chunk->code[offset++];
+		uint32_t operand = 0;
+		if (op == OP_CONSTANT || op == OP_CLOSURE) {
+			operand = wide ? read_long(&chunk->code[offset]) : chunk->code[offset];
+			offset += wide ? 3 : 1;
+		}
+
+		switch (op) {
+		case OP_CONSTANT:
+			push(chunk->constants.values[operand]);
+			break;
+		case OP_CONSTANT_LONG:
+			push(chunk->constants.values[read_long(&chunk->code[offset])]);
+			offset += 3;
+			break;
+		case OP_TRUE:
+			push(BOOL_VAL(true));
+			break;
+		case OP_FALSE:
+			push(BOOL_VAL(false));
+			break;
+		case OP_META:
+			push(META_VAL);
+			break;
+		case OP_CLOSURE: {
+			// Only const fns, which capture nothing, are named in a constant expression.
+			ObjFunction *function = AS_FUNCTION(chunk->constants.values[operand]);
+			constant = function->pure && function->upvalueCount == 0;
+			if (constant)
+				push_closure(function);
+			break;
+		}
+		case OP_CALL: {
+			int argCount = chunk->code[offset++];
+			Value callee = depth > argCount ? vm.stackTop[-argCount - 1] : META_VAL;
+			constant = IS_CLOSURE(callee) && AS_CLOSURE(callee)->function->pure && evaluate_call(argCount);
+			break;
+		}
+		case OP_NOT:
+		case OP_NEGATE:
+			constant = depth >= 1 && fold_unary(op, vm.stackTop[-1], &folded);
+			if (constant)
+				vm.stackTop[-1] = folded;
+			break;
+		case OP_ADD_MANY: {
+			int count = chunk->code[offset++];
+			constant = depth >= count;
+			for (int i = 1; constant && i < count; ++i) {
+				constant = fold_binary(OP_ADD, vm.stackTop[-count], vm.stackTop[i - count], &folded);
+				if (constant)
+					vm.stackTop[-count] = folded;
+			}
+			if (constant)
+				vm.stackTop -= count - 1;
+			break;
+		}
+		default:
+			constant = depth >= 2 && fold_binary(op, vm.stackTop[-2], vm.stackTop[-1], &folded);
+			if (constant) {
+				vm.stackTop[-2] = folded;
+				pop();
+			}
+		}
+	}
+
+	constant = constant && vm.stackTop - vm.stack == base + 1;
+	if (constant) {
+		*result = vm.stackTop[-1];
+		if (IS_CLOSURE(*result)) {
+			// Another name for a const fn.
+			ObjFunction *function = AS_CLOSURE(*result)->function;
+			constant = function->pure && function->upvalueCount == 0;
+			*result = OBJ_VAL(function);
+		} else {
+			constant = is_foldable(*result);
+		}
+	}
+	vm.stackTop = vm.stack + base;
+	return constant;
+}
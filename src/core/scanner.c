@@ -4,100 +4,218 @@
 #include "core/common.h"
 #include "core/scanner.h"
 
-Scanner scanner;
+// Long runs are skipped with aligned 16-byte loads. Those never cross into
+// another page, but they do read past the terminator, which AddressSanitizer
+// reports.
+#if defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__)
+#define SCANNER_SSE2
+#include <emmintrin.h>
+#endif
+
+void init_scanner(Scanner *scanner, const char *source)
+{
+	scanner->start = source;
+	scanner->current = source;
+	scanner->lineStart = source;
+	scanner->line = 1;
+	scanner->column = 1;
+}
 
-void init_scanner(const char *source)
+void seek_scanner(Scanner *scanner, const char *position, int line, int column)
 {
-	scanner.start = source;
-	scanner.current = source;
-	scanner.line = 1;
+	scanner->start = position;
+	scanner->current = position;
+	scanner->lineStart = position - (column - 1);
+	scanner->line = line;
+	scanner->column = column;
 }
 
+// Identifier characters, by byte. Bytes outside ASCII are neither.
+#define CHAR_ALPHA 1
+#define CHAR_DIGIT 2
+
+static const uint8_t charClasses[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
 static bool is_alpha(char c)
 {
-	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+	return charClasses[(uint8_t)c] & CHAR_ALPHA;
 }
 
 static bool is_digit(char c)
 {
-	return c >= '0' && c <= '9';
+	return charClasses[(uint8_t)c] & CHAR_DIGIT;
 }
 
-static bool is_at_end()
+static bool is_at_end(Scanner *scanner)
 {
-	return *scanner.current == '\0';
+	return *scanner->current == '\0';
 }
 
-static char advance()
+static char advance(Scanner *scanner)
 {
-	scanner.current++;
-	return scanner.current[-1];
+	scanner->current++;
+	return scanner->current[-1];
 }
 
-static char speek()
+static char speek(Scanner *scanner)
 {
-	return *scanner.current;
+	return *scanner->current;
 }
 
-static char speek_next()
+static char speek_next(Scanner *scanner)
 {
-	if (is_at_end())
+	if (is_at_end(scanner))
 		return '\0';
-	return scanner.current[1];
+	return scanner->current[1];
 }
 
-static bool match(char expected)
+static bool match(Scanner *scanner, char expected)
 {
-	if (is_at_end())
+	if (is_at_end(scanner))
 		return false;
-	if (*scanner.current != expected)
+	if (*scanner->current != expected)
 		return false;
 
-	scanner.current++;
+	scanner->current++;
 	return true;
 }
 
-static Token make_token(TokenType type)
+static Token make_token(Scanner *scanner, TokenType type)
 {
 	Token token;
 	token.type = type;
-	token.start = scanner.start;
-	token.length = (int)(scanner.current - scanner.start);
-	token.line = scanner.line;
+	token.start = scanner->start;
+	token.length = (int)(scanner->current - scanner->start);
+	token.line = scanner->line;
+	token.column = scanner->column;
 
 	return token;
 }
 
-static Token error_token(const char *message)
+static Token error_token(Scanner *scanner, const char *message)
 {
 	Token token;
 	token.type = TOKEN_ERROR;
 	token.start = message;
 	token.length = (int)strlen(message);
-	token.line = scanner.line;
+	token.line = scanner->line;
+	token.column = scanner->column;
 
 	return token;
 }
 
-static void skip_whitespace()
+typedef enum { SKIP_BLANKS, SKIP_COMMENT, SKIP_IDENTIFIER, SKIP_DIGITS, SKIP_STRING } SkipClass;
+
+static inline bool stops(char c, SkipClass skip)
+{
+	switch (skip) {
+	case SKIP_BLANKS:
+		return c != ' ' && c != '\t' && c != '\r';
+	case SKIP_COMMENT:
+		return c == '\n' || c == '\0';
+	case SKIP_IDENTIFIER:
+		return charClasses[(uint8_t)c] == 0;
+	case SKIP_DIGITS:
+		return !is_digit(c);
+	case SKIP_STRING:
+		return c == '"' || c == '\n' || c == '\0';
+	}
+	return true;
+}
+
+#ifdef SCANNER_SSE2
+// Bytes equal to `c`, as a vector of 0xff or 0 lanes.
+#define BYTES_EQUAL(chunk, c) _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c))
+// Bytes in [low, low + count), using a signed compare on bytes shifted by 128.
+#define BYTES_IN_RANGE(chunk, low, count)                                                                              \
+	_mm_cmplt_epi8(_mm_sub_epi8(chunk, _mm_set1_epi8((char)((low) + 128))), _mm_set1_epi8((char)(-128 + (count))))
+
+// Returns a mask of the bytes that end a run of `skip`.
+static inline unsigned stop_mask(__m128i chunk, SkipClass skip)
+{
+	__m128i keep;
+	switch (skip) {
+	case SKIP_BLANKS:
+		keep = _mm_or_si128(_mm_or_si128(BYTES_EQUAL(chunk, ' '), BYTES_EQUAL(chunk, '\t')), BYTES_EQUAL(chunk, '\r'));
+		break;
+	case SKIP_COMMENT:
+		return _mm_movemask_epi8(_mm_or_si128(BYTES_EQUAL(chunk, '\n'), BYTES_EQUAL(chunk, '\0')));
+	case SKIP_IDENTIFIER: {
+		__m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+		keep = _mm_or_si128(_mm_or_si128(BYTES_IN_RANGE(lower, 'a', 26), BYTES_IN_RANGE(chunk, '0', 10)),
+							BYTES_EQUAL(chunk, '_'));
+		break;
+	}
+	case SKIP_DIGITS:
+		keep = BYTES_IN_RANGE(chunk, '0', 10);
+		break;
+	case SKIP_STRING:
+		return _mm_movemask_epi8(
+			_mm_or_si128(_mm_or_si128(BYTES_EQUAL(chunk, '"'), BYTES_EQUAL(chunk, '\n')), BYTES_EQUAL(chunk, '\0')));
+	}
+	return ~_mm_movemask_epi8(keep) & 0xffff;
+}
+#endif
+
+// Returns the first byte from `position` that ends a run of `skip`. Every class
+// stops at the terminator.
+static inline const char *skip(const char *position, SkipClass skip)
+{
+	// Most runs are short, so a few bytes are checked before using vectors.
+	for (int i = 0; i < 8; i++, position++) {
+		if (stops(*position, skip))
+			return position;
+	}
+
+#ifdef SCANNER_SSE2
+	uintptr_t misalignment = (uintptr_t)position & 15;
+	const char *block = position - misalignment;
+	unsigned mask = stop_mask(_mm_load_si128((const __m128i *)block), skip) & (0xffffu << misalignment);
+
+	while (mask == 0) {
+		block += 16;
+		mask = stop_mask(_mm_load_si128((const __m128i *)block), skip);
+	}
+	return block + __builtin_ctz(mask);
+#else
+	while (!stops(*position, skip)) {
+		position++;
+	}
+	return position;
+#endif
+}
+
+static void skip_whitespace(Scanner *scanner)
 {
 	for (;;) {
-		char c = speek();
-		switch (c) {
-		case ' ':
-		case '\r':
-		case '\t':
-			advance();
-			break;
+		scanner->current = skip(scanner->current, SKIP_BLANKS);
+		switch (speek(scanner)) {
 		case '\n':
-			scanner.line++;
-			advance();
+			scanner->line++;
+			advance(scanner);
+			scanner->lineStart = scanner->current;
 			break;
 		case '/':
-			if (speek_next() == '/') {
+			if (speek_next(scanner) == '/') {
 				// A comment goes until the end of the line.
-				while (speek() != '\n' && !is_at_end())
-					advance();
+				scanner->current = skip(scanner->current, SKIP_COMMENT);
 			} else {
 				return;
 			}
@@ -109,150 +227,143 @@ static void skip_whitespace()
 	}
 }
 
-static TokenType check_keyword(int start, int length, const char *rest, TokenType type)
+typedef struct {
+	const char *name;
+	int length;
+	TokenType type;
+} Keyword;
+
+// A perfect hash of the keywords on their first and last characters: no two
+// share a slot, so a lookup is one hash and at most one compare. A keyword that
+// collided would override another slot, which -Woverride-init reports.
+#define KEYWORD_HASH(first, last) (((first) + 2 * (last)) & 31)
+
+static const Keyword keywords[32] = {
+	[KEYWORD_HASH('a', 'd')] = {"and", 3, TOKEN_AND},
+	[KEYWORD_HASH('c', 't')] = {"const", 5, TOKEN_CONST},
+	[KEYWORD_HASH('e', 'e')] = {"else", 4, TOKEN_ELSE},
+	[KEYWORD_HASH('f', 'e')] = {"false", 5, TOKEN_FALSE},
+	[KEYWORD_HASH('f', 'r')] = {"for", 3, TOKEN_FOR},
+	[KEYWORD_HASH('f', 'n')] = {"fn", 2, TOKEN_FN},
+	[KEYWORD_HASH('i', 'f')] = {"if", 2, TOKEN_IF},
+	[KEYWORD_HASH('i', 't')] = {"import", 6, TOKEN_IMPORT},
+	[KEYWORD_HASH('l', 't')] = {"let", 3, TOKEN_LET},
+	[KEYWORD_HASH('o', 'r')] = {"or", 2, TOKEN_OR},
+	[KEYWORD_HASH('n', 't')] = {"not", 3, TOKEN_NOT},
+	[KEYWORD_HASH('p', 't')] = {"print", 5, TOKEN_PRINT},
+	[KEYWORD_HASH('r', 'n')] = {"return", 6, TOKEN_RETURN},
+	[KEYWORD_HASH('t', 'e')] = {"true", 4, TOKEN_TRUE},
+	[KEYWORD_HASH('w', 'e')] = {"while", 5, TOKEN_WHILE},
+};
+
+static TokenType identifier_type(Scanner *scanner)
 {
-	if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
-		return type;
-	}
+	int length = (int)(scanner->current - scanner->start);
+	if (length < 2 || length > 6)
+		return TOKEN_IDENTIFIER;
 
-	return TOKEN_IDENTIFIER;
-}
-
-static TokenType identifier_type()
-{
-	switch (scanner.start[0]) {
-	case 'a':
-		return check_keyword(1, 2, "nd", TOKEN_AND);
-	case 'e':
-		return check_keyword(1, 3, "lse", TOKEN_ELSE);
-	case 'f':
-		if (scanner.current - scanner.start > 2) {
-			switch (scanner.start[1]) {
-			case 'a':
-				return check_keyword(2, 3, "lse", TOKEN_FALSE);
-			case 'o':
-				return check_keyword(2, 1, "r", TOKEN_FOR);
-			}
-		} else {
-			return check_keyword(1, 1, "n", TOKEN_FN);
-		}
-		break;
-	case 'i':
-		return check_keyword(1, 1, "f", TOKEN_IF);
-	case 'l':
-		return check_keyword(1, 2, "et", TOKEN_LET);
-	case 'n':
-		return check_keyword(1, 2, "ot", TOKEN_NOT);
-	case 'o':
-		return check_keyword(1, 1, "r", TOKEN_OR);
-	case 'p':
-		return check_keyword(1, 4, "rint", TOKEN_PRINT);
-	case 'r':
-		return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-	case 't':
-		return check_keyword(1, 2, "rue", TOKEN_TRUE);
-	case 'w':
-		return check_keyword(1, 4, "hile", TOKEN_WHILE);
+	const Keyword *keyword = &keywords[KEYWORD_HASH(scanner->start[0], scanner->start[length - 1])];
+	if (keyword->length == length && memcmp(scanner->start, keyword->name, length) == 0) {
+		return keyword->type;
 	}
 	return TOKEN_IDENTIFIER;
 }
 
-static Token identifier()
+static Token identifier(Scanner *scanner)
 {
-	while (is_alpha(speek()) || is_digit(speek()))
-		advance();
-
-	return make_token(identifier_type());
+	scanner->current = skip(scanner->current, SKIP_IDENTIFIER);
+	return make_token(scanner, identifier_type(scanner));
 }
 
-static Token number()
+static Token number(Scanner *scanner)
 {
-	while (is_digit(speek()))
-		advance();
+	scanner->current = skip(scanner->current, SKIP_DIGITS);
 
 	// Look for a fractional part.
-	if (speek() == '.' && is_digit(speek_next())) {
+	if (speek(scanner) == '.' && is_digit(speek_next(scanner))) {
 		// Consume the ".".
-		advance();
-
-		while (is_digit(speek()))
-			advance();
+		advance(scanner);
+		scanner->current = skip(scanner->current, SKIP_DIGITS);
 	}
 
-	return make_token(TOKEN_NUMBER);
+	return make_token(scanner, TOKEN_NUMBER);
 }
 
-static Token string()
+static Token string(Scanner *scanner)
 {
-	while (speek() != '"' && !is_at_end()) {
-		if (speek() == '\n')
-			scanner.line++;
-		advance();
+	for (;;) {
+		scanner->current = skip(scanner->current, SKIP_STRING);
+		if (speek(scanner) != '\n')
+			break;
+		scanner->line++;
+		advance(scanner);
+		scanner->lineStart = scanner->current;
 	}
 
-	if (is_at_end())
-		return error_token("Unterminated string.");
+	if (is_at_end(scanner))
+		return error_token(scanner, "Unterminated string.");
 
 	// The closing quote.
-	advance();
-	return make_token(TOKEN_STRING);
+	advance(scanner);
+	return make_token(scanner, TOKEN_STRING);
 }
 
-Token scan_token()
+Token scan_token(Scanner *scanner)
 {
-	skip_whitespace();
+	skip_whitespace(scanner);
 
-	scanner.start = scanner.current;
+	scanner->start = scanner->current;
+	scanner->column = (int)(scanner->start - scanner->lineStart) + 1;
 
-	if (is_at_end())
-		return make_token(TOKEN_EOF);
+	if (is_at_end(scanner))
+		return make_token(scanner, TOKEN_EOF);
 
-	char c = advance();
+	char c = advance(scanner);
 	if (is_alpha(c))
-		return identifier();
+		return identifier(scanner);
 
 	if (is_digit(c))
-		return number();
+		return number(scanner);
 
 	switch (c) {
 	case '(':
-		return make_token(TOKEN_LEFT_PAREN);
+		return make_token(scanner, TOKEN_LEFT_PAREN);
 	case ')':
-		return make_token(TOKEN_RIGHT_PAREN);
+		return make_token(scanner, TOKEN_RIGHT_PAREN);
 	case '{':
-		return make_token(TOKEN_LEFT_BRACE);
+		return make_token(scanner, TOKEN_LEFT_BRACE);
 	case '}':
-		return make_token(TOKEN_RIGHT_BRACE);
+		return make_token(scanner, TOKEN_RIGHT_BRACE);
 	case ';':
-		return make_token(TOKEN_SEMICOLON);
+		return make_token(scanner, TOKEN_SEMICOLON);
 	case ',':
-		return make_token(TOKEN_COMMA);
+		return make_token(scanner, TOKEN_COMMA);
 	case '.':
-		return make_token(TOKEN_DOT);
+		return make_token(scanner, TOKEN_DOT);
 	case '-':
-		return make_token(TOKEN_MINUS);
+		return make_token(scanner, TOKEN_MINUS);
 	case '+':
-		return make_token(TOKEN_PLUS);
+		return make_token(scanner, TOKEN_PLUS);
 	case '/':
-		return make_token(TOKEN_SLASH);
+		return make_token(scanner, TOKEN_SLASH);
 	case '*':
-		return make_token(match('*') ? TOKEN_STAR_STAR : TOKEN_STAR);
+		return make_token(scanner, match(scanner, '*') ? TOKEN_STAR_STAR : TOKEN_STAR);
 	case '%':
-		return make_token(TOKEN_PERCENT);
+		return make_token(scanner, TOKEN_PERCENT);
 	case '!':
-		if (match('=')) {
-			return make_token(TOKEN_BANG_EQUAL);
+		if (match(scanner, '=')) {
+			return make_token(scanner, TOKEN_BANG_EQUAL);
 		}
 		break;
 	case '=':
-		return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+		return make_token(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 	case '<':
-		return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+		return make_token(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 	case '>':
-		return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+		return make_token(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 	case '"':
-		return string();
+		return string(scanner);
 	}
 
-	return error_token("Unexpected character.");
+	return error_token(scanner, "Unexpected character.");
 }
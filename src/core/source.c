@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "core/memory.h"
+#include "core/source.h"
+#include "core/vm.h"
+
+static char *read_chars(const char *path, size_t *length)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0L, SEEK_END);
+	size_t fileSize = ftell(file);
+	rewind(file);
+
+	char *buffer = ALLOCATE(char, fileSize + 1);
+	if (fread(buffer, sizeof(char), fileSize, file) < fileSize) {
+		FREE_ARRAY(char, buffer, fileSize + 1);
+		fclose(file);
+		return NULL;
+	}
+
+	buffer[fileSize] = '\0';
+	*length = fileSize;
+
+	fclose(file);
+	return buffer;
+}
+
+#ifndef _WIN32
+// The rest of a mapping's last page reads as zeros, which terminates the text.
+// A file that fills its last page exactly has no such byte and is read instead.
+static const char *map_chars(const char *path, size_t *length)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat status;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size == 0 ||
+		status.st_size % pageSize == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	void *mapping = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	*length = (size_t)status.st_size;
+	return (const char *)mapping;
+}
+#endif
+
+Source *load_source(const char *path, size_t length)
+{
+	Source *source = ALLOCATE(Source, 1);
+	source->mapped = false;
+	source->path = ALLOCATE(char, length + 1);
+	memcpy(source->path, path, length);
+	source->path[length] = '\0';
+
+#ifndef _WIN32
+	source->chars = map_chars(source->path, &source->length);
+	source->mapped = source->chars != NULL;
+#endif
+
+	if (!source->mapped) {
+		source->chars = read_chars(source->path, &source->length);
+		if (source->chars == NULL) {
+			FREE_ARRAY(char, source->path, length + 1);
+			FREE(Source, source);
+			return NULL;
+		}
+	}
+
+	source->next = vm.sources;
+	vm.sources = source;
+	return source;
+}
+
+static void release_chars(Source *source)
+{
+#ifndef _WIN32
+	if (source->mapped) {
+		munmap((void *)source->chars, source->length);
+		return;
+	}
+#endif
+	FREE_ARRAY(char, (char *)source->chars, source->length + 1);
+}
+
+void free_sources()
+{
+	Source *source = vm.sources;
+	while (source != NULL) {
+		Source *next = source->next;
+		release_chars(source);
+		FREE_ARRAY(char, source->path, strlen(source->path) + 1);
+		FREE(Source, source);
+		source = next;
+	}
+	vm.sources = NULL;
+}
@@ -120,6 +120,25 @@ bool table_delete(Table *table, Value key)
 	return true;
 }
 
+void table_replace_key(Table *table, Value key, Value replacement)
+{
+	if (table->count == 0)
+		return;
+
+	uint32_t index = hash_value(replacement) & table->capacity;
+	for (;;) {
+		Entry *entry = &table->entries[index];
+		if (IS_META(entry->key)) {
+			if (IS_META(entry->value))
+				return;
+		} else if (values_equal(key, entry->key)) {
+			entry->key = replacement;
+			return;
+		}
+		index = (index + 1) & table->capacity;
+	}
+}
+
 // void table_add_all(Table *from, Table *to)
 // {
 // 	for (int i = 0; i <= from->capacity; ++i) {
@@ -140,13 +159,16 @@ ObjString *table_find_string(Table *table, const char *chars, int length, uint32
 	for (;;) {
 		Entry *entry = &table->entries[index];
 
-		if (IS_META(entry->key))
-			return NULL;
-
-		ObjString *string = AS_STRING(entry->key);
-		if (string->length == length && memcmp(string->chars, chars, length) == 0) {
-			// We found it.
-			return string;
+		if (IS_META(entry->key)) {
+			// Stop at an empty entry, but keep probing past tombstones.
+			if (IS_META(entry->value))
+				return NULL;
+		} else {
+			ObjString *string = AS_STRING(entry->key);
+			if (string->length == length && memcmp(string->chars, chars, length) == 0) {
+				// We found it.
+				return string;
+			}
 		}
 
 		index = (index + 1) & table->capacity;
@@ -155,7 +177,7 @@ ObjString *table_find_string(Table *table, const char *chars, int length, uint32
 
 void mark_table(Table *table)
 {
-	for (int i = 0; i < table->capacity; i++) {
+	for (int i = 0; i <= table->capacity; i++) {
 		Entry *entry = &table->entries[i];
 		if (!entry || (IS_META(entry->key)))
 			continue;
@@ -167,11 +189,12 @@ void mark_table(Table *table)
 // TODO: Although it looks error-free, it needs to be verified.
 void table_remove_white(Table *table)
 {
-	for (int i = 0; i < table->capacity; i++) {
+	for (int i = 0; i <= table->capacity; i++) {
 		Entry *entry = &table->entries[i];
 		if (IS_META(entry->key))
 			continue;
-		if (IS_OBJ(entry->key) && !AS_OBJ(entry->key)->isMarked) {
+		// Young collections look after young keys.
+		if (IS_OBJ(entry->key) && !is_young(AS_OBJ(entry->key)) && !is_marked(AS_OBJ(entry->key))) {
 			table_delete(table, entry->key);
 		}
 	}
@@ -4,10 +4,12 @@
 #include <string.h>
 #include <time.h>
 
+#include "core/cache.h"
 #include "core/common.h"
 #include "core/compiler.h"
 #include "core/math.h"
 #include "core/memory.h"
+#include "core/module.h"
 #include "core/object.h"
 #include "core/value.h"
 #include "core/vm.h"
@@ -25,14 +27,41 @@ static Value clock_native(int argCount, Value *args)
 
 static void reset_stack()
 {
-	vm.stack = GROW_ARRAY(vm.stack, Value, 0, vm.stackCapacity);
+	if (vm.stack == NULL) {
+		vm.stack = ALLOCATE(Value, vm.stackCapacity);
+		vm.openUpvalues = ALLOCATE(ObjUpvalue *, vm.stackCapacity);
+	}
 	vm.stackTop = vm.stack;
 	vm.frameCount = 0;
-	vm.openUpvalues = NULL;
+	memset(vm.openUpvalues, 0, sizeof(ObjUpvalue *) * vm.stackCapacity);
+}
+
+static void close_upvalues(CallFrame *frame, Value *last);
+
+// Young objects may move, so callers find the ones they need again afterwards.
+static void begin_loading()
+{
+	collect_young();
+	finish_marking();
+	vm.loading++;
+}
+
+static void end_loading()
+{
+	vm.loading--;
 }
 
 static void runtime_error(const char *format, ...)
 {
+	if (vm.evaluating) {
+		// The compiler just gives up on the call; what ran before it goes on.
+		while (vm.frameCount > vm.baseFrame) {
+			CallFrame *frame = &vm.frames[--vm.frameCount];
+			close_upvalues(frame, frame->slots);
+		}
+		return;
+	}
+
 	va_list args;
 	va_start(args, format);
 	vfprintf(stderr, format, args);
@@ -43,15 +72,20 @@ static void runtime_error(const char *format, ...)
 		CallFrame *frame = &vm.frames[i];
 		ObjFunction *function = frame->closure->function;
 		// -1 because the IP is sitting on the next instruction to be
-		// executed.
-		size_t instructionOffset = frame->ip - function->chunk.code - 1;
-		int line = get_line(&function->chunk.lines, instructionOffset);
+		// executed, unless the frame started a module's code and will run the
+		// instruction that needed it again.
+		bool retrying = i + 1 < vm.frameCount && vm.frames[i + 1].closure->function->name == NULL;
+		size_t instructionOffset = frame->ip - function->chunk.code - (retrying ? 0 : 1);
+		int line = get_line(&function->chunk, instructionOffset);
 		fprintf(stderr, "[line %d] in ", line);
 		// fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-		if (function->name == NULL) {
+		if (function->name == NULL && function->module != vm.main) {
+			ObjString *path = function->module->path;
+			fprintf(stderr, "module '%.*s'\n", path->length, path->chars);
+		} else if (function->name == NULL) {
 			fprintf(stderr, "script\n");
 		} else {
-			fprintf(stderr, "%s()\n", function->name->chars);
+			fprintf(stderr, "%.*s()\n", function->name->length, function->name->chars);
 		}
 	}
 
@@ -67,20 +101,48 @@ static void define_native(const char *name, NativeFn function)
 	pop();
 }
 
-void init_vm()
+void init_vm(const Allocator *allocator)
 {
-	vm.stackCapacity = STACK_MAX;
-	vm.stack = NULL;
-	vm.stackTop = vm.stack;
-	reset_stack();
-	vm.objects = NULL;
+	init_heap(allocator);
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+	vm.remembered = NULL;
 	vm.bytesAllocated = 0;
 	vm.nextGC = 1024 * 1024;
+	vm.heapLimit = 0;
+	vm.outOfMemory = false;
+	vm.gcStepTime = 0;
+	vm.gcConcurrent = false;
+	vm.gcThreads = 1;
+	vm.gcCompact = false;
+	vm.compactDue = false;
+	vm.satbCount = 0;
+	vm.satbCapacity = 0;
+	vm.satb = NULL;
+	vm.gcPhase = GC_IDLE;
+	vm.loading = 0;
+	vm.nextStep = 0;
 	vm.grayCount = 0;
 	vm.grayCapacity = 0;
 	vm.grayStack = NULL;
+	vm.sources = NULL;
 	init_table(&vm.globals);
 	init_table(&vm.strings);
+	init_table(&vm.modules);
+	vm.main = NULL;
+	init_parser(&vm.parser);
+	vm.cache = false;
+	vm.evaluating = false;
+	vm.baseFrame = 0;
+	vm.frameLimit = FRAMES_MAX;
+	vm.fuel = UINT64_MAX;
+	vm.stackCapacity = STACK_MAX;
+	vm.stack = NULL;
+	vm.stackTop = vm.stack;
+	vm.openUpvalues = NULL;
+	reset_stack();
+	vm.main = new_module(NULL);
+	vm.main->state = MODULE_LOADED;
 	define_native("clock", clock_native);
 }
 
@@ -88,7 +150,13 @@ void free_vm()
 {
 	free_table(&vm.globals);
 	free_table(&vm.strings);
+	free_table(&vm.modules);
+	FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+	FREE_ARRAY(ObjUpvalue *, vm.openUpvalues, vm.stackCapacity);
+	vm.stack = NULL;
+	vm.openUpvalues = NULL;
 	free_objects();
+	free_sources();
 }
 
 void push(Value value)
@@ -96,9 +164,22 @@ void push(Value value)
 	int count = (int)(vm.stackTop - vm.stack);
 	if (count == vm.stackCapacity) {
 		int oldCapacity = vm.stackCapacity;
+		Value *oldStack = vm.stack;
 		vm.stackCapacity = GROW_CAPACITY(oldCapacity * FRAMES_MAX);
 		vm.stack = GROW_ARRAY(vm.stack, Value, oldCapacity, vm.stackCapacity);
 		vm.stackTop = vm.stack + count;
+		vm.openUpvalues = GROW_ARRAY(vm.openUpvalues, ObjUpvalue *, oldCapacity, vm.stackCapacity);
+		memset(vm.openUpvalues + oldCapacity, 0, sizeof(ObjUpvalue *) * (vm.stackCapacity - oldCapacity));
+
+		// Frames and open upvalues point into the stack, so move them along with it.
+		for (int i = 0; i < vm.frameCount; ++i) {
+			vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+		}
+		for (int i = 0; i < count; ++i) {
+			if (vm.openUpvalues[i] != NULL) {
+				vm.openUpvalues[i]->location = vm.stack + i;
+			}
+		}
 	}
 	*vm.stackTop = value;
 	vm.stackTop++;
@@ -126,16 +207,36 @@ static bool call(ObjClosure *closure, int argCount)
 		return false;
 	}
 
-	if (vm.frameCount == FRAMES_MAX) {
+	if (closure->function->source != NULL) {
+		begin_loading();
+		closure = AS_CLOSURE(vm.stackTop[-argCount - 1]);
+		bool compiled = compile_lazy(&vm.parser, closure->function);
+		end_loading();
+		if (!compiled) {
+			ObjString *name = closure->function->name;
+			runtime_error("Could not compile function '%.*s'.", name->length, name->chars);
+			return false;
+		}
+	}
+
+	if (vm.frameCount == vm.frameLimit) {
 		runtime_error("Stack overflow.");
 		return false;
 	}
 
+	if (vm.evaluating && --vm.fuel == 0) {
+		runtime_error("Out of fuel.");
+		return false;
+	}
+
 	CallFrame *frame = &vm.frames[vm.frameCount++];
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
 
 	frame->slots = vm.stackTop - argCount - 1;
+	frame->openUpvalueCount = 0;
+	frame->lowestOpenSlot = 0;
+	frame->highestOpenSlot = 0;
 	return true;
 }
 
@@ -163,40 +264,50 @@ static bool call_value(Value callee, int argCount)
 	return false;
 }
 
-static ObjUpvalue *capture_upvalue(Value *local)
+// Captures always happen in the running frame, so the frame only has to track
+// its open upvalues; `vm.openUpvalues` finds the one for a slot directly.
+static ObjUpvalue *capture_upvalue(CallFrame *frame, Value *local)
 {
-	ObjUpvalue *prevUpvalue = NULL;
-	ObjUpvalue *upvalue = vm.openUpvalues;
-
-	while (upvalue != NULL && upvalue->location > local) {
-		prevUpvalue = upvalue;
-		upvalue = upvalue->next;
-	}
-
-	if (upvalue != NULL && upvalue->location == local)
-		return upvalue;
+	ObjUpvalue **open = &vm.openUpvalues[local - vm.stack];
+	if (*open != NULL)
+		return *open;
 
 	ObjUpvalue *createdUpvalue = new_upvalue(local);
+	*open = createdUpvalue;
 
-	createdUpvalue->next = upvalue;
-
-	if (prevUpvalue == NULL) {
-		vm.openUpvalues = createdUpvalue;
-	} else {
-		prevUpvalue->next = createdUpvalue;
-	}
+	int slot = (int)(local - frame->slots);
+	if (frame->openUpvalueCount == 0 || slot < frame->lowestOpenSlot)
+		frame->lowestOpenSlot = slot;
+	if (frame->openUpvalueCount == 0 || slot > frame->highestOpenSlot)
+		frame->highestOpenSlot = slot;
+	frame->openUpvalueCount++;
 
 	return createdUpvalue;
 }
 
-static void close_upvalues(Value *last)
+static void close_upvalues(CallFrame *frame, Value *last)
 {
-	while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-		ObjUpvalue *upvalue = vm.openUpvalues;
-		upvalue->closed = *upvalue->location;
+	if (frame->openUpvalueCount == 0)
+		return;
+
+	int from = (int)(last - frame->slots);
+	Value *bottom = frame->slots + (from > frame->lowestOpenSlot ? from : frame->lowestOpenSlot);
+	Value *top = frame->slots + frame->highestOpenSlot;
+	for (Value *slot = top; frame->openUpvalueCount > 0 && slot >= bottom; slot--) {
+		ObjUpvalue **open = &vm.openUpvalues[slot - vm.stack];
+		if (*open == NULL)
+			continue;
+
+		ObjUpvalue *upvalue = *open;
+		write_value((Obj *)upvalue, &upvalue->closed, *upvalue->location);
 		upvalue->location = &upvalue->closed;
-		vm.openUpvalues = upvalue->next;
+		*open = NULL;
+		frame->openUpvalueCount--;
 	}
+
+	// Whatever is still open lies below `last`.
+	if (frame->openUpvalueCount > 0 && frame->highestOpenSlot >= from)
+		frame->highestOpenSlot = from - 1;
 }
 
 static bool is_falsey(Value value)
@@ -206,11 +317,11 @@ static bool is_falsey(Value value)
 
 static void concatenate()
 {
+	int length = AS_STRING(peek(0))->length + AS_STRING(peek(1))->length;
+	ObjString *string = make_young_string(length);
+	// Both may have moved.
 	ObjString *b = AS_STRING(peek(0));
 	ObjString *a = AS_STRING(peek(1));
-
-	int length = a->length + b->length;
-	ObjString *string = make_string(length);
 	memcpy(string->chars, a->chars, a->length);
 	memcpy(string->chars + a->length, b->chars, b->length);
 	string->chars[length] = '\0';
@@ -220,14 +331,167 @@ static void concatenate()
 	push(OBJ_VAL(result));
 }
 
-static InterpretResult run()
+// Joins strings with a single allocation, or sums numbers, in order.
+static bool add_many(int count)
 {
-	CallFrame *frame = &vm.frames[vm.frameCount - 1];
+	Value *operands = vm.stackTop - count;
+	Value result;
+
+	if (IS_STRING(operands[0])) {
+		int length = 0;
+		for (int i = 0; i < count; ++i) {
+			if (!IS_STRING(operands[i]))
+				return false;
+			length += AS_STRING(operands[i])->length;
+		}
+
+		ObjString *string = make_young_string(length);
+		char *chars = string->chars;
+		for (int i = 0; i < count; ++i) {
+			ObjString *operand = AS_STRING(operands[i]);
+			memcpy(chars, operand->chars, operand->length);
+			chars += operand->length;
+		}
+		*chars = '\0';
+		result = OBJ_VAL(hash_string(string));
+	} else {
+		double sum = 0;
+		for (int i = 0; i < count; ++i) {
+			if (!IS_NUMBER(operands[i]))
+				return false;
+			sum = i == 0 ? AS_NUMBER(operands[i]) : sum + AS_NUMBER(operands[i]);
+		}
+		result = NUMBER_VAL(sum);
+	}
+
+	vm.stackTop -= count;
+	push(result);
+	return true;
+}
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_LONG() (frame->ip += 3, (uint32_t)(frame->ip[-3] | (frame->ip[-2] << 8) | (frame->ip[-1] << 16)))
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (frame->closure->function->chunk.constants.values[READ_LONG()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+// Between instructions, the VM holds no object outside of its roots, so the
+// heap can be compacted there, and running out of it can be reported.
+#define SAFEPOINT()                                                                                                    \
+	do {                                                                                                               \
+		if (vm.compactDue)                                                                                             \
+			compact_heap();                                                                                            \
+		if (vm.outOfMemory) {                                                                                          \
+			vm.outOfMemory = false;                                                                                    \
+			runtime_error("Out of memory.");                                                                           \
+			return INTERPRET_RUNTIME_ERROR;                                                                            \
+		}                                                                                                              \
+	} while (false)
+
+static bool get_global(ObjString *name)
+{
+	Value value;
+	if (!table_get(&vm.globals, OBJ_VAL(name), &value)) {
+		runtime_error("Undefined variable '%.*s'.", name->length, name->chars);
+		return false;
+	}
+	push(value);
+	return true;
+}
+
+static bool set_global(ObjString *name)
+{
+	if (table_set(&vm.globals, OBJ_VAL(name), peek(0))) {
+		table_delete(&vm.globals, OBJ_VAL(name));
+		runtime_error("Undefined variable '%.*s'.", name->length, name->chars);
+		return false;
+	}
+	return true;
+}
+
+// The instruction that needed the module, `size` bytes long, runs again once
+// the module's code returns.
+static bool start_module(CallFrame *frame, ObjModule *module, int size)
+{
+	begin_loading();
+	ObjFunction *function = compile_module(module);
+	end_loading();
+	if (function == NULL) {
+		runtime_error("Could not compile module '%.*s'.", module->path->length, module->path->chars);
+		return false;
+	}
+
+	frame->ip -= size;
+	module->state = MODULE_RUNNING;
+	push(OBJ_VAL(function));
+	ObjClosure *closure = new_closure(function);
+	pop();
+	push(OBJ_VAL(closure));
+	return call(closure, 0);
+}
+
+static bool get_module(ModuleSlot *slot)
+{
+	ModuleValue *value = &slot->owner->values[slot->index];
+	if (!value->defined) {
+		runtime_error("Undefined variable '%.*s'.", value->name->length, value->name->chars);
+		return false;
+	}
+	push(value->value);
+	return true;
+}
+
+static bool set_module(ModuleSlot *slot)
+{
+	ModuleValue *value = &slot->owner->values[slot->index];
+	if (!value->defined) {
+		runtime_error("Undefined variable '%.*s'.", value->name->length, value->name->chars);
+		return false;
+	}
+	if (value->constant) {
+		runtime_error("Cannot assign to constant '%.*s'.", value->name->length, value->name->chars);
+		return false;
+	}
+	write_value((Obj *)slot->owner, &value->value, peek(0));
+	return true;
+}
+
+static void define_module(CallFrame *frame, uint32_t index)
+{
+	ModuleSlot *slot = &frame->closure->function->module->slots[index];
+	ModuleValue *value = &slot->owner->values[slot->index];
+	write_value((Obj *)slot->owner, &value->value, pop());
+	value->defined = true;
+}
+
+static void make_closure(CallFrame *frame, ObjFunction *function, bool wide)
+{
+	if (function->upvalueCount == 0) {
+		// Nothing to capture, so every instance would be identical.
+		if (function->closure == NULL) {
+			ObjClosure *closure = new_closure(function);
+			write_object((Obj *)function, (Obj **)&function->closure, (Obj *)closure);
+		}
+		push(OBJ_VAL(function->closure));
+		return;
+	}
+
+	push(OBJ_VAL(new_young_closure(function)));
+	for (int i = 0; i < function->upvalueCount; ++i) {
+		uint8_t isLocal = READ_BYTE();
+		uint32_t index = wide ? READ_LONG() : READ_BYTE();
+		ObjUpvalue *upvalue =
+			isLocal ? capture_upvalue(frame, frame->slots + index) : frame->closure->upvalues[index];
+		// Capturing may have moved the closure out of the nursery.
+		ObjClosure *closure = AS_CLOSURE(peek(0));
+		write_object((Obj *)closure, (Obj **)&closure->upvalues[i], (Obj *)upvalue);
+	}
+}
+
+static InterpretResult run()
+{
+	CallFrame *frame = &vm.frames[vm.frameCount - 1];
 
 #define BINARY_OP(valueType, op)                                                                                       \
 	do {                                                                                                               \
@@ -241,6 +505,19 @@ static InterpretResult run()
 		push(valueType(a op b));                                                                                       \
 	} while (false)
 
+#define MODULE_OP(access, index, size)                                                                                 \
+	do {                                                                                                               \
+		ModuleSlot *slot = &frame->closure->function->module->slots[index];                                            \
+		if (slot->owner->state == MODULE_UNLOADED) {                                                                   \
+			if (!start_module(frame, slot->owner, size)) {                                                             \
+				return INTERPRET_RUNTIME_ERROR;                                                                        \
+			}                                                                                                          \
+			frame = &vm.frames[vm.frameCount - 1];                                                                     \
+		} else if (!access(slot)) {                                                                                    \
+			return INTERPRET_RUNTIME_ERROR;                                                                            \
+		}                                                                                                              \
+	} while (false)
+
 	for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
 		printf("          ");
@@ -282,41 +559,41 @@ static InterpretResult run()
 			frame->slots[slot] = peek(0);
 			break;
 		}
-		case OP_GET_GLOBAL: {
-			ObjString *name = READ_STRING();
-			Value value;
-			if (!table_get(&vm.globals, OBJ_VAL(name), &value)) {
-				runtime_error("Undefined variable '%s'.", name->chars);
+		case OP_GET_GLOBAL:
+			if (!get_global(READ_STRING())) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(value);
 			break;
-		}
 		case OP_DEFINE_GLOBAL: {
 			ObjString *name = READ_STRING();
 			table_set(&vm.globals, OBJ_VAL(name), peek(0));
 			pop();
 			break;
 		}
-		case OP_SET_GLOBAL: {
-			ObjString *name = READ_STRING();
-			if (table_set(&vm.globals, OBJ_VAL(name), peek(0))) {
-				table_delete(&vm.globals, OBJ_VAL(name));
-				runtime_error("Undefined variable '%s'.", name->chars);
+		case OP_SET_GLOBAL:
+			if (!set_global(READ_STRING())) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
-		}
 		case OP_GET_UPVALUE: {
 			uint8_t slot = READ_BYTE();
 			push(*frame->closure->upvalues[slot]->location);
 			break;
 		}
 		case OP_SET_UPVALUE: {
-			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
+			ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+			write_value((Obj *)upvalue, upvalue->location, peek(0));
 			break;
 		}
+		case OP_GET_MODULE:
+			MODULE_OP(get_module, READ_BYTE(), 2);
+			break;
+		case OP_DEFINE_MODULE:
+			define_module(frame, READ_BYTE());
+			break;
+		case OP_SET_MODULE:
+			MODULE_OP(set_module, READ_BYTE(), 2);
+			break;
 		case OP_EQUAL: {
 			Value b = pop();
 			Value a = pop();
@@ -332,6 +609,7 @@ static InterpretResult run()
 		case OP_ADD: {
 			if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
 				concatenate();
+				SAFEPOINT();
 			} else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
 				double b = AS_NUMBER(pop());
 				double a = AS_NUMBER(pop());
@@ -342,6 +620,13 @@ static InterpretResult run()
 			}
 			break;
 		}
+		case OP_ADD_MANY:
+			if (!add_many(READ_BYTE())) {
+				runtime_error("Operands must be two numbers or two strings.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			SAFEPOINT();
+			break;
 		case OP_MULTIPLY:
 			BINARY_OP(NUMBER_VAL, *);
 			break;
@@ -402,76 +687,143 @@ static InterpretResult run()
 		}
 		case OP_LOOP: {
 			uint16_t offset = READ_SHORT();
+			// Errors here belong to the loop, not to the code it jumps back to.
+			if (vm.evaluating && --vm.fuel == 0) {
+				runtime_error("Out of fuel.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			SAFEPOINT();
 			frame->ip -= offset;
 			break;
 		}
 		case OP_CALL: {
 			int argCount = READ_BYTE();
+			SAFEPOINT();
 			if (!call_value(peek(argCount), argCount)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			frame = &vm.frames[vm.frameCount - 1];
 			break;
 		}
-		case OP_CLOSURE: {
-			ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure *closure = new_closure(function);
-			push(OBJ_VAL(closure));
-			for (int i = 0; i < closure->upvalueCount; ++i) {
-				uint8_t isLocal = READ_BYTE();
-				uint8_t index = READ_BYTE();
-				if (isLocal) {
-					closure->upvalues[i] = capture_upvalue(frame->slots + index);
-				} else {
-					closure->upvalues[i] = frame->closure->upvalues[index];
-				}
-			}
+		case OP_CLOSURE:
+			make_closure(frame, AS_FUNCTION(READ_CONSTANT()), false);
 			break;
-		}
 		case OP_CLOSE_UPVALUE:
-			close_upvalues(vm.stackTop - 1);
+			close_upvalues(frame, vm.stackTop - 1);
 			pop();
 			break;
-		case OP_CONSTANT_LONG: {
-			uint32_t index = READ_BYTE();
-			index |= READ_BYTE() << 8;
-			index |= READ_BYTE() << 16;
-			push(vm.chunk->constants.values[index]);
+		case OP_CONSTANT_LONG:
+			push(READ_CONSTANT_LONG());
+			break;
+		case OP_WIDE:
+			// The same instructions again, with 24-bit operands.
+			switch (READ_BYTE()) {
+			case OP_CONSTANT:
+				push(READ_CONSTANT_LONG());
+				break;
+			case OP_GET_LOCAL:
+				push(frame->slots[READ_LONG()]);
+				break;
+			case OP_SET_LOCAL:
+				frame->slots[READ_LONG()] = peek(0);
+				break;
+			case OP_GET_GLOBAL:
+				if (!get_global(READ_STRING_LONG())) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				break;
+			case OP_DEFINE_GLOBAL:
+				table_set(&vm.globals, OBJ_VAL(READ_STRING_LONG()), peek(0));
+				pop();
+				break;
+			case OP_SET_GLOBAL:
+				if (!set_global(READ_STRING_LONG())) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				break;
+			case OP_GET_UPVALUE:
+				push(*frame->closure->upvalues[READ_LONG()]->location);
+				break;
+			case OP_SET_UPVALUE: {
+				ObjUpvalue *upvalue = frame->closure->upvalues[READ_LONG()];
+				write_value((Obj *)upvalue, upvalue->location, peek(0));
+				break;
+			}
+			case OP_GET_MODULE:
+				MODULE_OP(get_module, READ_LONG(), 5);
+				break;
+			case OP_DEFINE_MODULE:
+				define_module(frame, READ_LONG());
+				break;
+			case OP_SET_MODULE:
+				MODULE_OP(set_module, READ_LONG(), 5);
+				break;
+			case OP_JUMP: {
+				uint32_t offset = READ_LONG();
+				frame->ip += offset;
+				break;
+			}
+			case OP_JUMP_IF_FALSE: {
+				uint32_t offset = READ_LONG();
+				if (is_falsey(peek(0)))
+					frame->ip += offset;
+				break;
+			}
+			case OP_LOOP: {
+				uint32_t offset = READ_LONG();
+				// Errors here belong to the loop, not to the code it jumps back to.
+				if (vm.evaluating && --vm.fuel == 0) {
+					runtime_error("Out of fuel.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				SAFEPOINT();
+				frame->ip -= offset;
+				break;
+			}
+			case OP_CLOSURE:
+				make_closure(frame, AS_FUNCTION(READ_CONSTANT_LONG()), true);
+				break;
+			}
 			break;
-		}
 		case OP_RETURN: {
 			Value result = pop();
 
-			close_upvalues(frame->slots);
+			close_upvalues(frame, frame->slots);
 
 			vm.frameCount--;
-			if (vm.frameCount == 0) {
-				return INTERPRET_OK;
-			}
-
 			vm.stackTop = frame->slots;
-
 			push(result);
+			if (vm.frameCount == vm.baseFrame) {
+				return INTERPRET_OK;
+			}
 
 			frame = &vm.frames[vm.frameCount - 1];
 			break;
 		}
+		case OP_END_MODULE:
+			close_upvalues(frame, frame->slots);
+			frame->closure->function->module->state = MODULE_LOADED;
+			vm.frameCount--;
+			vm.stackTop = frame->slots;
+			frame = &vm.frames[vm.frameCount - 1];
+			break;
 		}
 	}
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef READ_STRING
+#undef READ_STRING_LONG
+#undef SAFEPOINT
 #undef BINARY_OP
+#undef MODULE_OP
 }
 
-InterpretResult interpret(const char *source)
+static InterpretResult run_function(ObjFunction *function)
 {
-	ObjFunction *function = compile(source);
-	if (function == NULL)
-		return INTERPRET_COMPILE_ERROR;
-
 	push(OBJ_VAL(function));
 	ObjClosure *closure = new_closure(function);
 	pop();
@@ -480,3 +832,54 @@ InterpretResult interpret(const char *source)
 
 	return run();
 }
+
+bool evaluate_call(int argCount)
+{
+	int base = (int)(vm.stackTop - vm.stack) - argCount - 1;
+	bool evaluating = vm.evaluating;
+	int baseFrame = vm.baseFrame;
+	int frameLimit = vm.frameLimit;
+	uint64_t fuel = vm.fuel;
+
+	vm.evaluating = true;
+	vm.baseFrame = vm.frameCount;
+	vm.frameLimit = vm.frameCount + EVAL_FRAMES_MAX < FRAMES_MAX ? vm.frameCount + EVAL_FRAMES_MAX : FRAMES_MAX;
+	vm.fuel = EVAL_FUEL;
+	bool done = call(AS_CLOSURE(vm.stack[base]), argCount) && run() == INTERPRET_OK;
+
+	vm.evaluating = evaluating;
+	vm.baseFrame = baseFrame;
+	vm.frameLimit = frameLimit;
+	vm.fuel = fuel;
+	if (!done)
+		vm.stackTop = vm.stack + base;
+	return done;
+}
+
+InterpretResult interpret(const char *source)
+{
+	begin_loading();
+	declare_module(vm.main, source);
+	vm.parser.module = vm.main;
+	vm.parser.borrowStrings = false;
+	ObjFunction *function = compile(&vm.parser, source);
+	end_loading();
+	if (function == NULL)
+		return INTERPRET_COMPILE_ERROR;
+
+	return run_function(function);
+}
+
+InterpretResult interpret_source(Source *source)
+{
+	begin_loading();
+	vm.main->path = copy_string(source->path, (int)strlen(source->path));
+	vm.main->source = source;
+	declare_module(vm.main, source->chars);
+	ObjFunction *function = compile_module(vm.main);
+	end_loading();
+	if (function == NULL)
+		return INTERPRET_COMPILE_ERROR;
+
+	return run_function(function);
+}
@@ -0,0 +1,18 @@
+#!/bin/bash
+# usage: repl-import.sh <emo>
+# A module path that a REPL line has already used as a string literal, which
+# borrows its characters from the source, must still be read as a file.
+
+emo="$(realpath "$1")"
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+printf 'let name = "b.emo";\nfn hello() { return name; }\n' > "${dir}/a.emo"
+echo 'let bee = 2;' > "${dir}/b.emo"
+
+cd "${dir}" || exit 1
+output=$(printf 'import "a.emo";\nprint(hello());\nimport "b.emo";\nprint(bee);\n' | "${emo}" --no-cache 2>&1)
+if ! grep -qx 2 <<< "${output}"; then
+	echo "${output}"
+	exit 1
+fi
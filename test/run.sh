@@ -0,0 +1,9 @@
+#!/bin/bash
+# usage: run.sh <emo> <script> [flags...]
+# Runs the script and compares what it prints with the .out file next to it.
+
+emo="$1"
+script="$2"
+shift 2
+
+diff -u "${script%.emo}.out" <("${emo}" --no-cache "$@" "${script}" 2>&1)
@@ -0,0 +1,18 @@
+#!/bin/bash
+# usage: stale-cache.sh <emo>
+# A module that turns a variable into a constant must invalidate the cached
+# code of the modules that assign to it.
+
+emo="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "${dir}"' EXIT
+
+echo 'let limit = 1;' > "${dir}/a.emo"
+printf 'import "a.emo";\nlimit = 2;\nprint(limit);\n' > "${dir}/b.emo"
+[ "$("${emo}" "${dir}/b.emo" 2>&1)" = "2" ] || exit 1
+
+echo 'const limit = 1;' > "${dir}/a.emo"
+if "${emo}" "${dir}/b.emo" > /dev/null 2>&1; then
+	echo "assigned to a constant through a stale cache"
+	exit 1
+fi